@@ -15,6 +15,8 @@ void gettimeofday(struct timeval* tv, const void* unusedTimezone);
 #endif
 
 static struct Server server = {0};
+/* the optional second argument is a tar file served under /archive/ */
+static struct ArchiveDocumentRoot* archive = NULL;
 
 static THREAD_RETURN_TYPE STDCALL_ON_WIN32 stopAcceptingConnections(void* u) {
     serverStop(&server);
@@ -22,6 +24,7 @@ static THREAD_RETURN_TYPE STDCALL_ON_WIN32 stopAcceptingConnections(void* u) {
 }
 
 static void writeDemoFiles();
+static long hitCounterIncrement(struct Server* server);
 
 int main(int argc, const char * argv[]) {
     uint16_t port = 8080;
@@ -33,10 +36,41 @@ int main(int argc, const char * argv[]) {
     printf("Running unit tests...\n");
     EWSUnitTestsRun();
     printf("Unit tests passed. Accepting connections from everywhere...\n");
+    /* so the /status page has something to show */
+    OptionLockStatistics = true;
+    /* the JSON endpoints are polled and mostly return the same thing */
+    OptionETagsForGeneratedResponses = true;
+    /* show which routes hold the heap on /status */
+    OptionAllocationProfile = true;
+    /* browsers don't half-close, so a closed socket means nobody will read the response */
+    OptionSkipResponseIfPeerClosed = true;
     serverInit(&server);
+    /* keep the status page snappy while someone downloads a lot of random numbers */
+    serverSetPathPriority(&server, "/status", ConnectionPriorityControl);
+    serverSetPathPriority(&server, "/random_streaming", ConnectionPriorityBulk);
+    serverSetPathPriority(&server, "/random_fd", ConnectionPriorityBulk);
+    /* these only read the server's own thread-safe state so a batch can run them at once */
+    serverSetPathParallelBatching(&server, "/json_status_example");
+    serverSetPathParallelBatching(&server, "/json_heavy_hitters");
+    serverSetPathParallelBatching(&server, "/connections.json");
+    /* trace every 10th request for /trace.json */
+    server.traceSampleEvery = 10;
+    /* print a breakdown of anything slower than a quarter second, like the bandwidth limited downloads */
+    server.slowRequestLogMilliseconds = 250;
+    /* watch the server with ./EWSStats /ews-8080 */
+    char statsName[32];
+    snprintf(statsName, sizeof(statsName), "/ews-%u", (unsigned) port);
+    serverStatsSharedMemoryPublish(&server, statsName, 1000);
     writeDemoFiles();
+    documentRootWarmInBackground("EWSDemoFiles");
+    if (argc > 2) {
+        archive = archiveDocumentRootOpen(argv[2]);
+    }
     acceptConnectionsUntilStoppedFromEverywhereIPv4(&server, port);
     serverDeInit(&server);
+    if (NULL != archive) {
+        archiveDocumentRootClose(archive);
+    }
     return 0;
 }
 
@@ -48,7 +82,11 @@ struct Response* createResponseForRequest(const struct Request* request, struct
     }
     /* Here's an example of how to return a regular dynamic web page */
     if (request->path == strstr(request->path, "/status")) {
-        return responseAllocWithFormat(200, "OK", "text/html; charset=UTF-8", "<html><title>Server Stats Page Example</title>"
+        connectionSetRouteTag(connection, "status");
+        struct HeapString lockStatistics = serverLockStatisticsStringCreate(connection->server);
+        struct HeapString tcpInfo = serverTCPInfoStringCreate(connection->server);
+        struct HeapString allocationProfile = allocationProfileStringCreate(10);
+        struct Response* response = responseAllocWithFormat(200, "OK", "text/html; charset=UTF-8", "<html><title>Server Stats Page Example</title>"
                                        "Here are some basic measurements and status indicators for this server<br>"
                                        "<table border=\"1\">\n"
                                        "<tr><td>Active connections</td><td>%" PRId64 "</td></tr>\n"
@@ -59,7 +97,12 @@ struct Response* createResponseForRequest(const struct Request* request, struct
                                        "<tr><td>Heap string reallocations</td><td>%" PRId64 "</td></tr>\n"
                                        "<tr><td>Heap string frees</td><td>%" PRId64 "</td></tr>\n"
                                        "<tr><td>Heap string total bytes allocated</td><td>%" PRId64 "</td></tr>\n"
-                                       "</table></html>",
+                                       "<tr><td>Responses not sent because the client hung up</td><td>%" PRId64 "</td></tr>\n"
+                                       "<tr><td>404s answered from the missing path cache</td><td>%" PRId64 "</td></tr>\n"
+                                       "</table>\n"
+                                       "<h3>Lock contention</h3><pre>%s</pre>"
+                                       "<h3>Network (TCP_INFO)</h3><pre>%s</pre>"
+                                       "<h3>Heap by route</h3><pre>%s</pre></html>",
                                        counters.activeConnections,
                                        counters.totalConnections,
                                        counters.bytesSent,
@@ -67,7 +110,16 @@ struct Response* createResponseForRequest(const struct Request* request, struct
                                        counters.heapStringAllocations,
                                        counters.heapStringReallocations,
                                        counters.heapStringFrees,
-                                       counters.heapStringTotalBytesReallocated);
+                                       counters.heapStringTotalBytesReallocated,
+                                       counters.responsesForClosedConnections,
+                                       counters.missingPathCacheHits,
+                                       lockStatistics.contents,
+                                       tcpInfo.contents,
+                                       allocationProfile.contents);
+        heapStringFreeContents(&lockStatistics);
+        heapStringFreeContents(&tcpInfo);
+        heapStringFreeContents(&allocationProfile);
+        return response;
     }
     /* This is the home page of the demo, which links to various things */
     if (0 == strcmp(request->path, "/")) {
@@ -81,10 +133,16 @@ struct Response* createResponseForRequest(const struct Request* request, struct
                                                             "<a href=\"/status\">Server Status</a><br>"
                                                             "<a href=\"/index.html\">Serve files like a regular web server</a><br>"
                                                             "<a href=\"/random_streaming\">Chunked Streaming / Custom Connection Handling</a><br>"
+                                                            "<a href=\"/random_fd\">Streaming from a file descriptor</a> (<a href=\"/random_fd?bytes_per_second=100000\">at 100KB/s</a>)<br>"
                                                             "<a href=\"/form_post_demo\">HTML Form POST Demo</a><br>"
                                                             "<a href=\"/form_get_demo\">HTML Form GET Demo</a><br>"
                                                             "<a href=\"/json_status_example\">JSON status example</a><br>"
                                                             "<a href=\"/json_hit_counter\">JSON hit counter</a><br>"
+                                                            "<a href=\"/json_heavy_hitters\">Busiest clients and paths (JSON)</a><br>"
+                                                            "<a href=\"/connections\">Open connections</a> (<a href=\"/connections.json\">JSON</a>)<br>"
+                                                            "<a href=\"/trace.json\">Request traces</a> (open in <a href=\"https://ui.perfetto.dev\">Perfetto</a>)<br>"
+                                                            "<a href=\"/profile?seconds=5\">Profile the CPU for 5 seconds</a> (folded stacks for flamegraph.pl)<br>"
+                                                            "<a href=\"/batch?paths=/json_status_example,/json_hit_counter,/about\">Three requests in one round trip</a><br>"
                                                             "<a href=\"/html_hit_counter\">HTML hit counter</a><br>"
                                                             "<a href=\"/about\">About</a><br>"
                                                             "<h2>Connection Debug Info</h2><pre>%s</pre>"
@@ -187,7 +245,13 @@ struct Response* createResponseForRequest(const struct Request* request, struct
         free(delayTimeString);
         struct timeval startSleep, endSleep;
         gettimeofday(&startSleep, NULL);
-        usleep(delayTime * 1000);
+        /* sleep in small steps so we can stop early if the browser gives up on us */
+        int remainingMilliseconds = delayTime;
+        while (remainingMilliseconds > 0 && !connectionPeerClosed(connection)) {
+            int sleepMilliseconds = MIN(remainingMilliseconds, 100);
+            usleep(sleepMilliseconds * 1000);
+            remainingMilliseconds -= sleepMilliseconds;
+        }
         gettimeofday(&endSleep, NULL);
         
         int64_t startSleepMicroseconds = ((startSleep.tv_sec * 1000 * 1000) + startSleep.tv_usec);
@@ -201,11 +265,67 @@ struct Response* createResponseForRequest(const struct Request* request, struct
         return response;
     }
     
+    /* /profile?seconds=10&samples_per_second=99 */
+    if (request->path == strstr(request->path, "/profile")) {
+        char* secondsDecoded = strdupDecodeGETParam("seconds=", request, "5");
+        char* samplesPerSecondDecoded = strdupDecodeGETParam("samples_per_second=", request, "99");
+        int seconds = 0;
+        int samplesPerSecond = 0;
+        sscanf(secondsDecoded, "%d", &seconds);
+        sscanf(samplesPerSecondDecoded, "%d", &samplesPerSecond);
+        free(secondsDecoded);
+        free(samplesPerSecondDecoded);
+        if (seconds <= 0 || seconds > 60) {
+            return responseAlloc400BadRequestHTML("Profile for 1-60 seconds");
+        }
+        struct HeapString folded = profilerFoldedStacksCreate(seconds, samplesPerSecond);
+        struct Response* response = responseAllocWithFormat(200, "OK", "text/plain; charset=UTF-8", "%s", NULL != folded.contents ? folded.contents : "");
+        heapStringFreeContents(&folded);
+        return response;
+    }
+    
+    if (0 == strcmp(request->path, "/trace.json")) {
+        struct HeapString trace = serverTraceChromeJSONCreate(connection->server);
+        struct Response* response = responseAllocJSON(trace.contents);
+        heapStringFreeContents(&trace);
+        return response;
+    }
+    
+    if (0 == strcmp(request->path, "/json_heavy_hitters")) {
+        struct HeapString heavyHitters = serverHeavyHittersJSONCreate(connection->server);
+        struct Response* response = responseAllocJSON(heavyHitters.contents);
+        heapStringFreeContents(&heavyHitters);
+        return response;
+    }
+    
+    if (0 == strcmp(request->path, "/connections")) {
+        connectionSetRouteTag(connection, "status");
+        struct HeapString connections = serverConnectionsHTMLCreate(connection->server);
+        struct Response* response = responseAllocHTML("<html><head><title>Open connections</title><meta http-equiv=\"refresh\" content=\"1\"></head><body>\n");
+        heapStringAppendString(&response->body, connections.contents);
+        heapStringAppendString(&response->body, "</body></html>");
+        heapStringFreeContents(&connections);
+        return response;
+    }
+    
+    if (0 == strcmp(request->path, "/connections.json")) {
+        connectionSetRouteTag(connection, "status");
+        struct HeapString connections = serverConnectionsJSONCreate(connection->server);
+        struct Response* response = responseAllocJSON(connections.contents);
+        heapStringFreeContents(&connections);
+        return response;
+    }
+    
+    /* GET /batch?paths=/a,/b or POST the paths one per line */
+    if (0 == strncmp(request->path, "/batch", strlen("/batch")) && ('\0' == request->path[strlen("/batch")] || '?' == request->path[strlen("/batch")])) {
+        return responseAllocBatchedSubRequests(connection, request, true);
+    }
+    
     if (0 == strcmp(request->path, "/json_status_example"))
     {
         /* advanced JSON support - we could have used responseAllocWithFormat but
          I wanted to show it's easy to use regular C strings */
-        char jsonStatus[512];
+        char jsonStatus[1024];
         sprintf(jsonStatus, "{\n"
                 "\t\"active_connections\" : %" PRId64 ",\n"
                 "\t\"total_connections\" : %" PRId64 ",\n"
@@ -214,7 +334,9 @@ struct Response* createResponseForRequest(const struct Request* request, struct
                 "\t\"heap_string_allocations\" : %" PRId64 ",\n"
                 "\t\"heap_string_reallocations\" : %" PRId64 ",\n"
                 "\t\"heap_string_frees\" : %" PRId64 ",\n"
-                "\t\"heap_string_total_bytes_allocated\" : %" PRId64 "\n"
+                "\t\"heap_string_total_bytes_allocated\" : %" PRId64 ",\n"
+                "\t\"responses_for_closed_connections\" : %" PRId64 ",\n"
+                "\t\"missing_path_cache_hits\" : %" PRId64 "\n"
                 "}",
                 counters.activeConnections,
                 counters.totalConnections,
@@ -223,7 +345,9 @@ struct Response* createResponseForRequest(const struct Request* request, struct
                 counters.heapStringAllocations,
                 counters.heapStringReallocations,
                 counters.heapStringFrees,
-                counters.heapStringTotalBytesReallocated);
+                counters.heapStringTotalBytesReallocated,
+                counters.responsesForClosedConnections,
+                counters.missingPathCacheHits);
         struct Response* response = responseAllocWithFormat(200, "OK", "application/json", "%s" , jsonStatus);
         return response;
     }
@@ -233,34 +357,14 @@ struct Response* createResponseForRequest(const struct Request* request, struct
     }
 
     if (request->path == strstr(request->path, "/json_hit_counter")) {
-        serverMutexLock(connection->server);
-        long count = 0;
-        FILE* fp = fopen("EWSDemoFiles/hitcounter.txt", "rb");
-        if (NULL != fp) {
-            fscanf(fp, "%ld", &count);
-            fclose(fp);
-        }
-        count++;
-        fp = fopen("EWSDemoFiles/hitcounter.txt", "wb");
-        fprintf(fp, "%ld", count);
-        fclose(fp);
-        serverMutexUnlock(connection->server);
+        connectionSetRouteTag(connection, "hit_counter");
+        long count = hitCounterIncrement(connection->server);
         return responseAllocJSONWithFormat("{ \"hits\" : %ld }", count);
     }
 
     if (request->path == strstr(request->path, "/html_hit_counter")) {
-        serverMutexLock(connection->server);
-        long count = 0;
-        FILE* fp = fopen("EWSDemoFiles/hitcounter.txt", "rb");
-        if (NULL != fp) {
-            fscanf(fp, "%ld", &count);
-            fclose(fp);
-        }
-        count++;
-        fp = fopen("EWSDemoFiles/hitcounter.txt", "wb");
-        fprintf(fp, "%ld", count);
-        fclose(fp);
-        serverMutexUnlock(connection->server);
+        connectionSetRouteTag(connection, "hit_counter");
+        long count = hitCounterIncrement(connection->server);
         return responseAllocHTMLWithFormat("<html><head><title>Hit Counter</title></head><body>"
             "<a href=\"/\">Home</a><br>"
             "Hit counters were popular on web pages in the late 1990s + early 2000s. Every time someone loaded your web page the hit counter would increase. People had lots of different styles of hit counter with rolling images and animations. It was fun.<br>"
@@ -289,7 +393,7 @@ struct Response* createResponseForRequest(const struct Request* request, struct
             return responseAlloc400BadRequestHTML("You specified a bad size_in_bytes. It needs to be positive");
         }
         size_t randomBytesSent = 0;
-        while (randomBytesSent < sizeInBytes) {
+        while (randomBytesSent < sizeInBytes && !connectionPeerClosed(connection)) {
             size_t bytesToSend = MIN(sizeof(connection->sendRecvBuffer), sizeInBytes - randomBytesSent);
             fread(connection->sendRecvBuffer, 1, bytesToSend, randomfp);
             char chunkTerminationAndHeader[20];
@@ -303,12 +407,59 @@ struct Response* createResponseForRequest(const struct Request* request, struct
         return NULL;
     }
 
+#ifndef WIN32
+    /* The same thing without taking over the connection - the server moves the bytes from the fd to the socket */
+    if (request->path == strstr(request->path, "/random_fd")) {
+        char* sizeInBytesDecoded = strdupDecodeGETParam("size_in_bytes=", request, "1000000");
+        long sizeInBytes = 0;
+        sscanf(sizeInBytesDecoded, "%ld", &sizeInBytes);
+        free(sizeInBytesDecoded);
+        if (sizeInBytes <= 0) {
+            return responseAlloc400BadRequestHTML("You specified a bad size_in_bytes. It needs to be positive");
+        }
+        /* try ?bytes_per_second=100000 */
+        char* bytesPerSecondDecoded = strdupDecodeGETParam("bytes_per_second=", request, "0");
+        long bytesPerSecond = 0;
+        sscanf(bytesPerSecondDecoded, "%ld", &bytesPerSecond);
+        free(bytesPerSecondDecoded);
+        connectionSetBandwidthLimit(connection, bytesPerSecond, NULL);
+        connectionSetRouteTag(connection, "random_fd");
+        int randomfd = open("/dev/urandom", O_RDONLY);
+        if (randomfd < 0) {
+            return responseAlloc500InternalErrorHTML("The server operating system did not let us open /dev/urandom");
+        }
+        return responseAllocWithFileDescriptor(randomfd, sizeInBytes, "application/binary", true);
+    }
+#endif
+
+    if (NULL != archive && request->pathDecoded == strstr(request->pathDecoded, "/archive")) {
+        return responseAllocServeFileFromArchive("/archive", request, archive);
+    }
+
+    connectionSetRouteTag(connection, "files");
     return responseAllocServeFileFromRequestPath("/", request->path, request->pathDecoded, "EWSDemoFiles");
 }
 
 #define MASK(high, low) ((1 << (high - low + 1)) - 1)
 #define BITS(value, high, low) ((value >> low) & MASK(high, low))
 
+/* The count is kept in a file so it survives restarts */
+static long hitCounterIncrement(struct Server* server) {
+    serverMutexLock(server);
+    long count = 0;
+    FILE* fp = fopen("EWSDemoFiles/hitcounter.txt", "rb");
+    if (NULL != fp) {
+        fscanf(fp, "%ld", &count);
+        fclose(fp);
+    }
+    count++;
+    fp = fopen("EWSDemoFiles/hitcounter.txt", "wb");
+    fprintf(fp, "%ld", count);
+    fclose(fp);
+    serverMutexUnlock(server);
+    return count;
+}
+
 static void fput_utf8_c(FILE* fp, uint32_t c) {
     if (c >= 0x10000) {
         fputc(0xf0 | BITS(c, 20, 18), fp);
@@ -1,9 +1,8 @@
 #define EWS_FUZZ_TEST 1
-#include "../EmbeddableWebServer.h"
+#include "EmbeddableWebServer.h"
 
 struct Server server;
 int main(int argc, const char* argv[]) {
-    printf("%d\n", RequestParseStateBadRequest);
     serverInit(&server);
     struct Connection* connection = connectionAlloc(&server);
     struct sockaddr_in* simulated = (struct sockaddr_in*) &connection->remoteAddr;
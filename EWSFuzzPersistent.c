@@ -0,0 +1,155 @@
+/* An in-process fuzzer for requestParse and the response path. EWSFuzz.c runs a whole connection per process, which
+ is slow for afl. This keeps one Connection around, resets it for every input and feeds the input to requestParse in
+ fragments picked by the first byte (byte at a time, small chunks, big chunks or all at once) since that's where parsers
+ break. If the request parses, your handler runs and the response is sent to /dev/null.
+ libFuzzer:   clang -g -O1 -fsanitize=fuzzer,address -o EWSFuzzPersistent EWSFuzzPersistent.c -lpthread
+              ./EWSFuzzPersistent corpus/
+ AFL++:       afl-clang-fast -g -o EWSFuzzPersistent EWSFuzzPersistent.c -lpthread
+              afl-fuzz -i corpus -o findings ./EWSFuzzPersistent
+ Reproduce:   cc -g -DEWS_FUZZ_STANDALONE -DEWS_FUZZ_VERBOSE -o EWSFuzzPersistent EWSFuzzPersistent.c -lpthread
+              ./EWSFuzzPersistent crash-1234 */
+#define EWS_FUZZ_TEST 1
+#define EWS_FUZZ_OUTPUT_FD fuzzOutputFD
+#ifndef EWS_FUZZ_VERBOSE
+/* printing a warning for every bad request would be most of the run time */
+#define ews_printf(...)
+#endif
+static int fuzzOutputFD = -1;
+#include "EmbeddableWebServer.h"
+
+static struct Server fuzzServer;
+static struct Connection* fuzzConnection;
+/* the state of fuzzConnection before the first input. Every input starts from here */
+static struct Connection* fuzzConnectionPristine;
+
+static void fuzzInit() {
+    fuzzOutputFD = open("/dev/null", O_WRONLY);
+    serverInit(&fuzzServer);
+    fuzzConnection = connectionAlloc(&fuzzServer);
+    fuzzConnection->socketfd = fuzzOutputFD;
+    strcpy(fuzzConnection->remoteHost, "127.0.0.1");
+    strcpy(fuzzConnection->remotePort, "8080");
+    fuzzConnectionPristine = (struct Connection*) malloc(sizeof(*fuzzConnectionPristine));
+    memcpy(fuzzConnectionPristine, fuzzConnection, sizeof(*fuzzConnection));
+}
+
+static void fuzzConnectionReset(struct Connection* connection) {
+    heapStringFreeContents(&connection->request.body);
+    memcpy(connection, fuzzConnectionPristine, sizeof(*connection));
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    if (NULL == fuzzConnection) {
+        fuzzInit();
+    }
+    if (0 == size) {
+        return 0;
+    }
+    fuzzConnectionReset(fuzzConnection);
+    /* the first byte picks the fragment sizes, the rest is the request */
+    uint8_t control = data[0];
+    const char* request = (const char*) data + 1;
+    size_t requestLength = size - 1;
+    const size_t maximumFragmentLengths[] = {1, 7, 64, SEND_RECV_BUFFER_SIZE};
+    size_t maximumFragmentLength = maximumFragmentLengths[control & 3];
+    /* xorshift seeded from the control byte so an input always splits the same way */
+    uint32_t random = 0x9e3779b9u ^ ((uint32_t) control * 0x01000193u);
+    size_t offset = 0;
+    bool foundRequest = false;
+    while (offset < requestLength) {
+        random ^= random << 13;
+        random ^= random >> 17;
+        random ^= random << 5;
+        size_t fragmentLength = 1 + random % maximumFragmentLength;
+        if (fragmentLength > requestLength - offset) {
+            fragmentLength = requestLength - offset;
+        }
+        /* the same as connectionHandlerThread: the bytes come through sendRecvBuffer */
+        memcpy(fuzzConnection->sendRecvBuffer, request + offset, fragmentLength);
+        fuzzConnection->status.bytesReceived += (int64_t) fragmentLength;
+        requestParse(&fuzzConnection->request, fuzzConnection->sendRecvBuffer, fragmentLength);
+        offset += fragmentLength;
+        if (RequestParseStateDone == fuzzConnection->request.state) {
+            foundRequest = true;
+            break;
+        }
+    }
+    /* a request that ran out in the body still gets a response so different Content-Lengths are fuzzed too */
+    if (RequestParseStateBody == fuzzConnection->request.state) {
+        foundRequest = true;
+    }
+    if (foundRequest) {
+        connectionRespond(fuzzConnection);
+    }
+    return 0;
+}
+
+/* Hits the parameter decoding, the escaping and the different kinds of responses */
+struct Response* createResponseForRequest(const struct Request* request, struct Connection* connection) {
+    if (0 == strncmp(request->path, "/files", strlen("/files"))) {
+        return responseAllocServeFileFromRequestPath("/files", request->path, request->pathDecoded, "fuzz-test-document-root");
+    }
+    if (0 == strncmp(request->path, "/batch", strlen("/batch"))) {
+        return responseAllocBatchedSubRequests(connection, request, false);
+    }
+    if (0 == strcmp(request->method, "POST")) {
+        char* message = strdupDecodePOSTParam("message=", request, "");
+        char* escapedMessage = strdupEscapeForHTML(message);
+        struct Response* response = responseAllocHTMLWithFormat("<html><body>%s</body></html>", escapedMessage);
+        free(escapedMessage);
+        free(message);
+        return response;
+    }
+    char* name = strdupDecodeGETParam("name=", request, "nobody");
+    struct Response* response = responseAllocJSON("");
+    heapStringAppendString(&response->body, "{\"name\":");
+    heapStringAppendJSONString(&response->body, name, strlen(name));
+    heapStringAppendChar(&response->body, '}');
+    free(name);
+    const struct Header* header = headerInRequest("Accept-Encoding", request);
+    if (NULL != header) {
+        responseAppendSegment(response, header->value.contents, header->value.length, NULL, NULL);
+    }
+    return response;
+}
+
+#if defined(__AFL_FUZZ_TESTCASE_LEN)
+__AFL_FUZZ_INIT();
+int main(int argc, const char* argv[]) {
+    __AFL_INIT();
+    const unsigned char* buffer = __AFL_FUZZ_TESTCASE_BUF;
+    while (__AFL_LOOP(100000)) {
+        LLVMFuzzerTestOneInput(buffer, (size_t) __AFL_FUZZ_TESTCASE_LEN);
+    }
+    return 0;
+}
+#elif defined(EWS_FUZZ_STANDALONE)
+/* Runs each file named on the command line, or stdin */
+int main(int argc, const char* argv[]) {
+    for (int i = argc > 1 ? 1 : 0; i < argc; i++) {
+        FILE* fp = argc > 1 ? fopen(argv[i], "rb") : stdin;
+        if (NULL == fp) {
+            fprintf(stderr, "Could not open '%s'\n", argv[i]);
+            return 1;
+        }
+        /* inputs have NULs in them so no HeapStrings */
+        size_t inputLength = 0;
+        size_t inputCapacity = 4096;
+        uint8_t* input = (uint8_t*) malloc(inputCapacity);
+        size_t bytesRead;
+        while ((bytesRead = fread(input + inputLength, 1, inputCapacity - inputLength, fp)) > 0) {
+            inputLength += bytesRead;
+            if (inputLength == inputCapacity) {
+                inputCapacity *= 2;
+                input = (uint8_t*) realloc(input, inputCapacity);
+            }
+        }
+        if (stdin != fp) {
+            fclose(fp);
+        }
+        LLVMFuzzerTestOneInput(input, inputLength);
+        free(input);
+    }
+    return 0;
+}
+#endif
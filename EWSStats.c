@@ -0,0 +1,158 @@
+/* A top-like live view of a server that called serverStatsSharedMemoryPublish. It only maps the shared memory segment
+ read-only so watching a struggling server doesn't add to its load. Run it as the server's user, the segment is 0600.
+ cc -o EWSStats EWSStats.c -lpthread (add -lrt on glibc before 2.34)
+ ./EWSStats /ews-8080 [refresh milliseconds] */
+/* just the StatsSegment layout, none of the server */
+#define EWS_STATS_SEGMENT_ONLY
+#include "EmbeddableWebServer.h"
+
+static const char* connectionStateNames[] = {"reading headers", "reading body", "in handler", "sending"};
+
+/* The same percentile as the server's /status: the top of the power of 2 bucket it lands in, -1 without samples */
+static int64_t histogramPercentile(const int64_t* histogram, int64_t samples, int percentile) {
+    if (samples <= 0) {
+        return -1;
+    }
+    int64_t target = (samples * percentile + 99) / 100;
+    int64_t seen = 0;
+    for (int bucket = 0; bucket < TCP_INFO_HISTOGRAM_BUCKETS; bucket++) {
+        seen += histogram[bucket];
+        if (seen >= target) {
+            return bucket >= 63 ? INT64_MAX : ((int64_t) 1 << bucket) - 1;
+        }
+    }
+    return -1;
+}
+
+/* Returns 0 with a consistent copy in snapshot, 1 if the publisher kept writing (or hasn't published yet) */
+static int statsSegmentRead(const struct StatsSegment* segment, struct StatsSegment* snapshot) {
+    for (int attempt = 0; attempt < 100; attempt++) {
+        int64_t sequenceBefore = __atomic_load_n(&segment->sequence, __ATOMIC_ACQUIRE);
+        if (0 == sequenceBefore || 0 != (sequenceBefore & 1)) {
+            usleep(1000);
+            continue;
+        }
+        memcpy(snapshot, segment, sizeof(*snapshot));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (sequenceBefore == __atomic_load_n(&segment->sequence, __ATOMIC_RELAXED)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void formatBytes(char* buffer, size_t bufferSize, double bytes) {
+    const char* units[] = {"B", "KB", "MB", "GB", "TB"};
+    int unit = 0;
+    while (bytes >= 1024 && unit < 4) {
+        bytes /= 1024;
+        unit++;
+    }
+    snprintf(buffer, bufferSize, "%.1f%s", bytes, units[unit]);
+}
+
+static void statsPrint(const char* name, const struct StatsSegment* stats, const struct StatsSegment* previous, double elapsedSeconds) {
+    char sent[32], received[32], sentRate[32], receivedRate[32];
+    formatBytes(sent, sizeof(sent), (double) stats->bytesSent);
+    formatBytes(received, sizeof(received), (double) stats->bytesReceived);
+    double connectionsPerSecond = 0;
+    if (NULL != previous && elapsedSeconds > 0) {
+        formatBytes(sentRate, sizeof(sentRate), (double) (stats->bytesSent - previous->bytesSent) / elapsedSeconds);
+        formatBytes(receivedRate, sizeof(receivedRate), (double) (stats->bytesReceived - previous->bytesReceived) / elapsedSeconds);
+        connectionsPerSecond = (double) (stats->totalConnections - previous->totalConnections) / elapsedSeconds;
+    } else {
+        strcpy(sentRate, "-");
+        strcpy(receivedRate, "-");
+    }
+    int64_t ageSeconds = (int64_t) time(NULL) - stats->publishedUnixSeconds;
+    /* clear the screen and go home */
+    printf("\033[H\033[2J");
+    printf("%s  pid %" PRId64 "  published every %" PRId64 "ms, %" PRId64 " times", name, stats->publisherProcessID, stats->publishIntervalMilliseconds, stats->publishes);
+    if (ageSeconds * 1000 > 3 * stats->publishIntervalMilliseconds + 1000) {
+        printf("  STALE: last published %" PRId64 "s ago", ageSeconds);
+    }
+    printf("\n\n");
+    printf("Connections  %" PRId64 " active, %" PRId64 " total, %.1f/s, %" PRId64 " control requests in flight\n",
+        stats->activeConnections, stats->totalConnections, connectionsPerSecond, stats->controlRequestsInFlight);
+    printf("             %" PRId64 " reading headers, %" PRId64 " reading body, %" PRId64 " in handler, %" PRId64 " sending\n",
+        stats->connectionsByState[0], stats->connectionsByState[1], stats->connectionsByState[2], stats->connectionsByState[3]);
+    printf("Traffic      sent %s (%s/s), received %s (%s/s)\n", sent, sentRate, received, receivedRate);
+    printf("Wasted       %" PRId64 " responses for clients that hung up, %" PRId64 " missing path cache hits\n",
+        stats->responsesForClosedConnections, stats->missingPathCacheHits);
+    printf("HeapStrings  %" PRId64 " allocations, %" PRId64 " reallocations, %" PRId64 " frees\n",
+        stats->heapStringAllocations, stats->heapStringReallocations, stats->heapStringFrees);
+    printf("TCP_INFO     %" PRId64 " samples. rtt p50/p90/p99 %" PRId64 "/%" PRId64 "/%" PRId64 "us, retransmits p99 %" PRId64 ", cwnd p50 %" PRId64 " segments\n",
+        stats->tcpInfoSamples,
+        histogramPercentile(stats->tcpInfoRTTMicroseconds, stats->tcpInfoSamples, 50),
+        histogramPercentile(stats->tcpInfoRTTMicroseconds, stats->tcpInfoSamples, 90),
+        histogramPercentile(stats->tcpInfoRTTMicroseconds, stats->tcpInfoSamples, 99),
+        histogramPercentile(stats->tcpInfoTotalRetransmits, stats->tcpInfoSamples, 99),
+        histogramPercentile(stats->tcpInfoCongestionWindowSegments, stats->tcpInfoSamples, 50));
+    printf("\nOldest connections");
+    if (stats->connectionsUnregistered > 0) {
+        printf(" (%" PRId64 " didn't fit in the registry since the server started)", stats->connectionsUnregistered);
+    }
+    printf("\n%-40s %-16s %10s %10s %10s %10s  %s\n", "client", "state", "age ms", "state ms", "received", "sent", "request");
+    for (int64_t i = 0; i < stats->connectionsCount && i < STATS_SEGMENT_CONNECTIONS; i++) {
+        const struct StatsSegmentConnection* connection = &stats->connections[i];
+        const char* state = connection->state >= 0 && connection->state < 4 ? connectionStateNames[connection->state] : "?";
+        printf("%-40.*s %-16s %10" PRId64 " %10" PRId64 " %10" PRId64 " %10" PRId64 "  %.*s %.*s\n",
+            (int) sizeof(connection->remoteHost), connection->remoteHost, state,
+            connection->ageMilliseconds, connection->inStateMilliseconds, connection->bytesReceived, connection->bytesSent,
+            (int) sizeof(connection->method), connection->method, (int) sizeof(connection->path), connection->path);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, const char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s /shared-memory-name [refresh milliseconds]\n", argv[0]);
+        return 1;
+    }
+    const char* name = argv[1];
+    int refreshMilliseconds = argc > 2 ? atoi(argv[2]) : 1000;
+    if (refreshMilliseconds <= 0) {
+        refreshMilliseconds = 1000;
+    }
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open the shared memory segment '%s'. Is the server running and calling serverStatsSharedMemoryPublish? %s = %d\n", name, strerror(errno), errno);
+        return 1;
+    }
+    struct stat st;
+    if (0 != fstat(fd, &st) || (size_t) st.st_size < sizeof(struct StatsSegment)) {
+        fprintf(stderr, "The shared memory segment '%s' is too small to be stats from this version\n", name);
+        close(fd);
+        return 1;
+    }
+    const struct StatsSegment* segment = (const struct StatsSegment*) mmap(NULL, sizeof(struct StatsSegment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == (const void*) segment) {
+        fprintf(stderr, "Could not mmap '%s'. %s = %d\n", name, strerror(errno), errno);
+        return 1;
+    }
+    struct StatsSegment snapshots[2];
+    int current = 0;
+    bool havePrevious = false;
+    struct timespec previousTime = {0, 0};
+    while (true) {
+        if (0 != statsSegmentRead(segment, &snapshots[current])) {
+            printf("Waiting for '%s' to be published...\n", name);
+        } else if (STATS_SEGMENT_MAGIC != snapshots[current].magic || STATS_SEGMENT_VERSION != snapshots[current].version || sizeof(struct StatsSegment) != snapshots[current].size) {
+            /* only checked once something was published - until then the header is all zeros */
+            fprintf(stderr, "'%s' isn't a version %d stats segment (magic 0x%x, version %u, size %" PRIu64 ")\n",
+                name, STATS_SEGMENT_VERSION, snapshots[current].magic, snapshots[current].version, snapshots[current].size);
+            return 1;
+        } else {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double elapsedSeconds = (double) (now.tv_sec - previousTime.tv_sec) + (double) (now.tv_nsec - previousTime.tv_nsec) / 1e9;
+            statsPrint(name, &snapshots[current], havePrevious ? &snapshots[1 - current] : NULL, elapsedSeconds);
+            previousTime = now;
+            havePrevious = true;
+            current = 1 - current;
+        }
+        usleep((useconds_t) refreshMilliseconds * 1000);
+    }
+    return 0;
+}
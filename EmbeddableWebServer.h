@@ -27,6 +27,8 @@ Tips:
 * If you want a clean server shutdown you can use serverInit() + acceptConnectionsUntilStopped() + serverDeInit()
 * To include the file in multiple .c files use EWS_HEADER_ONLY in all places but one. This is the opposite of 
 STB_IMPLEMENTATION if you are familiar with the STB libraries
+* Tools that only read the stats shared memory segment (like EWSStats.c) can define EWS_STATS_SEGMENT_ONLY to get just
+the types and constants without the options or any functions
 * To run a server on a different thread use (even on Windows):
 #include "EmbeddableWebServer.h"
 #include <time.h>
@@ -60,16 +62,21 @@ int main() {
 */
 
 /* You can turn these prints on/off.  ews_printf generally prints warnings + errors while ews_print_debug prints mundane information */
+#ifndef ews_printf
 #define ews_printf printf
 //#define ews_printf(...)
+#endif
+#ifndef ews_printf_debug
 //#define ews_printf_debug printf
 #define ews_printf_debug(...)
+#endif
 
 #include <stdbool.h>
 
 /* History:
  2016-11: Version 1.0 released */
 
+#ifndef EWS_STATS_SEGMENT_ONLY
 /* Quick nifty options */
 static bool OptionPrintWholeRequest = false;
 /* /status page - makes quite a few things take a lock to update counters but it doesn't make much of a difference. This isn't something like Nginx or Haywire*/
@@ -78,17 +85,89 @@ static bool OptionIncludeStatusPageAndCounters = true;
 static bool OptionListDirectoryContents = true;
 /* Print the entire server response to every request */
 static bool OptionPrintResponse = false;
+/* Linux only: pin each connection thread to the CPU whose NIC queue received the connection (SO_INCOMING_CPU) and
+ re-allocate the connection buffers from that thread so they are first-touched on its NUMA node. Use Server.acceptThreadCPU
+ to pin the accept thread as well */
+static bool OptionPinConnectionThreadsToIncomingCPU = false;
+/* Before sending a response, peek at the socket and don't bother sending if the client already hung up. Off by default
+ because a client that half-closes (shutdown(SHUT_WR)) after sending its request, which is fine in HTTP/1.0, looks just
+ like one that hung up and would never get its response. Turn it on if your clients are browsers */
+static bool OptionSkipResponseIfPeerClosed = false;
+/* Measure how long threads wait for and hold the server's internal locks (and your RWLocks). Costs a couple of clock
+ reads per lock so it's off by default. See serverLockStatisticsStringCreate */
+static bool OptionLockStatistics = false;
+/* While a control priority request (like /status) is being handled, bulk priority connections pause their sends
+ for up to 50ms at a time. See serverSetPathPriority */
+static bool OptionBulkYieldsToControl = true;
+/* Hash 200 OK response bodies you generate (body + segments, not files) and send an ETag. If the request's
+ If-None-Match has the same ETag we send a 304 with no body. Your handler still runs, but polling clients don't
+ download + parse the same JSON over and over */
+static bool OptionETagsForGeneratedResponses = false;
+/* Count every request's remote host and path in the server's heavy hitter sketches. It's a few atomic adds per request.
+ See serverHeavyHittersJSONCreate */
+static bool OptionTrackHeavyHitters = true;
+/* Charge HeapString, Response and Connection allocations to the route tag of the thread that made them (see
+ connectionSetRouteTag) so you can find the handler that's growing the heap. A few atomic adds per allocation.
+ See allocationProfileStringCreate */
+static bool OptionAllocationProfile = false;
+#endif // EWS_STATS_SEGMENT_ONLY
 
 /* These bound the memory used by a request. The headers used to be dynamically allocated but I've made them hard coded because: 1. Memory used by a request should be bounded 2. It was responsible for 2 * headersCount allocations every request */
 #define REQUEST_MAX_HEADERS 64
 #define REQUEST_HEADERS_MAX_MEMORY (8 * 1024)
 #define REQUEST_MAX_BODY_LENGTH (128 * 1024 * 1024) /* (rather arbitrary) */
+/* responseAllocServeFileFromRequestPath remembers this many paths that weren't there so scanners probing for
+ /wp-admin.php over and over don't cost a stat each time. A remembered miss is trusted for MISSING_PATH_CACHE_MILLISECONDS */
+#define MISSING_PATH_CACHE_ENTRIES 1024
+#define MISSING_PATH_CACHE_MILLISECONDS 1000
+#define MISSING_PATH_CACHE_MAX_PATH_LENGTH 512
+/* documentRootWarmInBackground asks the OS to read files up to this size into the page cache, and stops after the total */
+#define DOCUMENT_ROOT_WARM_MAX_FILE_SIZE (1024 * 1024)
+#define DOCUMENT_ROOT_WARM_MAX_TOTAL_SIZE (64 * 1024 * 1024)
+/* Threads that do the file reads for sendResponseFile, so reading the next chunk from slow storage (SD cards...)
+ overlaps with sending the last one. This also caps how many reads hit the disk at once. 0 reads on the connection thread */
+#define SERVER_DISK_IO_THREADS 2
+/* responseAllocBatchedSubRequests answers at most this many paths per request */
+#define BATCH_MAX_SUBREQUESTS 32
+/* Heavy hitter tracking (see serverHeavyHittersJSONCreate). Each count-min sketch is DEPTH rows of WIDTH counters, so
+ remote hosts + paths take 2 * 4 * 1024 * 8 = 64KB of the Server. All counts are halved every HEAVY_HITTERS_HALVE_EVERY
+ requests so the top list shows who is busy now rather than since startup */
+#define HEAVY_HITTERS_SKETCH_DEPTH 4
+#define HEAVY_HITTERS_SKETCH_WIDTH 1024
+#define HEAVY_HITTERS_TOP_K 16
+#define HEAVY_HITTERS_MAX_KEY_LENGTH 128
+#define HEAVY_HITTERS_HALVE_EVERY 65536
+/* TCP_INFO samples are kept in log2 histograms for the whole server and for up to SERVER_MAX_ROUTE_TAGS route tags
+ (see connectionSetRouteTag). Tags past that only count toward the server */
+#define TCP_INFO_HISTOGRAM_BUCKETS 40
+#define SERVER_MAX_ROUTE_TAGS 16
+/* The last this many traced requests are kept for serverTraceChromeJSONCreate */
+#define TRACE_RING_RECORDS 512
+/* Slow requests wait here for the logger thread. If it falls this far behind more are counted but not logged */
+#define SLOW_REQUEST_LOG_RECORDS 64
+/* serverConnectionsJSONCreate shows this many connections. Past that they're counted but not shown */
+#define SERVER_CONNECTION_REGISTRY_SLOTS 1024
+/* The shared memory stats segment (see serverStatsSharedMemoryPublish) lists this many of the oldest connections */
+#define STATS_SEGMENT_CONNECTIONS 16
+/* profilerFoldedStacksCreate keeps this many samples of up to this many frames (2MB, allocated the first time you profile).
+ The skipped frames are the signal handler and the signal trampoline */
+#define PROFILER_MAX_SAMPLES 8192
+#define PROFILER_MAX_FRAMES 32
+#define PROFILER_SKIP_FRAMES 2
+/* OptionAllocationProfile keeps statistics for this many route tags. Tags after that are counted as untagged */
+#define ALLOCATION_PROFILE_MAX_TAGS 32
 
 /* the buffer in connection used for sending and receiving. Should be big enough to fread(buffer) -> send(buffer) */
 #define SEND_RECV_BUFFER_SIZE (16 * 1024)
 /* contains the Response HTTP status and headers */
 #define RESPONSE_HEADER_SIZE 1024
 
+/* The server store (serverStoreSet/Get) is split into shards which each have their own lock, so handlers working on
+ different keys don't wait on each other. SERVER_STORE_MAX_MEMORY is divided evenly between the shards */
+#define SERVER_STORE_SHARDS 16
+#define SERVER_STORE_BUCKETS_PER_SHARD 256
+#define SERVER_STORE_MAX_MEMORY (4 * 1024 * 1024)
+
 #define EMBEDDABLE_WEB_SERVER_VERSION_STRING "1.0.0"
 #define EMBEDDABLE_WEB_SERVER_VERSION 0x00010000 // major = [31:16] minor = [15:8] build = [7:0]
 
@@ -100,6 +179,12 @@ static bool OptionPrintResponse = false;
 #define _CRT_SECURE_NO_WARNINGS 1
 #endif //_CRT_SECURE_NO_WARNINGS
 
+/* CPU_SET and pthread_setaffinity_np need _GNU_SOURCE. This does nothing if you already included system headers before
+ us, in which case CPU pinning is compiled out */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE 1
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -109,16 +194,23 @@ static bool OptionPrintResponse = false;
 #include <time.h>
 #include <signal.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <inttypes.h>
 
 #ifdef WIN32
 #include <WinSock2.h>
 #include <Ws2tcpip.h>
 #include <Windows.h>
+#include <intrin.h>
 typedef int64_t ssize_t;
 typedef HANDLE pthread_t;
 typedef CRITICAL_SECTION pthread_mutex_t;
 typedef CONDITION_VARIABLE pthread_cond_t;
+/* SRWLOCKs need to know how they were locked when they are unlocked. Only the exclusive owner sets the flag */
+typedef struct {
+    SRWLOCK lock;
+    bool exclusive;
+} pthread_rwlock_t;
 typedef SOCKET sockettype;
 #define STDCALL_ON_WIN32 WINAPI
 #define THREAD_RETURN_TYPE DWORD
@@ -131,6 +223,27 @@ typedef SOCKET sockettype;
 #include <sys/stat.h>
 #include <dirent.h>
 #include <strings.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include <sys/time.h>
+/* musl and friends don't have backtrace() */
+#if defined(__GLIBC__) || defined(__APPLE__)
+#include <execinfo.h>
+#define EWS_PROFILER_SUPPORTED 1
+#endif
 typedef int sockettype;
 #define STDCALL_ON_WIN32
 #define THREAD_RETURN_TYPE void*
@@ -155,6 +268,8 @@ struct HeapString {
     char* contents; // null-terminated, at least length+1
     size_t length; // this is updated by the heapString* functions
     size_t capacity;
+    /* who the contents are charged to when OptionAllocationProfile is on. 0 if they aren't tracked */
+    int allocationTagIndex;
 };
 
 /* a string pointing to the request->headerStringPool */
@@ -212,6 +327,43 @@ struct ConnectionStatus {
     int64_t bytesReceived;
 };
 
+/* Control requests get the CPU and the network first, bulk transfers get what's left */
+typedef enum {
+    ConnectionPriorityControl,
+    ConnectionPriorityNormal,
+    ConnectionPriorityBulk
+} ConnectionPriority;
+
+/* Points in a request's life that are timestamped when tracing is on. See Server.traceSampleEvery */
+typedef enum {
+    ConnectionTraceAccept,
+    ConnectionTraceFirstByteReceived,
+    ConnectionTraceHeadersParsed,
+    ConnectionTraceHandlerStart,
+    ConnectionTraceHandlerEnd,
+    /* just before the first send of the response */
+    ConnectionTraceSendStart,
+    ConnectionTraceSendEnd,
+    ConnectionTraceClose,
+    ConnectionTracePointsCount
+} ConnectionTracePoint;
+
+/* Where a live connection is at. See serverConnectionsJSONCreate */
+typedef enum {
+    ConnectionStateReadingHeaders,
+    ConnectionStateReadingBody,
+    ConnectionStateInHandler,
+    ConnectionStateSending
+} ConnectionState;
+
+struct ConnectionTrace {
+    bool enabled;
+    /* TSC ticks on x86, nanoseconds elsewhere. 0 if that point wasn't reached */
+    uint64_t ticks[ConnectionTracePointsCount];
+    int64_t acceptNanoseconds;
+    int responseCode;
+};
+
 /* This contains a full HTTP connection. For every connection, a thread is spawned
  and passed this struct */
 struct Connection {
@@ -225,7 +377,29 @@ struct Connection {
     socklen_t remoteAddrLength;
     char remoteHost[128];
     char remotePort[16];
+    /* The CPU that received this connection (SO_INCOMING_CPU) or -1 if unknown. Only filled out with OptionPinConnectionThreadsToIncomingCPU */
+    int incomingCPU;
     struct ConnectionStatus status;
+    /* Set once we notice the client went away. Use connectionPeerClosed to check for it */
+    bool peerClosed;
+    /* Response body bandwidth. See connectionSetBandwidthLimit */
+    int64_t bandwidthLimitBytesPerSecond;
+    struct BandwidthLimiter* routeBandwidthLimiter;
+    int64_t bandwidthStartNanoseconds;
+    int64_t bandwidthBytesSent;
+    /* Set from the route, the Priority header or the server default before your handler runs. See connectionSetPriority */
+    ConnectionPriority priority;
+    bool countedAsControlRequest;
+    /* Which route this is for statistics. See connectionSetRouteTag */
+    const char* routeTag;
+    struct ConnectionTrace trace;
+    /* See OptionAllocationProfile */
+    int allocationTagIndex;
+    /* Our slot in the server's ConnectionRegistry or -1 */
+    int registrySlot;
+    ConnectionState registryState;
+    /* Set on the scratch connections responseAllocBatchedSubRequests runs each path on. They have no socket (socketfd is -1) */
+    const struct Connection* batchParent;
     struct Request request;
     /* points back to the server, usually used for the server's globalMutex */
     struct Server* server;
@@ -235,6 +409,15 @@ struct Connection {
  You can fill out the body field using the heapString* functions. You can also specify a
  filenameToSend which will be sent using regular file streaming. This is so you don't have
  to load the entire file into memory all at once to send it. */
+/* A piece of a response body that the response points at instead of copying. When the response is freed release
+ is called with releaseContext (if release isn't NULL) so you can free or unreference the memory */
+struct ResponseSegment {
+    const void* data;
+    size_t length;
+    void (*release)(void* releaseContext);
+    void* releaseContext;
+};
+
 struct Response {
     int code;
     struct HeapString body;
@@ -242,13 +425,355 @@ struct Response {
     char* status;
     char* contentType;
     char* extraHeaders; // can be NULL
+    /* Static responses (responseAllocStatic and the server's own pre-rendered errors) are shared between threads,
+     never freed and must not be modified. serialized is the whole HTTP header + body, sent with one send */
+    bool isStatic;
+    const char* serialized;
+    size_t serializedLength;
+    /* sent after body, with writev. See responseAppendSegment */
+    struct ResponseSegment* segments;
+    size_t segmentsCount;
+    size_t segmentsCapacity;
+    /* -1 unless this came from responseAllocWithFileDescriptor */
+    int fdToSend;
+    int64_t fdLength;
+    bool fdCloseWhenFreed;
+    /* See OptionAllocationProfile */
+    int allocationTagIndex;
+};
+
+/* One file in an archive document root. data points into the archive */
+struct ArchiveEntry {
+    char* name;
+    uint64_t nameHash;
+    const uint8_t* data;
+    size_t length;
+    const char* contentType;
+};
+
+/* A tar file used as a document root. See archiveDocumentRootOpen */
+struct ArchiveDocumentRoot {
+    const uint8_t* data;
+    size_t length;
+    /* set if we mapped the file, NULL if the caller owns the memory */
+    void* mapping;
+    size_t mappingLength;
+    struct ArchiveEntry* entries;
+    size_t entriesCount;
+    /* open addressing - index into entries + 1, 0 is empty */
+    uint32_t* table;
+    size_t tableCapacity;
+};
+
+/* Wait + hold times for one lock. These are only updated when OptionLockStatistics is on */
+struct LockStatistics {
+    const char* name;
+    int64_t acquisitions;
+    /* acquisitions where someone else was already holding the lock */
+    int64_t contendedAcquisitions;
+    int64_t totalWaitNanoseconds;
+    int64_t maxWaitNanoseconds;
+    /* hold times are only measured for exclusive (mutex + write) locks, so they're averaged over exclusiveAcquisitions */
+    int64_t exclusiveAcquisitions;
+    int64_t totalHoldNanoseconds;
+    int64_t maxHoldNanoseconds;
+    /* internal - when the current exclusive owner got the lock */
+    int64_t lockedAtNanoseconds;
+};
+
+/* A reader-writer lock for your handlers' shared data. Use the rwLock* functions */
+struct RWLock {
+    pthread_rwlock_t lock;
+    struct LockStatistics statistics;
+};
+
+struct ServerStoreEntry;
+
+struct ServerStoreShard {
+    /* readers (serverStoreGet) share this */
+    struct RWLock lock;
+    struct ServerStoreEntry* buckets[SERVER_STORE_BUCKETS_PER_SHARD];
+    /* every entry in the shard from least to most recently set. We evict from the oldest end when over the memory limit */
+    struct ServerStoreEntry* oldest;
+    struct ServerStoreEntry* newest;
+    size_t memoryUsed;
+};
+
+/* One fread handed to the disk I/O threads. The connection thread waits on done */
+struct DiskRead {
+    FILE* fp;
+    void* buffer;
+    size_t capacity;
+    size_t bytesRead;
+    bool failed;
+    /* errno from the thread that did the fread, so it's worth logging when failed */
+    int errorNumber;
+    bool done;
+    /* false if the read happened right away on the calling thread */
+    bool queued;
+    struct DiskRead* next;
+};
+
+/* See SERVER_DISK_IO_THREADS */
+struct DiskIOPool {
+    pthread_mutex_t lock;
+    pthread_cond_t readQueued;
+    pthread_cond_t readDone;
+    struct DiskRead* queueHead;
+    struct DiskRead* queueTail;
+    bool stopping;
+    int threadsCount;
+    pthread_t threads[SERVER_DISK_IO_THREADS > 0 ? SERVER_DISK_IO_THREADS : 1];
+};
+
+/* A token bucket shared by many connections - the whole server, or every download from one route. Waiters are served
+ in the order they arrived and only the one at the front sleeps for tokens, so concurrent downloads share it evenly */
+struct BandwidthLimiter {
+    pthread_mutex_t lock;
+    pthread_cond_t nextWaiter;
+    /* 0 is unlimited */
+    int64_t bytesPerSecond;
+    int64_t burstBytes;
+    int64_t tokens;
+    int64_t lastRefillNanoseconds;
+    uint64_t nextTicket;
+    uint64_t nowServing;
+};
+
+struct HeavyHitter {
+    char key[HEAVY_HITTERS_MAX_KEY_LENGTH];
+    uint64_t keyHash;
+    int64_t estimate;
+};
+
+/* Approximate request counts per key in fixed memory. The sketch is only touched with atomic adds. The top list is a
+ min-heap of the biggest estimates behind a lock that recording only ever trylocks */
+struct HeavyHitters {
+    int64_t sketch[HEAVY_HITTERS_SKETCH_DEPTH][HEAVY_HITTERS_SKETCH_WIDTH];
+    int64_t total;
+    pthread_mutex_t topLock;
+    struct HeavyHitter top[HEAVY_HITTERS_TOP_K];
+    size_t topCount;
+    /* times the top list update was skipped because another thread was updating it */
+    int64_t topUpdatesSkipped;
+};
+
+/* The kernel's view of one connection (getsockopt TCP_INFO). Fields the platform doesn't report are -1 */
+struct TCPInfoSample {
+    int64_t rttMicroseconds;
+    int64_t rttVarianceMicroseconds;
+    int64_t totalRetransmits;
+    int64_t congestionWindowSegments;
+    int64_t deliveryRateBytesPerSecond;
+};
+
+/* Bucket 0 counts 0s, bucket i counts values in [2^(i-1), 2^i) */
+struct TCPInfoHistograms {
+    /* NULL for the whole server */
+    const char* routeTag;
+    int64_t samples;
+    int64_t rttMicroseconds[TCP_INFO_HISTOGRAM_BUCKETS];
+    int64_t totalRetransmits[TCP_INFO_HISTOGRAM_BUCKETS];
+    int64_t congestionWindowSegments[TCP_INFO_HISTOGRAM_BUCKETS];
+    int64_t deliveryRateBytesPerSecond[TCP_INFO_HISTOGRAM_BUCKETS];
+};
+
+struct TCPInfoStatistics {
+    pthread_mutex_t lock;
+    int64_t responses;
+    struct TCPInfoHistograms server;
+    struct TCPInfoHistograms routes[SERVER_MAX_ROUTE_TAGS];
+    size_t routesCount;
+};
+
+/* One finished request's timeline */
+struct TraceRecord {
+    uint64_t number;
+    uint64_t ticks[ConnectionTracePointsCount];
+    char method[16];
+    char path[128];
+    char remoteHost[64];
+    int responseCode;
+    int64_t bytesSent;
+    int64_t bytesReceived;
+    bool slow;
+};
+
+/* sequence is odd while the record is being written (a seqlock) */
+struct TraceRingSlot {
+    int64_t sequence;
+    struct TraceRecord record;
+};
+
+/* Finished requests go in here without a lock. Ticks are turned into time with the epoch pair */
+struct TraceRing {
+    int64_t nextSlot;
+    int64_t requests;
+    uint64_t epochTicks;
+    int64_t epochNanoseconds;
+    struct TraceRingSlot slots[TRACE_RING_RECORDS];
+};
+
+/* A request that took longer than Server.slowRequestLogMilliseconds */
+struct SlowRequestRecord {
+    int64_t durationNanoseconds;
+    uint64_t ticks[ConnectionTracePointsCount];
+    char method[16];
+    char path[128];
+    char remoteHost[64];
+    char remotePort[16];
+    const char* routeTag;
+    int responseCode;
+    int64_t bytesSent;
+    int64_t bytesReceived;
+    size_t bodyLength;
+    size_t headersCount;
+    /* the names of the Request warnings that were set, space separated */
+    char warnings[96];
+};
+
+/* Request threads only ever trylock this and drop the record if it's busy or full. The logger thread does the
+ formatting and the writing. It's started by the first slow request so servers that never log don't pay for it */
+struct SlowRequestLog {
+    pthread_mutex_t lock;
+    pthread_cond_t recordAdded;
+    struct SlowRequestRecord records[SLOW_REQUEST_LOG_RECORDS];
+    size_t head;
+    size_t count;
+    int64_t dropped;
+    bool stopping;
+    bool threadStarted;
+    /* pthread_create failed once, don't keep trying on every slow request */
+    bool threadFailed;
+    pthread_t thread;
+    /* for slowRequestLogFile */
+    const struct Server* server;
+    /* to turn ticks into time, like TraceRing */
+    uint64_t epochTicks;
+    int64_t epochNanoseconds;
+};
+
+/* One live connection. Only the connection's own thread writes it. sequence is odd while it does (a seqlock) */
+struct ConnectionRegistrySlot {
+    /* 0 if the slot is free. Claimed with a CAS */
+    int64_t inUse;
+    int64_t sequence;
+    /* bumped every time the slot is claimed so index + generation names one connection */
+    int index;
+    int64_t generation;
+    ConnectionState state;
+    int64_t startNanoseconds;
+    int64_t stateNanoseconds;
+    int64_t bytesReceived;
+    int64_t bytesSent;
+    char remoteHost[64];
+    char remotePort[16];
+    char method[16];
+    char path[128];
+    const char* routeTag;
+};
+
+/* Connection threads register themselves here without a lock so a stuck connection can be found from the outside */
+struct ConnectionRegistry {
+    int64_t nextSlot;
+    /* connections that found every slot taken */
+    int64_t unregistered;
+    struct ConnectionRegistrySlot slots[SERVER_CONNECTION_REGISTRY_SLOTS];
+};
+
+/* The layout of the shared memory segment serverStatsSharedMemoryPublish keeps up to date. Bump STATS_SEGMENT_VERSION
+ whenever it changes. Readers copy it out like a seqlock: sequence is odd while it's being written and 0 until the first
+ publish, so retry if it's odd or changed while you copied. Check magic, version and size on that first good copy - the
+ header isn't filled in before then. See EWSStats.c */
+#define STATS_SEGMENT_MAGIC 0x53535745 /* "EWSS" */
+#define STATS_SEGMENT_VERSION 1
+
+struct StatsSegmentConnection {
+    /* a ConnectionState */
+    int32_t state;
+    int32_t unused;
+    int64_t ageMilliseconds;
+    int64_t inStateMilliseconds;
+    int64_t bytesReceived;
+    int64_t bytesSent;
+    char remoteHost[64];
+    char method[16];
+    char path[128];
+};
+
+struct StatsSegment {
+    uint32_t magic;
+    uint32_t version;
+    /* sizeof(struct StatsSegment) */
+    uint64_t size;
+    int64_t sequence;
+    /* everything from here on is rewritten by each publish */
+    int64_t publisherProcessID;
+    int64_t publishIntervalMilliseconds;
+    /* wall clock, so a reader can tell the publisher went away */
+    int64_t publishedUnixSeconds;
+    int64_t publishes;
+    /* the /status counters */
+    int64_t bytesReceived;
+    int64_t bytesSent;
+    int64_t totalConnections;
+    int64_t activeConnections;
+    int64_t heapStringAllocations;
+    int64_t heapStringReallocations;
+    int64_t heapStringFrees;
+    int64_t heapStringTotalBytesReallocated;
+    int64_t responsesForClosedConnections;
+    int64_t missingPathCacheHits;
+    int64_t controlRequestsInFlight;
+    /* the whole server's TCP_INFO histograms. Bucket i counts values up to 2^i - 1 */
+    int64_t tcpInfoSamples;
+    int64_t tcpInfoRTTMicroseconds[TCP_INFO_HISTOGRAM_BUCKETS];
+    int64_t tcpInfoTotalRetransmits[TCP_INFO_HISTOGRAM_BUCKETS];
+    int64_t tcpInfoCongestionWindowSegments[TCP_INFO_HISTOGRAM_BUCKETS];
+    int64_t tcpInfoDeliveryRateBytesPerSecond[TCP_INFO_HISTOGRAM_BUCKETS];
+    /* from the ConnectionRegistry, indexed by ConnectionState */
+    int64_t connectionsByState[4];
+    int64_t connectionsUnregistered;
+    /* oldest first */
+    int64_t connectionsCount;
+    struct StatsSegmentConnection connections[STATS_SEGMENT_CONNECTIONS];
+};
+
+/* The thread behind serverStatsSharedMemoryPublish */
+struct StatsPublisher {
+    struct Server* server;
+    struct StatsSegment* segment;
+    char name[128];
+    int intervalMilliseconds;
+    int64_t stopping;
+    pthread_t thread;
+    /* filled in without touching the segment, then copied in under the seqlock */
+    struct StatsSegment staging;
+    struct ConnectionRegistrySlot* connections;
+};
+
+/* See serverSetPathPriority */
+#define SERVER_MAX_PATH_PRIORITIES 16
+struct PathPriority {
+    char pathPrefix[128];
+    ConnectionPriority priority;
+};
+/* See serverSetPathParallelBatching */
+#define SERVER_MAX_PARALLEL_BATCH_PATHS 16
+
+/* A key/value store for state shared between handlers. Use the serverStore* functions */
+struct ServerStore {
+    struct ServerStoreShard shards[SERVER_STORE_SHARDS];
 };
 
 struct Server {
     bool initialized;
     pthread_mutex_t globalMutex;
+    struct LockStatistics globalMutexStatistics;
     bool shouldRun;
     sockettype listenerfd;
+    /* If >= 0 the thread that calls acceptConnectionsUntilStopped is pinned to this CPU. serverInit sets this to -1 so set it afterwards */
+    int acceptThreadCPU;
     /* User field for whatever - if your request handler you can do connection->server->tag */
     void* tag; 
 
@@ -261,12 +786,56 @@ struct Server {
     int activeConnectionCount;
     pthread_cond_t connectionFinishedCond;
     pthread_mutex_t connectionFinishedLock;
+    struct LockStatistics connectionFinishedLockStatistics;
+
+    /* shared key/value state for your handlers (connection->server->store). Use the serverStore* functions */
+    struct ServerStore store;
+    /* file reads for sendResponseFile. Started by serverInit, stopped by serverDeInit */
+    struct DiskIOPool diskIOPool;
+    /* Caps response body bandwidth for all connections together. Unlimited until you bandwidthLimiterSetRate it */
+    struct BandwidthLimiter bandwidthLimiter;
+    /* The default per-connection cap in bytes per second. 0 is unlimited */
+    int64_t connectionBandwidthLimitBytesPerSecond;
+    /* Priority for requests that don't match a path prefix or ask for background with a Priority header. If you have a separate
+     Server for an admin port, set it to ConnectionPriorityControl */
+    ConnectionPriority defaultPriority;
+    struct PathPriority pathPriorities[SERVER_MAX_PATH_PRIORITIES];
+    size_t pathPrioritiesCount;
+    /* path prefixes that are safe to run at the same time as each other in a batch */
+    char parallelBatchPathPrefixes[SERVER_MAX_PARALLEL_BATCH_PATHS][128];
+    size_t parallelBatchPathPrefixesCount;
+    int64_t controlRequestsInFlight;
+    /* who and what the requests are for. See serverHeavyHittersJSONCreate */
+    struct HeavyHitters heavyHitterRemoteHosts;
+    struct HeavyHitters heavyHitterPaths;
+    /* Sample TCP_INFO for 1 in this many responses once they're sent, so you can tell a slow network from a slow
+     handler. 0 turns it off. serverInit sets it to 16. See serverTCPInfoStringCreate */
+    int tcpInfoSampleEvery;
+    struct TCPInfoStatistics tcpInfoStatistics;
+    /* Record the timeline (accept, first byte, headers, handler, send, close) of 1 in traceSampleEvery requests and of
+     every request that took longer than traceSlowRequestMilliseconds. 0 turns either off. serverInit sets them to 0
+     and 500. See serverTraceChromeJSONCreate */
+    int traceSampleEvery;
+    int traceSlowRequestMilliseconds;
+    struct TraceRing* traceRing;
+    /* Requests that take longer than this are logged with how long they spent waiting for the first byte, reading the
+     headers, reading the body, in your handler and sending, plus their sizes, the client and any Request warnings. A
+     background thread writes the log so a slow terminal never holds up a request. 0 turns it off. serverInit sets it to
+     0 and slowRequestLogFile to stdout */
+    int slowRequestLogMilliseconds;
+    FILE* slowRequestLogFile;
+    struct SlowRequestLog* slowRequestLog;
+    /* Every live connection. See serverConnectionsJSONCreate */
+    struct ConnectionRegistry* connectionRegistry;
+    /* See serverStatsSharedMemoryPublish */
+    struct StatsPublisher* statsPublisher;
 };
 
 #ifndef __printflike
 #define __printflike(...) // clang (and maybe GCC) has this macro that can check printf/scanf format arguments
 #endif
 
+#ifndef EWS_STATS_SEGMENT_ONLY
 
 /* You fill in this function. Look at request->path for the requested URI */
 struct Response* createResponseForRequest(const struct Request* request, struct Connection* connection);
@@ -284,8 +853,26 @@ To serve out the current directory like a normal web server do:
 responseAllocServeFileFromRequestPath("/", request->path, request->pathDecoded, ".") 
 To serve files with a prefix do this:
 responseAllocServeFileFromRequestPath("/release/current", request->path, request->pathDecoded, "/var/root/www/release-5.0.0") so people will go to:
-http://55.55.55.55/release/current and be served /var/root/www/release-5.0.0 */
+http://55.55.55.55/release/current and be served /var/root/www/release-5.0.0
+The 403 and 404 responses are shared and static (see Response.isStatic) so return them as they are */
 struct Response* responseAllocServeFileFromRequestPath(const char* pathPrefix, const char* requestPath, const char* requestPathDecoded, const char* documentRoot);
+/* If you create files in a documentRoot while the server runs call this so the new files show up right away instead
+ of 404ing until the remembered misses expire (see MISSING_PATH_CACHE_MILLISECONDS) */
+void documentRootMissingPathsForget(void);
+/* After a reboot the first visitors wait on every file being faulted in from slow storage. Call this after serverInit
+ and a background thread walks documentRoot, stats everything (so the directory entries are cached) and asks the OS to
+ read ahead small files (see DOCUMENT_ROOT_WARM_MAX_FILE_SIZE). It returns right away */
+void documentRootWarmInBackground(const char* documentRoot);
+/* Serve a web UI out of one tar file (ustar or GNU tar, not compressed - but members can be). The archive is memory mapped
+ and indexed once so serving a file doesn't open or stat anything. If the client accepts gzip and the archive has
+ "app.js.gz" next to "app.js" we send the .gz one. Returns NULL and prints why if the archive couldn't be opened */
+struct ArchiveDocumentRoot* archiveDocumentRootOpen(const char* archivePath);
+/* For archives that are already in memory, like ones linked into your program. The memory must outlive the archive */
+struct ArchiveDocumentRoot* archiveDocumentRootOpenFromMemory(const void* data, size_t length);
+/* Only close it after the server is stopped - responses point right into the archive */
+void archiveDocumentRootClose(struct ArchiveDocumentRoot* archive);
+/* Like responseAllocServeFileFromRequestPath but from an archive. There are no directory listings, but dir/index.html is served for dir/ */
+struct Response* responseAllocServeFileFromArchive(const char* pathPrefix, const struct Request* request, const struct ArchiveDocumentRoot* archive);
 /* You can use heapStringAppend*(&response->body) to dynamically generate the body */
 struct Response* responseAllocHTML(const char* html);
 struct Response* responseAllocHTMLWithFormat(const char* format, ...) __printflike(1, 0);
@@ -300,6 +887,32 @@ struct Response* responseAllocWithFile(const char* filename, const char* MIMETyp
 struct Response* responseAlloc400BadRequestHTML(const char* errorMessage);
 struct Response* responseAlloc404NotFoundHTML(const char* resourcePathOrNull);
 struct Response* responseAlloc500InternalErrorHTML(const char* extraInformationOrNull);
+/* Renders the whole response (header + body) once. You can return the same static response from any number of requests
+ on any thread - the server never frees it. Create these at startup and don't modify them */
+struct Response* responseAllocStatic(int code, const char* status, const char* contentType, const char* body);
+/* These don't copy the body - it must stay valid until the response is sent, so use them for string literals and
+ other long-lived buffers */
+struct Response* responseAllocHTMLNoCopy(const char* html);
+struct Response* responseAllocJSONNoCopy(const char* json);
+struct Response* responseAllocWithBodyNoCopy(int code, const char* status, const char* contentType, const void* body, size_t bodyLength);
+/* Add memory you own to the end of the response body without copying it. The segments are sent with one writev
+ along with the header. release (can be NULL) is called with releaseContext when the response is freed, which is how
+ you free or unreference the memory */
+void responseAppendSegment(struct Response* response, const void* data, size_t length, void (*release)(void* releaseContext), void* releaseContext);
+/* Dashboards that fire off 20 tiny GETs per refresh can send them in one request instead. The paths come from a POST
+ body (one per line) or ?paths=/a,/b and each one is run through createResponseForRequest as a GET with this request's
+ headers. You get back {"responses":[{"path":..., "status":..., "contentType":..., "body":...}]} where JSON bodies are
+ embedded as-is and everything else as a string. Files and file descriptor responses can't be batched. If parallel, the
+ paths you opted in with serverSetPathParallelBatching run on their own threads and the rest run one after the other
+ on this one. Batches can't contain batches */
+struct Response* responseAllocBatchedSubRequests(struct Connection* connection, const struct Request* request, bool parallel);
+#ifndef WIN32
+/* Send whatever can be read from fd: a pipe from a child process, a device, a socket or a file. Regular files go out
+ with sendfile and everything else is spliced through a pipe (on Linux) so the data doesn't pass through user space.
+ The data is sent from fd's current position. Pass -1 for length to send until end of file - then there's no
+ Content-Length and the client reads until we close the connection. If closeWhenFreed the response closes fd */
+struct Response* responseAllocWithFileDescriptor(int fd, int64_t lengthOrNegative, const char* contentType, bool closeWhenFreed);
+#endif
 
 /* If you care about initialization and tear-down or managing multiple servers 
  you'll want to use these functions. Otherwise you can just pass null to acceptConnections* */
@@ -319,16 +932,24 @@ char* strdupEscapeForHTML(const char* stringToEscape);
 static const struct Header* headerInRequest(const char* headerName, const struct Request* request);
 /* Get a debug string representing this connection that's easy to print out. wrap it in HTML <pre> tags */
 struct HeapString connectionDebugStringCreate(const struct Connection* connection);
+/* Has the client closed the connection? Slow handlers can call this every so often and stop working on a response
+ nobody will read. It does a non-blocking peek at the socket so it's cheap, but not free. A client that half-closed
+ (shutdown(SHUT_WR)) after sending its request counts as closed too */
+bool connectionPeerClosed(struct Connection* connection);
 /* Some really basic dynamic string handling. AppendChar and AppendFormat allocate enough memory and
  these strings are null-terminated so you can pass them into sews_printf */
 static void heapStringInit(struct HeapString* string);
 static void heapStringFreeContents(struct HeapString* string);
+/* Hands the contents to you to free() yourself and empties the string */
+static char* heapStringReleaseContents(struct HeapString* string);
 static void heapStringSetToCString(struct HeapString* heapString, const char* cString);
 static void heapStringAppendChar(struct HeapString* string, char c);
 static void heapStringAppendFormat(struct HeapString* string, const char* format, ...) __printflike(2, 0);
 static void heapStringAppendString(struct HeapString* string, const char* stringToAppend);
 static void heapStringAppendFormatV(struct HeapString* string, const char* format, va_list ap);
 static void heapStringAppendHeapString(struct HeapString* target, const struct HeapString* source);
+/* Appends a quoted JSON string with ", \ and control characters escaped */
+static void heapStringAppendJSONString(struct HeapString* string, const char* contents, size_t length);
 /* functions that help when serving files */
 static const char* MIMETypeFromFile(const char* filename, const uint8_t* contents, size_t contentsLength);
 
@@ -336,6 +957,94 @@ static const char* MIMETypeFromFile(const char* filename, const uint8_t* content
 int serverMutexLock(struct Server* server);
 int serverMutexUnlock(struct Server* server);
 
+/* Reader-writer locks for data that's read far more than it's written. Pass a string literal for name, it shows up
+ when you lockStatisticsStringAppend(&string, &rwLock.statistics) */
+void rwLockInit(struct RWLock* rwLock, const char* name);
+void rwLockDestroy(struct RWLock* rwLock);
+int rwLockReadLock(struct RWLock* rwLock);
+int rwLockWriteLock(struct RWLock* rwLock);
+int rwLockUnlock(struct RWLock* rwLock);
+/* Table of wait/hold times for the server's locks (globalMutex, connection bookkeeping, counters, store shards) when
+ OptionLockStatistics is on. Wrap it in <pre> tags */
+struct HeapString serverLockStatisticsStringCreate(struct Server* server);
+void lockStatisticsStringAppend(struct HeapString* string, const struct LockStatistics* statistics);
+
+/* A thread-safe key/value store shared by all connections so handlers with shared caches or counters don't have to
+ serialize on serverMutexLock. Keys + values are copied in and out. A ttlSeconds of 0 never expires. When a shard is
+ over its part of SERVER_STORE_MAX_MEMORY the least recently set entries are evicted. Returns 0 on success */
+int serverStoreSet(struct Server* server, const char* key, const void* value, size_t valueLength, int ttlSeconds);
+/* Copies the value into valueOut (null-terminated - heapStringFreeContents it when you're done). Returns false if the key isn't there or expired */
+bool serverStoreGet(struct Server* server, const char* key, struct HeapString* valueOut);
+bool serverStoreDelete(struct Server* server, const char* key);
+/* Adds delta to the number stored at key (missing keys start at 0) and returns the new value. Good for hit counters */
+int64_t serverStoreIncrement(struct Server* server, const char* key, int64_t delta);
+
+/* Bandwidth shaping for response bodies so big downloads don't starve everything else on a slow uplink. Every body
+ send goes through the connection's own limit, then the route's limiter (if any), then the server's. The HTTP headers
+ that go out with a body count too. burstBytes is how much can go out at once after being idle */
+void bandwidthLimiterInit(struct BandwidthLimiter* limiter, int64_t bytesPerSecond, int64_t burstBytes);
+void bandwidthLimiterDestroy(struct BandwidthLimiter* limiter);
+void bandwidthLimiterSetRate(struct BandwidthLimiter* limiter, int64_t bytesPerSecond, int64_t burstBytes);
+/* Blocks until bytes can be sent. Useful if you take over the connection and send yourself */
+void bandwidthLimiterAcquire(struct BandwidthLimiter* limiter, int64_t bytes);
+/* Call from your handler. bytesPerSecond overrides Server.connectionBandwidthLimitBytesPerSecond for this connection
+ (0 keeps the default, -1 is unlimited). routeLimiterOrNULL is shared by everything you pass it to, e.g. all of /downloads */
+void connectionSetBandwidthLimit(struct Connection* connection, int64_t bytesPerSecond, struct BandwidthLimiter* routeLimiterOrNULL);
+
+/* Requests under pathPrefix get this priority, which wins over the client's Priority header. The header can only
+ make a request Bulk (u=5 and up), so Control has to come from here or defaultPriority. Call these before you
+ start accepting connections. Bulk connections run on lower priority threads and pause for control ones (see
+ OptionBulkYieldsToControl), control connections get a higher SO_PRIORITY on Linux. Returns 0 on success */
+int serverSetPathPriority(struct Server* server, const char* pathPrefix, ConnectionPriority priority);
+/* Lets batched requests under pathPrefix run on their own threads (see responseAllocBatchedSubRequests). Only opt in
+ handlers that are safe to run concurrently with each other. Call these before you start accepting connections.
+ Returns 0 on success */
+int serverSetPathParallelBatching(struct Server* server, const char* pathPrefix);
+/* Change the priority from inside your handler, e.g. once you know the response will be big */
+void connectionSetPriority(struct Connection* connection, ConnectionPriority priority);
+
+/* When load spikes this tells you which clients and paths it's coming from: the busiest remote hosts and paths (without
+ the query string) with their approximate request counts, as JSON. Counts can be a little high, never low. See OptionTrackHeavyHitters */
+struct HeapString serverHeavyHittersJSONCreate(struct Server* server);
+
+/* Statistics are broken down by route tag as well as by server (listener). Call it from your handler with a string
+ literal (or anything that outlives the server) like "api" or "downloads". With OptionAllocationProfile the connection
+ and everything the thread allocates afterwards is charged to the tag */
+void connectionSetRouteTag(struct Connection* connection, const char* routeTag);
+/* RTT, retransmits, congestion window and delivery rate percentiles from the sampled TCP_INFO (Linux + Mac OS X) for
+ the server and each route tag. Wrap it in <pre> tags. See Server.tcpInfoSampleEvery */
+struct HeapString serverTCPInfoStringCreate(struct Server* server);
+
+/* The recently traced requests in Chrome's trace event format. Save it to a .json file and open it in
+ https://ui.perfetto.dev or chrome://tracing. Each request gets its own track */
+struct HeapString serverTraceChromeJSONCreate(struct Server* server);
+
+/* Every connection that's open right now, oldest first, with what it's doing (reading headers, reading the body, in
+ your handler or sending), how long it's been at it and the bytes in and out so far. For finding stuck or slow
+ connections without a debugger. Reading it doesn't slow the connections down */
+struct HeapString serverConnectionsJSONCreate(struct Server* server);
+/* The same as an HTML table */
+struct HeapString serverConnectionsHTMLCreate(struct Server* server);
+
+/* Scraping /status adds load right when the server is struggling. This mirrors the /status counters, the TCP_INFO
+ histograms and a summary of the open connections into a POSIX shared memory segment (a shm_open name like "/ews-8080")
+ every intervalMilliseconds from a background thread instead, so a tool like EWSStats.c can watch the server without
+ sending it anything. The connection threads don't do any extra work. See struct StatsSegment for the layout. Call it
+ after serverInit. serverDeInit removes the segment. It's only readable by the same user. If another running process
+ is publishing to name this fails; a segment left behind by one that died is replaced. Returns 0 on success. Linux +
+ Mac OS X only, and on glibc before 2.34 link with -lrt */
+int serverStatsSharedMemoryPublish(struct Server* server, const char* name, int intervalMilliseconds);
+
+/* A sampling CPU profiler for when you can't install perf. For `seconds` it samples the stack of whichever thread is on
+ the CPU samplesPerSecond times a second (SIGPROF) and then returns the samples folded ("main;foo;bar 42" lines) for
+ flamegraph.pl or speedscope. It blocks the calling thread the whole time. Link with -rdynamic to get function names.
+ glibc and Mac OS X only, elsewhere you get a message saying so */
+struct HeapString profilerFoldedStacksCreate(int seconds, int samplesPerSecond);
+
+/* Which route tags hold the most heap (HeapStrings, Responses and Connections) right now, with their high water marks
+ and totals, biggest first. Only counts what was allocated while OptionAllocationProfile was on. Wrap it in <pre> tags */
+struct HeapString allocationProfileStringCreate(size_t topN);
+
 /* runs quick unit tests in the demo app */
 void EWSUnitTestsRun(void);
 
@@ -348,6 +1057,7 @@ void EWSUnitTestsRun(void);
 static struct Counters {
     bool lockInitialized;
     pthread_mutex_t lock;
+    struct LockStatistics lockStatistics;
     int64_t bytesReceived;
     int64_t bytesSent;
     int64_t totalConnections;
@@ -356,15 +1066,106 @@ static struct Counters {
     int64_t heapStringReallocations;
     int64_t heapStringFrees;
     int64_t heapStringTotalBytesReallocated;
+    /* requests where the client hung up before we sent the response, so the handler's work was wasted */
+    int64_t responsesForClosedConnections;
+    /* 404s answered from the missing path cache without touching the filesystem */
+    int64_t missingPathCacheHits;
 } counters;
 
 #ifndef MIN
 #define MIN(a, b) ((a < b) ? a : b)
 #endif
 
+/* pass this as the contentLength to snprintfResponseHeader when we're streaming something with an unknown length */
+#define RESPONSE_CONTENT_LENGTH_UNKNOWN ((size_t) -1)
+/* Sends are chunked to this when a bandwidth limit is on so one big writev doesn't get a whole burst to itself */
+#define BANDWIDTH_LIMITED_CHUNK_SIZE SEND_RECV_BUFFER_SIZE
+
+/* pre-rendered error responses that scanners hit all day long. Set up once by serverInit. Only the server's own
+ code paths hand these out - handlers calling responseAlloc404NotFoundHTML and friends get a response they can change */
+static struct StaticResponses {
+    bool initialized;
+    struct Response* forbidden403;
+    struct Response* notFound404;
+    struct Response* internalError500;
+} staticResponses;
+
+/* Just enough atomics for statistics that are updated from many threads without a lock */
+#ifdef WIN32
+#define ews_atomic_add64(pointer, value) InterlockedExchangeAdd64((volatile LONGLONG*) (pointer), (value))
+#define ews_atomic_cas64(pointer, expected, desired) ((expected) == InterlockedCompareExchange64((volatile LONGLONG*) (pointer), (desired), (expected)))
+#else
+#define ews_atomic_add64(pointer, value) __sync_fetch_and_add((pointer), (value))
+#define ews_atomic_cas64(pointer, expected, desired) __sync_bool_compare_and_swap((pointer), (expected), (desired))
+#endif
+#ifdef _MSC_VER
+#define ews_thread_local __declspec(thread)
+#else
+#define ews_thread_local __thread
+#endif
+
+typedef enum {
+    AllocationKindHeapString,
+    AllocationKindResponse,
+    AllocationKindConnection,
+    AllocationKindsCount
+} AllocationKind;
+
+struct AllocationTagStatistics {
+    /* NULL for untagged */
+    const char* tag;
+    int64_t allocations[AllocationKindsCount];
+    int64_t bytesAllocated;
+    int64_t liveBytes[AllocationKindsCount];
+    int64_t liveBytesTotal;
+    int64_t liveBytesHighWaterMark;
+};
+
+/* tags[0] is untagged. Objects remember tag index + 1 so 0 can mean "not tracked" */
+static struct AllocationProfile {
+    bool initialized;
+    pthread_mutex_t lock;
+    int64_t tagsCount;
+    struct AllocationTagStatistics tags[ALLOCATION_PROFILE_MAX_TAGS];
+} allocationProfile = { false };
+
+/* index + 1 of the tag the current thread's allocations are charged to, 0 for untagged */
+static ews_thread_local int allocationProfileThreadTagIndex;
+
+/* USDT probes for bpftrace/perf/SystemTap. Each one is a single nop in the code plus a note in the binary until
+ something attaches to it. They're on automatically when <sys/sdt.h> is around (systemtap-sdt-dev(el)); define
+ EWS_NO_USDT_PROBES to leave them out. The probes (provider "ews") are:
+ connection__accept(fd)
+ connection__start(fd, remoteHost, remotePort)
+ request__parsed(method, path, bodyLength)
+ handler__start(method, path)
+ handler__done(path, status or -1 if the handler took over the connection)
+ response__sent(path, status, bytesSent, 0 on success)
+ connection__close(fd, bytesReceived, bytesSent)
+ For example: bpftrace -e 'usdt:./EWSDemo:ews:response__sent { @bytes[str(arg0)] = sum(arg2); }' */
+#if !defined(WIN32) && !defined(EWS_NO_USDT_PROBES) && !defined(EWS_USDT_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define EWS_USDT_PROBES 1
+#endif
+#endif
+#ifdef EWS_USDT_PROBES
+#include <sys/sdt.h>
+#define EWS_PROBE1(name, a) DTRACE_PROBE1(ews, name, a)
+#define EWS_PROBE2(name, a, b) DTRACE_PROBE2(ews, name, a, b)
+#define EWS_PROBE3(name, a, b, c) DTRACE_PROBE3(ews, name, a, b, c)
+#define EWS_PROBE4(name, a, b, c, d) DTRACE_PROBE4(ews, name, a, b, c, d)
+#else
+#define EWS_PROBE1(name, a) do {} while (0)
+#define EWS_PROBE2(name, a, b) do {} while (0)
+#define EWS_PROBE3(name, a, b, c) do {} while (0)
+#define EWS_PROBE4(name, a, b, c, d) do {} while (0)
+#endif
+
 struct PathInformation {
     bool exists;
     bool isDirectory;
+    /* the path itself is a symlink (a reparse point on Windows). exists and isDirectory describe what it points to */
+    bool isSymbolicLink;
 };
 
 static void responseFree(struct Response* response);
@@ -381,9 +1182,78 @@ static void ignoreSIGPIPE();
 static void callWSAStartupIfNecessary();
 static FILE* fopen_utf8_path(const char* utf8Path, const char* mode);
 static int pathInformationGet(const char* path, struct PathInformation* info);
-static int sendResponseBody(struct Connection* connection, const struct Response* response, ssize_t* bytesSent);
+static int sendResponseBody(struct Connection* connection, const struct Response* response, const char* etagOrNULL, ssize_t* bytesSent);
 static int sendResponseFile(struct Connection* connection, const struct Response* response, ssize_t* bytesSent);
-static int snprintfResponseHeader(char* destination, size_t destinationCapacity, int code, const char* status, const char* contentType, const char* extraHeaders, size_t contentLength);
+static int snprintfResponseHeader(char* destination, size_t destinationCapacity, int code, const char* status, const char* contentType, const char* extraHeaders, size_t contentLength, const char* etagOrNULL);
+static int sendResponseSerialized(struct Connection* connection, const struct Response* response, ssize_t* bytesSent);
+static int sendResponseSegments(struct Connection* connection, const struct Response* response, const char* etagOrNULL, ssize_t* bytesSent);
+static int sendResponseNotModified(struct Connection* connection, const char* etag, const char* extraHeaders, ssize_t* bytesSent);
+static bool responseETagCreate(const struct Response* response, char* etag, size_t etagCapacity);
+static bool requestIfNoneMatchMatches(const struct Request* request, const char* etag);
+static int sendBuffers(struct Connection* connection, struct ResponseSegment* buffers, size_t buffersCount, ssize_t* bytesSent);
+static int sendResponseFileDescriptor(struct Connection* connection, const struct Response* response, ssize_t* bytesSent);
+static void staticResponsesInit(void);
+static struct Response* responseShared404NotFound(void);
+static struct Response* responseShared500InternalError(void);
+static int threadPinToCPU(int cpu);
+static int socketIncomingCPU(sockettype socketfd);
+static bool socketPeerClosed(sockettype socketfd);
+static uint64_t hashFNV1a64(const void* data, size_t length);
+static uint64_t hashFNV1a64Continue(uint64_t hash, const void* data, size_t length);
+static void missingPathCacheInit(void);
+static int fileMapReadOnly(const char* path, void** mappingOut, size_t* lengthOut);
+static int64_t fileWarm(const char* path, int64_t maxFileSize);
+static void fileUnmap(void* mapping, size_t length);
+static void* sharedMemoryCreate(const char* name, size_t length, size_t processIDOffset);
+static void sharedMemoryDestroy(const char* name, void* mapping, size_t length);
+static int64_t processID(void);
+static void serverStoreInit(struct ServerStore* store);
+static void serverStoreFree(struct ServerStore* store);
+static void diskIOPoolStart(struct DiskIOPool* pool);
+static void diskIOPoolStop(struct DiskIOPool* pool);
+static void diskReadInline(struct DiskRead* read);
+static bool batchedSubRequestMayRunInParallel(const struct Server* server, const struct Request* request);
+static void diskReadStart(struct DiskIOPool* pool, struct DiskRead* read, FILE* fp, void* buffer, size_t capacity);
+static void diskReadWait(struct DiskIOPool* pool, struct DiskRead* read);
+static void sleepNanoseconds(int64_t nanoseconds);
+static bool connectionBandwidthLimited(const struct Connection* connection);
+static ConnectionPriority connectionPriorityForRequest(const struct Server* server, const struct Request* request);
+static void threadAndSocketSetPriority(sockettype socketfd, ConnectionPriority priority);
+static void connectionBandwidthWait(struct Connection* connection, size_t bytes);
+static int64_t monotonicNanoseconds(void);
+static int mutexLockWithStatistics(pthread_mutex_t* mutex, struct LockStatistics* statistics);
+static int mutexUnlockWithStatistics(pthread_mutex_t* mutex, struct LockStatistics* statistics);
+static void countersLock(void);
+static void countersUnlock(void);
+static struct Connection* connectionMoveToLocalMemory(struct Connection* connection);
+static void heavyHittersInit(struct HeavyHitters* heavyHitters);
+static void heavyHittersDestroy(struct HeavyHitters* heavyHitters);
+static void heavyHittersRecord(struct HeavyHitters* heavyHitters, const char* key, size_t keyLength);
+static int socketTCPInfoGet(sockettype socketfd, struct TCPInfoSample* sample);
+static void tcpInfoStatisticsInit(struct TCPInfoStatistics* statistics);
+static void connectionTCPInfoSample(struct Connection* connection);
+static uint64_t traceTicks(void);
+static void connectionTraceStart(struct Connection* connection);
+static void connectionTraceMark(struct Connection* connection, ConnectionTracePoint point);
+static void connectionTraceFinish(struct Connection* connection);
+static double traceTicksPerNanosecond(uint64_t epochTicks, int64_t epochNanoseconds);
+static void slowRequestLogInit(struct SlowRequestLog* slowLog, const struct Server* server);
+static void slowRequestLogStop(struct SlowRequestLog* slowLog);
+static void slowRequestLogPush(struct SlowRequestLog* slowLog, const struct Connection* connection, int64_t durationNanoseconds);
+static void slowRequestRecordFormat(struct HeapString* line, const struct SlowRequestRecord* record, double ticksPerNanosecond);
+static void connectionRegistryAdd(struct Connection* connection);
+static void connectionRegistryUpdate(struct Connection* connection, ConnectionState state);
+static void connectionRegistryBytesSent(struct Connection* connection, int64_t bytesSent);
+static void connectionRegistryRemove(struct Connection* connection);
+static void statsSegmentFill(struct Server* server, struct StatsSegment* staging, struct ConnectionRegistrySlot* connections);
+static void statsSegmentPublish(struct StatsSegment* segment, const struct StatsSegment* staging);
+static void statsPublisherStop(struct StatsPublisher* publisher);
+static void allocationProfileInit(void);
+static int allocationProfileCurrentTagIndex(void);
+static void allocationProfileAdd(int tagIndex, AllocationKind kind, int64_t bytesDelta, bool isNewAllocation);
+#ifdef EWS_PROFILER_SUPPORTED
+static void profilerFrameNameAppend(struct HeapString* stack, const char* symbol);
+#endif
 
 #ifdef WIN32 /* Windows implementations of functions available on Linux/Mac OS X */
     /* opendir/readdir/closedir API implementation with FindNextFile */
@@ -405,11 +1275,21 @@ static int snprintfResponseHeader(char* destination, size_t destinationCapacity,
     static int pthread_cond_init(pthread_cond_t* cond, const void* attributes);
     static int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex);
     static int pthread_cond_signal(pthread_cond_t* cond);
+    static int pthread_cond_broadcast(pthread_cond_t* cond);
+    static int pthread_join(pthread_t threadHandle, void** result);
     static int pthread_cond_destroy(pthread_cond_t* cond);
     static int pthread_mutex_init(pthread_mutex_t* mutex, const void* attributes);
     static int pthread_mutex_lock(pthread_mutex_t* mutex);
     static int pthread_mutex_unlock(pthread_mutex_t* mutex);
     static int pthread_mutex_destroy(pthread_mutex_t* mutex);
+    static int pthread_mutex_trylock(pthread_mutex_t* mutex);
+    static int pthread_rwlock_init(pthread_rwlock_t* rwlock, const void* attributes);
+    static int pthread_rwlock_rdlock(pthread_rwlock_t* rwlock);
+    static int pthread_rwlock_wrlock(pthread_rwlock_t* rwlock);
+    static int pthread_rwlock_tryrdlock(pthread_rwlock_t* rwlock);
+    static int pthread_rwlock_trywrlock(pthread_rwlock_t* rwlock);
+    static int pthread_rwlock_unlock(pthread_rwlock_t* rwlock);
+    static int pthread_rwlock_destroy(pthread_rwlock_t* rwlock);
     static int snprintf(char* destination, size_t length, const char* format, ...);
     static int strcasecmp(const char* utf8String1, const char* utf8String2);
     static wchar_t* strdupWideFromUTF8(const char* utf8String, size_t extraBytes);
@@ -423,12 +1303,17 @@ static int snprintfResponseHeader(char* destination, size_t destinationCapacity,
 #endif // Linux/Mac OS X
 
 #ifdef EWS_FUZZ_TEST
+/* Where responses go. The persistent fuzzer points this at /dev/null so the terminal doesn't slow it down */
+#ifndef EWS_FUZZ_OUTPUT_FD
+#define EWS_FUZZ_OUTPUT_FD STDOUT_FILENO
+#endif
 #define recv(socket, buffer, bufferLength, flags) read(socket, buffer, bufferLength)
-#define send(socket, buffer, bufferLength, flags) write(STDOUT_FILENO, buffer, bufferLength)
+#define send(socket, buffer, bufferLength, flags) write(EWS_FUZZ_OUTPUT_FD, buffer, bufferLength)
 #define CHECK_SERVED_FILES_WITH_REALPATH 
 #endif
 
 static THREAD_RETURN_TYPE STDCALL_ON_WIN32 connectionHandlerThread(void* connectionPointer);
+static void connectionRespond(struct Connection* connection);
 
 typedef enum {
     URLDecodeTypeWholeURL,
@@ -526,7 +1411,7 @@ static char* strdupEscapeForURL(const char* stringToEscape) {
         }
         p++;
     }
-    return escapedString.contents;
+    return heapStringReleaseContents(&escapedString);
 }
 
 char* strdupEscapeForHTML(const char* stringToEscape) {
@@ -565,7 +1450,7 @@ char* strdupEscapeForHTML(const char* stringToEscape) {
                 break;
         }
     }
-    return escapedString.contents;
+    return heapStringReleaseContents(&escapedString);
 }
 
 /* Is someone using ../ to try to read a directory outside of the documentRoot? */
@@ -675,22 +1560,27 @@ static void heapStringReallocIfNeeded(struct HeapString* string, size_t minimumC
     if (minimumCapacity <= string->capacity) {
         return;
     }
+    bool previouslyAllocated = string->contents != NULL;
+    size_t previousCapacity = previouslyAllocated ? string->capacity : 0;
     /* to avoid many reallocations every time we call AppendChar, round up to the next power of two */
     string->capacity = heapStringNextAllocationSize(minimumCapacity);
     assert(string->capacity > 0 && "We are about to allocate a string with 0 capacity. We should have checked this condition above");
-    bool previouslyAllocated = string->contents != NULL;
     string->contents = (char*) realloc(string->contents, string->capacity);
 	/* zero out the newly allocated memory */
     memset(&string->contents[string->length], 0, string->capacity - string->length);
+    if (!previouslyAllocated) {
+        string->allocationTagIndex = allocationProfileCurrentTagIndex();
+    }
+    allocationProfileAdd(string->allocationTagIndex, AllocationKindHeapString, (int64_t) string->capacity - (int64_t) previousCapacity, !previouslyAllocated);
     if (OptionIncludeStatusPageAndCounters) {
-        pthread_mutex_lock(&counters.lock);
+        countersLock();
         if (previouslyAllocated) {
             counters.heapStringReallocations++;
         } else {
             counters.heapStringAllocations++;
         }
         counters.heapStringTotalBytesReallocated += string->capacity;
-        pthread_mutex_unlock(&counters.lock);
+        countersUnlock();
     }
 }
 
@@ -748,6 +1638,30 @@ static void heapStringAppendHeapString(struct HeapString* target, const struct H
     target->contents[target->length] = '\0';
 }
 
+static void heapStringAppendJSONString(struct HeapString* string, const char* contents, size_t length) {
+    /* worst case every character is \u00XX */
+    heapStringReallocIfNeeded(string, string->length + length * 6 + 3);
+    heapStringAppendChar(string, '"');
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char) contents[i];
+        switch (c) {
+            case '"': heapStringAppendString(string, "\\\""); break;
+            case '\\': heapStringAppendString(string, "\\\\"); break;
+            case '\n': heapStringAppendString(string, "\\n"); break;
+            case '\r': heapStringAppendString(string, "\\r"); break;
+            case '\t': heapStringAppendString(string, "\\t"); break;
+            default:
+                if (c < 0x20) {
+                    heapStringAppendFormat(string, "\\u%04x", c);
+                } else {
+                    heapStringAppendChar(string, (char) c);
+                }
+                break;
+        }
+    }
+    heapStringAppendChar(string, '"');
+}
+
 static bool heapStringIsSaneCString(const struct HeapString* heapString) {
     if (NULL == heapString->contents) {
         if (heapString->capacity != 0) {
@@ -796,30 +1710,50 @@ static void heapStringInit(struct HeapString* string) {
     string->capacity = 0;
     string->contents = NULL;
     string->length = 0;
+    string->allocationTagIndex = 0;
 }
 
 static void heapStringFreeContents(struct HeapString* string) {
     if (NULL != string->contents) {
         assert(string->capacity > 0 && "A heap string had a capacity > 0 with non-NULL contents which implies a malloc(0)");
+        allocationProfileAdd(string->allocationTagIndex, AllocationKindHeapString, -(int64_t) string->capacity, false);
+        string->allocationTagIndex = 0;
         free(string->contents);
         string->contents = NULL;
         string->capacity = 0;
         string->length = 0;
         if (OptionIncludeStatusPageAndCounters) {
-            pthread_mutex_lock(&counters.lock);
+            countersLock();
             counters.heapStringFrees++;
-            pthread_mutex_unlock(&counters.lock);
+            countersUnlock();
         }
     } else {
         assert(string->capacity == 0 && "Why did a string with a NULL contents have a capacity > 0? This is not correct and may indicate corruption");
     }
 }
+
+/* free() won't tell the allocation profile about it so the bytes are credited back here */
+static char* heapStringReleaseContents(struct HeapString* string) {
+    char* contents = string->contents;
+    if (NULL != contents) {
+        allocationProfileAdd(string->allocationTagIndex, AllocationKindHeapString, -(int64_t) string->capacity, false);
+        if (OptionIncludeStatusPageAndCounters) {
+            countersLock();
+            counters.heapStringFrees++;
+            countersUnlock();
+        }
+    }
+    heapStringInit(string);
+    return contents;
+}
+
 struct HeapString connectionDebugStringCreate(const struct Connection* connection) {
     struct HeapString debugString = {0};
     heapStringAppendFormat(&debugString, "%s %s from %s:%s\n", connection->request.method, connection->request.path, connection->remoteHost, connection->remotePort);
     heapStringAppendFormat(&debugString, "Request URL Path decoded to '%s'\n", connection->request.pathDecoded);
     heapStringAppendFormat(&debugString, "Bytes sent:%" PRId64 "\n", connection->status.bytesSent);
     heapStringAppendFormat(&debugString, "Bytes received:%" PRId64 "\n", connection->status.bytesReceived);
+    heapStringAppendFormat(&debugString, "Incoming CPU:%d\n", connection->incomingCPU);
     heapStringAppendFormat(&debugString, "Final request parse state:%d\n", connection->request.state);
     heapStringAppendFormat(&debugString, "Header pool used:%" PRIu64 "\n", (uint64_t) connection->request.headersStringPoolOffset);
     heapStringAppendFormat(&debugString, "Header count:%" PRIu64 "\n", (uint64_t) connection->request.headersCount);
@@ -867,6 +1801,25 @@ struct HeapString connectionDebugStringCreate(const struct Connection* connectio
     return debugString;
 }
 
+bool connectionPeerClosed(struct Connection* connection) {
+    if (connection->peerClosed) {
+        return true;
+    }
+    /* batched sub-requests don't have a socket of their own - the client that matters is the batch's */
+    sockettype socketfd = NULL != connection->batchParent ? connection->batchParent->socketfd : connection->socketfd;
+    if (!socketPeerClosed(socketfd)) {
+        return false;
+    }
+    ews_printf_debug("%s:%s closed the connection while we were working on '%s'\n", connection->remoteHost, connection->remotePort, connection->request.path);
+    connection->peerClosed = true;
+    if (OptionIncludeStatusPageAndCounters) {
+        countersLock();
+        counters.responsesForClosedConnections++;
+        countersUnlock();
+    }
+    return true;
+}
+
 static void poolStringStartNewString(struct PoolString* poolString, struct Request* request) {
     /* always re-initialize the length...just in case */
     poolString->length = 0;
@@ -903,19 +1856,24 @@ static void poolStringAppendChar(struct Request* request, struct PoolString* str
 struct Response* responseAlloc(int code, const char* status, const char* contentType, size_t bodyCapacity) {
     struct Response* response = (struct Response*) calloc(1, sizeof(*response));
     response->code = code;
+    response->allocationTagIndex = allocationProfileCurrentTagIndex();
+    allocationProfileAdd(response->allocationTagIndex, AllocationKindResponse, sizeof(*response), true);
     heapStringInit(&response->body);
     response->body.capacity = bodyCapacity;
     response->body.length = 0;
     if (response->body.capacity > 0) {
         response->body.contents = (char*) calloc(1, response->body.capacity);
+        response->body.allocationTagIndex = response->allocationTagIndex;
+        allocationProfileAdd(response->body.allocationTagIndex, AllocationKindHeapString, (int64_t) response->body.capacity, true);
         if (OptionIncludeStatusPageAndCounters) {
-            pthread_mutex_lock(&counters.lock);
+            countersLock();
             counters.heapStringAllocations++;
-            pthread_mutex_unlock(&counters.lock);
+            countersUnlock();
         }
     }
     response->contentType = strdupIfNotNull(contentType);
     response->status = strdupIfNotNull(status);
+    response->fdToSend = -1;
     return response;
 }
 
@@ -933,7 +1891,7 @@ struct Response* responseAllocHTMLWithFormat(const char* format, ...) {
 }
 
 struct Response* responseAllocHTMLWithStatus(int code, const char* status, const char* html) {
-    struct Response* response = responseAlloc(200, "OK", "text/html; charset=UTF-8", 0);
+    struct Response* response = responseAlloc(code, status, "text/html; charset=UTF-8", 0);
     heapStringSetToCString(&response->body, html);
     return response;
 }
@@ -952,7 +1910,7 @@ struct Response* responseAllocJSONWithFormat(const char* format, ...) {
 }
 
 struct Response* responseAllocJSONWithStatus(int code, const char* status, const char* json) {
-    struct Response* response = responseAlloc(200, "OK", "application/json", 0);
+    struct Response* response = responseAlloc(code, status, "application/json", 0);
     heapStringSetToCString(&response->body, json);
     return response;
 }
@@ -1021,6 +1979,92 @@ static bool requestMatchesPathPrefix(const char* requestPathDecoded, const char*
     }
     return false;
 }
+/* Paths under a documentRoot we recently found didn't exist. Direct mapped by hash: a new miss just replaces whatever
+ was in its slot so the memory is bounded. The path is kept to rule out hash collisions */
+struct MissingPathCacheEntry {
+    uint64_t hash;
+    int64_t insertedAtNanoseconds;
+    char* path; /* documentRoot/suffix */
+};
+
+static struct MissingPathCache {
+    bool initialized;
+    struct RWLock lock;
+    struct MissingPathCacheEntry entries[MISSING_PATH_CACHE_ENTRIES];
+} missingPathCache;
+
+/* called from serverInit, which happens before there are any connections */
+static void missingPathCacheInit() {
+    if (missingPathCache.initialized) {
+        return;
+    }
+    rwLockInit(&missingPathCache.lock, "missing path cache");
+    missingPathCache.initialized = true;
+}
+
+static uint64_t missingPathHash(const char* documentRoot, const char* requestPathSuffix) {
+    uint64_t hash = hashFNV1a64(documentRoot, strlen(documentRoot));
+    hash = hashFNV1a64Continue(hash, "/", 1);
+    return hashFNV1a64Continue(hash, requestPathSuffix, strlen(requestPathSuffix));
+}
+
+static bool missingPathEntryMatches(const struct MissingPathCacheEntry* entry, uint64_t hash, const char* documentRoot, const char* requestPathSuffix) {
+    if (NULL == entry->path || entry->hash != hash) {
+        return false;
+    }
+    size_t documentRootLength = strlen(documentRoot);
+    return 0 == strncmp(entry->path, documentRoot, documentRootLength) &&
+        '/' == entry->path[documentRootLength] &&
+        0 == strcmp(entry->path + documentRootLength + 1, requestPathSuffix);
+}
+
+static bool missingPathCacheContains(const char* documentRoot, const char* requestPathSuffix) {
+    if (!missingPathCache.initialized) {
+        return false;
+    }
+    uint64_t hash = missingPathHash(documentRoot, requestPathSuffix);
+    struct MissingPathCacheEntry* entry = &missingPathCache.entries[hash % MISSING_PATH_CACHE_ENTRIES];
+    int64_t now = monotonicNanoseconds();
+    bool found = false;
+    rwLockReadLock(&missingPathCache.lock);
+    if (missingPathEntryMatches(entry, hash, documentRoot, requestPathSuffix)) {
+        found = now - entry->insertedAtNanoseconds < (int64_t) MISSING_PATH_CACHE_MILLISECONDS * 1000000;
+    }
+    rwLockUnlock(&missingPathCache.lock);
+    return found;
+}
+
+static void missingPathCacheAdd(const char* documentRoot, const char* requestPathSuffix) {
+    if (!missingPathCache.initialized || strlen(documentRoot) + strlen(requestPathSuffix) > MISSING_PATH_CACHE_MAX_PATH_LENGTH) {
+        return;
+    }
+    uint64_t hash = missingPathHash(documentRoot, requestPathSuffix);
+    struct MissingPathCacheEntry* entry = &missingPathCache.entries[hash % MISSING_PATH_CACHE_ENTRIES];
+    /* build the new path outside of the lock */
+    struct HeapString path;
+    heapStringInit(&path);
+    heapStringAppendFormat(&path, "%s/%s", documentRoot, requestPathSuffix);
+    rwLockWriteLock(&missingPathCache.lock);
+    char* oldPath = entry->path;
+    entry->hash = hash;
+    entry->insertedAtNanoseconds = monotonicNanoseconds();
+    entry->path = heapStringReleaseContents(&path);
+    rwLockUnlock(&missingPathCache.lock);
+    free(oldPath);
+}
+
+void documentRootMissingPathsForget() {
+    if (!missingPathCache.initialized) {
+        return;
+    }
+    rwLockWriteLock(&missingPathCache.lock);
+    for (size_t i = 0; i < MISSING_PATH_CACHE_ENTRIES; i++) {
+        free(missingPathCache.entries[i].path);
+        missingPathCache.entries[i].path = NULL;
+    }
+    rwLockUnlock(&missingPathCache.lock);
+}
+
 /*
 Here's how the path logic works:
 
@@ -1088,7 +2132,19 @@ struct Response* responseAllocServeFileFromRequestPath(const char* pathPrefix, c
     }
     // Step 3 (see above)
     if (pathEscapesDocumentRoot(requestPathSuffix)) {
-        return responseAllocHTMLWithStatus(403, "Forbidden", "<html><head><title>Forbidden</title></head><body>You are not allowed to access this URL</body></html>");
+        if (staticResponses.initialized) {
+            return staticResponses.forbidden403;
+        }
+        return responseAllocHTMLWithStatus(403, "Forbidden", "<html><head><title>403 - Forbidden</title></head><body>You are forbidden from accessing this URL.</body></html>");
+    }
+    /* Did we just look for this and not find it? */
+    if (missingPathCacheContains(documentRoot, requestPathSuffix)) {
+        if (OptionIncludeStatusPageAndCounters) {
+            countersLock();
+            counters.missingPathCacheHits++;
+            countersUnlock();
+        }
+        return responseShared404NotFound();
     }
     // Step 4 (see above)
     struct HeapString filePath;
@@ -1107,11 +2163,11 @@ struct Response* responseAllocServeFileFromRequestPath(const char* pathPrefix, c
         heapStringFreeContents(&filePath);
         return responseAlloc500InternalErrorHTML("Information about the path could not be determined for your request");
     }
-    /* ok the file is really not found */
+    /* ok the file is really not found. Scanners hit this a lot so use the pre-rendered 404 (which also doesn't tell them where the documentRoot is) */
     if (!pathInfo.exists) {
-        struct Response* response = responseAlloc404NotFoundHTML(filePath.contents);
         heapStringFreeContents(&filePath);
-        return response;
+        missingPathCacheAdd(documentRoot, requestPathSuffix);
+        return responseShared404NotFound();
     }
 #ifdef CHECK_SERVED_FILES_WITH_REALPATH
 #ifdef WIN32
@@ -1135,6 +2191,10 @@ struct Response* responseAllocServeFileFromRequestPath(const char* pathPrefix, c
     if (pathInfo.isDirectory) {
         if (!OptionListDirectoryContents) {
             ews_printf("Failed to serve directory: OptionListDirectoryContents is false so we aren't serving the directory contents/listing for request '%s' documentRoot '%s', pointing at dir '%s'\n", requestPathDecoded, documentRoot, filePath.contents);
+            heapStringFreeContents(&filePath);
+            if (staticResponses.initialized) {
+                return staticResponses.forbidden403;
+            }
             return responseAllocHTMLWithStatus(403, "Forbidden", "<html><head><title>403 - Forbidden</title></head><body>You are forbidden from accessing this URL.</body></html>");
         }
         /* If it's a directory, see if we can serve up index.html */
@@ -1198,66 +2258,460 @@ struct Response* responseAllocServeFileFromRequestPath(const char* pathPrefix, c
     return response;
 }
 
-struct Response* responseAlloc400BadRequestHTML(const char* errorMessage) {
-    if (NULL == errorMessage) {
-        errorMessage = "An unspecified error occurred";
+struct DocumentRootWarmStatistics {
+    int64_t startNanoseconds;
+    int64_t files;
+    int64_t directories;
+    int64_t bytesWarmed;
+};
+
+static void documentRootWarm(struct HeapString* path, int depth, struct DocumentRootWarmStatistics* statistics) {
+    /* directory symlinks aren't followed so this is just for absurdly deep trees */
+    if (depth > 32) {
+        return;
     }
-    return responseAllocWithFormat(400, "Bad Request", "text/html; charset=UTF-8", "<html><head><title>400 - Bad Request</title></head><body>The request made was invalid. %s", errorMessage);
+    DIR* dir = opendir(path->contents);
+    if (NULL == dir) {
+        return;
+    }
+    statistics->directories++;
+    size_t pathLength = path->length;
+    struct dirent* entry;
+    while (NULL != (entry = readdir(dir)) && statistics->bytesWarmed < DOCUMENT_ROOT_WARM_MAX_TOTAL_SIZE) {
+        if (0 == strcmp(entry->d_name, ".") || 0 == strcmp(entry->d_name, "..")) {
+            continue;
+        }
+        heapStringAppendChar(path, '/');
+        heapStringAppendString(path, entry->d_name);
+        struct PathInformation pathInfo;
+        if (0 == pathInformationGet(path->contents, &pathInfo) && pathInfo.exists) {
+            if (pathInfo.isDirectory) {
+                /* a link back up the tree would have us walk it over and over, exponentially with more than one link */
+                if (!pathInfo.isSymbolicLink) {
+                    documentRootWarm(path, depth + 1, statistics);
+                }
+            } else {
+                int64_t warmed = fileWarm(path->contents, MIN(DOCUMENT_ROOT_WARM_MAX_FILE_SIZE, DOCUMENT_ROOT_WARM_MAX_TOTAL_SIZE - statistics->bytesWarmed));
+                if (warmed >= 0) {
+                    statistics->files++;
+                    statistics->bytesWarmed += warmed;
+                }
+            }
+        }
+        path->length = pathLength;
+        path->contents[pathLength] = '\0';
+    }
+    closedir(dir);
 }
 
-struct Response* responseAlloc404NotFoundHTML(const char* resourcePathOrNull) {
-    if (NULL == resourcePathOrNull) {
-        return responseAllocHTMLWithStatus(404, "Not Found", "<html><head><title>404 Not Found</title></head><body>The resource you specified could not be found</body></html>");
-    } else {
-        return responseAllocWithFormat(404, "Not Found", "text/html; charset=UTF-8", "<html><head><title>404 Not Found</title></head><body>The resource you specified ('%s') could not be found</body></html>", resourcePathOrNull);
+static THREAD_RETURN_TYPE STDCALL_ON_WIN32 documentRootWarmThread(void* documentRootPointer) {
+    char* documentRoot = (char*) documentRootPointer;
+    struct DocumentRootWarmStatistics statistics;
+    memset(&statistics, 0, sizeof(statistics));
+    statistics.startNanoseconds = monotonicNanoseconds();
+    struct HeapString path;
+    heapStringInit(&path);
+    heapStringSetToCString(&path, documentRoot);
+    documentRootWarm(&path, 0, &statistics);
+    ews_printf("Warmed documentRoot '%s': %" PRId64 " directories, %" PRId64 " files, read ahead %" PRId64 " bytes in %" PRId64 "ms\n",
+        documentRoot, statistics.directories, statistics.files, statistics.bytesWarmed, (monotonicNanoseconds() - statistics.startNanoseconds) / 1000000);
+    heapStringFreeContents(&path);
+    free(documentRoot);
+    return (THREAD_RETURN_TYPE) 0;
+}
+
+void documentRootWarmInBackground(const char* documentRoot) {
+    pthread_t warmThread;
+    char* documentRootCopy = strdup(documentRoot);
+    int result = pthread_create(&warmThread, NULL, &documentRootWarmThread, documentRootCopy);
+    if (0 != result) {
+        ews_printf("Could not start the thread to warm documentRoot '%s'. pthread_create returned %d. Skipping that\n", documentRoot, result);
+        free(documentRootCopy);
+        return;
     }
+    pthread_detach(warmThread);
 }
 
-struct Response* responseAlloc500InternalErrorHTML(const char* extraInformationOrNull) {
-    if (NULL == extraInformationOrNull) {
-        return responseAllocHTMLWithStatus(500, "Internal Error", "<html><head><title>500 Internal Error</title></head><body>There was an internal error while completing your request</body></html>");
-    } else {
-        return responseAllocWithFormat(500, "Internal Error", "text/html; charset=UTF-8", "<html><head><title>500 Internal Error</title></head><body>There was an internal error while completing your request. %s</body></html>", extraInformationOrNull);
+#define TAR_BLOCK_SIZE 512
+
+/* tar stores numbers as octal text, which older tars pad with leading spaces. Big GNU sizes (base-256) aren't supported */
+static size_t tarOctal(const uint8_t* field, size_t fieldLength) {
+    size_t i = 0;
+    while (i < fieldLength && (' ' == field[i] || '\0' == field[i])) {
+        i++;
+    }
+    size_t value = 0;
+    for (; i < fieldLength && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = value * 8 + (field[i] - '0');
     }
+    return value;
 }
 
-struct Response* responseAllocWithFile(const char* filename, const char* MIMETypeOrNULL) {
-    struct Response* response = responseAlloc(200, "OK", MIMETypeOrNULL, 0);
-    response->filenameToSend = strdup(filename);
-    return response;
+/* The checksum is the sum of the header's bytes with the checksum field itself counted as spaces */
+static bool tarHeaderChecksumValid(const uint8_t* header) {
+    size_t sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+        sum += i >= 148 && i < 156 ? ' ' : header[i];
+    }
+    return sum == tarOctal(header + 148, 8);
 }
 
-static void responseFree(struct Response* response) {
-    if (NULL != response->status) {
-        free(response->status);
+static const struct ArchiveEntry* archiveEntryFind(const struct ArchiveDocumentRoot* archive, const char* name, size_t nameLength) {
+    if (0 == archive->tableCapacity) {
+        return NULL;
     }
-    if (NULL != response->filenameToSend) {
-        free(response->filenameToSend);
+    uint64_t hash = hashFNV1a64(name, nameLength);
+    size_t slot = hash & (archive->tableCapacity - 1);
+    while (0 != archive->table[slot]) {
+        const struct ArchiveEntry* entry = &archive->entries[archive->table[slot] - 1];
+        if (entry->nameHash == hash && 0 == strncmp(entry->name, name, nameLength) && '\0' == entry->name[nameLength]) {
+            return entry;
+        }
+        slot = (slot + 1) & (archive->tableCapacity - 1);
     }
-    if (NULL != response->contentType) {
-        free(response->contentType);
+    return NULL;
+}
+
+static void archiveEntryAdd(struct ArchiveDocumentRoot* archive, char* name, const uint8_t* data, size_t length, size_t* entriesCapacity) {
+    /* later entries replace earlier ones like tar -x would */
+    while ('.' == name[0] && '/' == name[1]) {
+        memmove(name, name + 2, strlen(name + 2) + 1);
     }
-    if (NULL != response->extraHeaders) {
-        free(response->extraHeaders);
+    if (archive->entriesCount == *entriesCapacity) {
+        *entriesCapacity = 0 == *entriesCapacity ? 64 : *entriesCapacity * 2;
+        archive->entries = (struct ArchiveEntry*) realloc(archive->entries, *entriesCapacity * sizeof(struct ArchiveEntry));
     }
-    heapStringFreeContents(&response->body);
-    free(response);
+    struct ArchiveEntry* entry = &archive->entries[archive->entriesCount++];
+    entry->name = name;
+    entry->nameHash = hashFNV1a64(name, strlen(name));
+    entry->data = data;
+    entry->length = length;
+    /* compressed members are sent as whatever they were before compression */
+    const char* uncompressedName = name;
+    char* nameWithoutGz = NULL;
+    if (strEndsWith(name, ".gz")) {
+        nameWithoutGz = strdup(name);
+        nameWithoutGz[strlen(nameWithoutGz) - 3] = '\0';
+        uncompressedName = nameWithoutGz;
+    }
+    entry->contentType = MIMETypeFromFile(uncompressedName, data, nameWithoutGz != NULL ? 0 : MIN(length, (size_t) 100));
+    free(nameWithoutGz);
 }
 
-/* Only grab another header if we have space for it. This was revealed to be open for attack by afl-fuzz! */
-static RequestParseState stateHeaderNameIfSpaceLeft(struct Request* request) {
-    if (request->headersCount < REQUEST_MAX_HEADERS) {
-        if (!request->warnings.headersStringPoolExhausted) {
-            return RequestParseStateHeaderName;
+static int archiveIndex(struct ArchiveDocumentRoot* archive) {
+    size_t entriesCapacity = 0;
+    size_t offset = 0;
+    char* longName = NULL;
+    while (offset + TAR_BLOCK_SIZE <= archive->length) {
+        const uint8_t* header = archive->data + offset;
+        if ('\0' == header[0]) {
+            break; /* the end of archive is two zero blocks */
         }
-    } else {
-        request->warnings.tooManyHeaders = true;
+        if (!tarHeaderChecksumValid(header)) {
+            ews_printf("The archive is corrupt or isn't a tar file: the header at offset %" PRIu64 " has the wrong checksum\n", (uint64_t) offset);
+            free(longName);
+            return 1;
+        }
+        size_t entryLength = tarOctal(header + 124, 12);
+        char type = (char) header[156];
+        const uint8_t* entryData = header + TAR_BLOCK_SIZE;
+        if (entryLength > archive->length - offset - TAR_BLOCK_SIZE) {
+            ews_printf("The archive is truncated: entry at offset %" PRIu64 " says it's %" PRIu64 " bytes long but the archive ends first\n", (uint64_t) offset, (uint64_t) entryLength);
+            free(longName);
+            return 1;
+        }
+        if ('L' == type) {
+            /* GNU long name for the next entry */
+            free(longName);
+            longName = (char*) calloc(1, entryLength + 1);
+            memcpy(longName, entryData, entryLength);
+        } else if ('0' == type || '\0' == type || '7' == type) {
+            char* name;
+            if (NULL != longName) {
+                name = longName;
+                longName = NULL;
+            } else {
+                /* ustar splits long names into prefix/name */
+                char prefix[156] = {0};
+                char shortName[101] = {0};
+                memcpy(shortName, header, 100);
+                if (0 == memcmp(header + 257, "ustar", 5)) {
+                    memcpy(prefix, header + 345, 155);
+                }
+                size_t nameCapacity = strlen(prefix) + strlen(shortName) + 2;
+                name = (char*) malloc(nameCapacity);
+                snprintf(name, nameCapacity, "%s%s%s", prefix, '\0' != prefix[0] ? "/" : "", shortName);
+            }
+            archiveEntryAdd(archive, name, entryData, entryLength, &entriesCapacity);
+        } else {
+            /* directories, links, pax headers... */
+            free(longName);
+            longName = NULL;
+        }
+        offset += TAR_BLOCK_SIZE + (entryLength + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
     }
-    return RequestParseStateEatHeaders;
-}
-
-/* parses a typical HTTP request looking for the first line: GET /path HTTP/1.0\r\n */
+    free(longName);
+    archive->tableCapacity = 16;
+    while (archive->tableCapacity < archive->entriesCount * 2) {
+        archive->tableCapacity *= 2;
+    }
+    archive->table = (uint32_t*) calloc(archive->tableCapacity, sizeof(uint32_t));
+    for (size_t i = 0; i < archive->entriesCount; i++) {
+        size_t slot = archive->entries[i].nameHash & (archive->tableCapacity - 1);
+        while (0 != archive->table[slot]) {
+            struct ArchiveEntry* existing = &archive->entries[archive->table[slot] - 1];
+            if (existing->nameHash == archive->entries[i].nameHash && 0 == strcmp(existing->name, archive->entries[i].name)) {
+                break;
+            }
+            slot = (slot + 1) & (archive->tableCapacity - 1);
+        }
+        archive->table[slot] = (uint32_t) i + 1;
+    }
+    return 0;
+}
+
+struct ArchiveDocumentRoot* archiveDocumentRootOpenFromMemory(const void* data, size_t length) {
+    struct ArchiveDocumentRoot* archive = (struct ArchiveDocumentRoot*) calloc(1, sizeof(*archive));
+    archive->data = (const uint8_t*) data;
+    archive->length = length;
+    if (0 != archiveIndex(archive)) {
+        archiveDocumentRootClose(archive);
+        return NULL;
+    }
+    ews_printf_debug("Indexed %" PRIu64 " files in the archive\n", (uint64_t) archive->entriesCount);
+    return archive;
+}
+
+struct ArchiveDocumentRoot* archiveDocumentRootOpen(const char* archivePath) {
+    void* mapping = NULL;
+    size_t mappingLength = 0;
+    if (0 != fileMapReadOnly(archivePath, &mapping, &mappingLength)) {
+        ews_printf("Unable to use '%s' as a document root because we could not memory map it\n", archivePath);
+        return NULL;
+    }
+    struct ArchiveDocumentRoot* archive = archiveDocumentRootOpenFromMemory(mapping, mappingLength);
+    if (NULL == archive) {
+        ews_printf("Unable to use '%s' as a document root because it isn't a tar file we understand\n", archivePath);
+        fileUnmap(mapping, mappingLength);
+        return NULL;
+    }
+    archive->mapping = mapping;
+    archive->mappingLength = mappingLength;
+    return archive;
+}
+
+void archiveDocumentRootClose(struct ArchiveDocumentRoot* archive) {
+    for (size_t i = 0; i < archive->entriesCount; i++) {
+        free(archive->entries[i].name);
+    }
+    free(archive->entries);
+    free(archive->table);
+    if (NULL != archive->mapping) {
+        fileUnmap(archive->mapping, archive->mappingLength);
+    }
+    free(archive);
+}
+
+struct Response* responseAllocServeFileFromArchive(const char* pathPrefix, const struct Request* request, const struct ArchiveDocumentRoot* archive) {
+    if (NULL == pathPrefix) {
+        pathPrefix = "/";
+    }
+    size_t matchLength = 0;
+    if (!requestMatchesPathPrefix(request->pathDecoded, pathPrefix, &matchLength)) {
+        return responseAlloc400BadRequestHTML("You requested the server to serve a path it doesn't know. Use the <code>requestMatchesPathPrefix</code> before passing this path. Or use a <code>pathPrefix</code> of <code>/</code> to have the server serve files from all URLs.");
+    }
+    const char* requestPathSuffix = request->pathDecoded + matchLength;
+    while ('/' == *requestPathSuffix || '\\' == *requestPathSuffix) {
+        requestPathSuffix++;
+    }
+    /* room for /index.html and .gz. Names that still don't fit can't be in the archive anyway */
+    char name[sizeof(request->pathDecoded) + sizeof("/index.html.gz")];
+    size_t suffixLength = strlen(requestPathSuffix);
+    bool isDirectory = 0 == suffixLength || '/' == requestPathSuffix[suffixLength - 1];
+    int nameLength = snprintf(name, sizeof(name), "%s%s", requestPathSuffix, isDirectory ? "index.html" : "");
+    if (nameLength < 0 || (size_t) nameLength >= sizeof(name)) {
+        return responseShared404NotFound();
+    }
+    const struct ArchiveEntry* entry = archiveEntryFind(archive, name, (size_t) nameLength);
+    if (NULL == entry && !isDirectory) {
+        /* a directory without the trailing / */
+        nameLength = snprintf(name, sizeof(name), "%s/index.html", requestPathSuffix);
+        if (nameLength < 0 || (size_t) nameLength >= sizeof(name)) {
+            return responseShared404NotFound();
+        }
+        entry = archiveEntryFind(archive, name, (size_t) nameLength);
+    }
+    if (NULL == entry) {
+        return responseShared404NotFound();
+    }
+    const struct Header* acceptEncoding = headerInRequest("Accept-Encoding", request);
+    const struct ArchiveEntry* compressedEntry = NULL;
+    if (NULL != acceptEncoding && NULL != strstr(acceptEncoding->value.contents, "gzip") && !strEndsWith(name, ".gz") &&
+        (size_t) nameLength + strlen(".gz") < sizeof(name)) {
+        memcpy(name + nameLength, ".gz", sizeof(".gz"));
+        compressedEntry = archiveEntryFind(archive, name, (size_t) nameLength + strlen(".gz"));
+    }
+    struct Response* response = responseAlloc(200, "OK", entry->contentType, 0);
+    if (NULL != compressedEntry) {
+        response->extraHeaders = strdup("Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n");
+        entry = compressedEntry;
+    }
+    responseAppendSegment(response, entry->data, entry->length, NULL, NULL);
+    return response;
+}
+
+struct Response* responseAlloc400BadRequestHTML(const char* errorMessage) {
+    if (NULL == errorMessage) {
+        errorMessage = "An unspecified error occurred";
+    }
+    return responseAllocWithFormat(400, "Bad Request", "text/html; charset=UTF-8", "<html><head><title>400 - Bad Request</title></head><body>The request made was invalid. %s", errorMessage);
+}
+
+struct Response* responseAlloc404NotFoundHTML(const char* resourcePathOrNull) {
+    if (NULL == resourcePathOrNull) {
+        return responseAllocHTMLWithStatus(404, "Not Found", "<html><head><title>404 Not Found</title></head><body>The resource you specified could not be found</body></html>");
+    } else {
+        return responseAllocWithFormat(404, "Not Found", "text/html; charset=UTF-8", "<html><head><title>404 Not Found</title></head><body>The resource you specified ('%s') could not be found</body></html>", resourcePathOrNull);
+    }
+}
+
+struct Response* responseAlloc500InternalErrorHTML(const char* extraInformationOrNull) {
+    if (NULL == extraInformationOrNull) {
+        return responseAllocHTMLWithStatus(500, "Internal Error", "<html><head><title>500 Internal Error</title></head><body>There was an internal error while completing your request</body></html>");
+    } else {
+        return responseAllocWithFormat(500, "Internal Error", "text/html; charset=UTF-8", "<html><head><title>500 Internal Error</title></head><body>There was an internal error while completing your request. %s</body></html>", extraInformationOrNull);
+    }
+}
+
+struct Response* responseAllocStatic(int code, const char* status, const char* contentType, const char* body) {
+    struct Response* response = responseAlloc(code, status, contentType, 0);
+    response->isStatic = true;
+    size_t bodyLength = strlen(body);
+    char header[RESPONSE_HEADER_SIZE];
+    int headerLength = snprintfResponseHeader(header, sizeof(header), code, status, contentType, NULL, bodyLength, NULL);
+    char* serialized = (char*) malloc(headerLength + bodyLength + 1);
+    memcpy(serialized, header, headerLength);
+    memcpy(serialized + headerLength, body, bodyLength + 1);
+    response->serialized = serialized;
+    response->serializedLength = headerLength + bodyLength;
+    return response;
+}
+
+struct Response* responseAllocHTMLNoCopy(const char* html) {
+    return responseAllocWithBodyNoCopy(200, "OK", "text/html; charset=UTF-8", html, strlen(html));
+}
+
+struct Response* responseAllocJSONNoCopy(const char* json) {
+    return responseAllocWithBodyNoCopy(200, "OK", "application/json", json, strlen(json));
+}
+
+struct Response* responseAllocWithBodyNoCopy(int code, const char* status, const char* contentType, const void* body, size_t bodyLength) {
+    struct Response* response = responseAlloc(code, status, contentType, 0);
+    responseAppendSegment(response, body, bodyLength, NULL, NULL);
+    return response;
+}
+
+void responseAppendSegment(struct Response* response, const void* data, size_t length, void (*release)(void* releaseContext), void* releaseContext) {
+    assert(!response->isStatic && "Static responses are shared and can't be modified");
+    if (response->segmentsCount == response->segmentsCapacity) {
+        response->segmentsCapacity = response->segmentsCapacity == 0 ? 4 : response->segmentsCapacity * 2;
+        response->segments = (struct ResponseSegment*) realloc(response->segments, response->segmentsCapacity * sizeof(struct ResponseSegment));
+    }
+    struct ResponseSegment* segment = &response->segments[response->segmentsCount++];
+    segment->data = data;
+    segment->length = length;
+    segment->release = release;
+    segment->releaseContext = releaseContext;
+}
+
+#ifndef WIN32
+struct Response* responseAllocWithFileDescriptor(int fd, int64_t lengthOrNegative, const char* contentType, bool closeWhenFreed) {
+    struct Response* response = responseAlloc(200, "OK", NULL == contentType ? "application/octet-stream" : contentType, 0);
+    response->fdToSend = fd;
+    response->fdLength = lengthOrNegative;
+    response->fdCloseWhenFreed = closeWhenFreed;
+    return response;
+}
+#endif
+
+/* kind of hacky and not thread-safe like the counters lock, but serverInit is called before any connections */
+static void staticResponsesInit() {
+    if (staticResponses.initialized) {
+        return;
+    }
+    staticResponses.forbidden403 = responseAllocStatic(403, "Forbidden", "text/html; charset=UTF-8", "<html><head><title>403 - Forbidden</title></head><body>You are forbidden from accessing this URL.</body></html>");
+    staticResponses.notFound404 = responseAllocStatic(404, "Not Found", "text/html; charset=UTF-8", "<html><head><title>404 Not Found</title></head><body>The resource you specified could not be found</body></html>");
+    staticResponses.internalError500 = responseAllocStatic(500, "Internal Error", "text/html; charset=UTF-8", "<html><head><title>500 Internal Error</title></head><body>There was an internal error while completing your request</body></html>");
+    staticResponses.initialized = true;
+}
+
+static struct Response* responseShared404NotFound() {
+    if (staticResponses.initialized) {
+        return staticResponses.notFound404;
+    }
+    return responseAlloc404NotFoundHTML(NULL);
+}
+
+static struct Response* responseShared500InternalError() {
+    if (staticResponses.initialized) {
+        return staticResponses.internalError500;
+    }
+    return responseAlloc500InternalErrorHTML(NULL);
+}
+
+struct Response* responseAllocWithFile(const char* filename, const char* MIMETypeOrNULL) {
+    struct Response* response = responseAlloc(200, "OK", MIMETypeOrNULL, 0);
+    response->filenameToSend = strdup(filename);
+    return response;
+}
+
+static void responseFree(struct Response* response) {
+    if (response->isStatic) {
+        return;
+    }
+    if (NULL != response->status) {
+        free(response->status);
+    }
+    if (NULL != response->filenameToSend) {
+        free(response->filenameToSend);
+    }
+    if (NULL != response->contentType) {
+        free(response->contentType);
+    }
+    if (NULL != response->extraHeaders) {
+        free(response->extraHeaders);
+    }
+    heapStringFreeContents(&response->body);
+    for (size_t i = 0; i < response->segmentsCount; i++) {
+        if (NULL != response->segments[i].release) {
+            response->segments[i].release(response->segments[i].releaseContext);
+        }
+    }
+    free(response->segments);
+#ifndef WIN32
+    if (response->fdCloseWhenFreed && response->fdToSend >= 0) {
+        close(response->fdToSend);
+    }
+#endif
+    allocationProfileAdd(response->allocationTagIndex, AllocationKindResponse, -(int64_t) sizeof(*response), false);
+    free(response);
+}
+
+/* Only grab another header if we have space for it. This was revealed to be open for attack by afl-fuzz! */
+static RequestParseState stateHeaderNameIfSpaceLeft(struct Request* request) {
+    if (request->headersCount < REQUEST_MAX_HEADERS) {
+        if (!request->warnings.headersStringPoolExhausted) {
+            return RequestParseStateHeaderName;
+        }
+    } else {
+        request->warnings.tooManyHeaders = true;
+    }
+    return RequestParseStateEatHeaders;
+}
+
+/* parses a typical HTTP request looking for the first line: GET /path HTTP/1.0\r\n */
 static void requestParse(struct Request* request, const char* requestFragment, size_t requestFragmentLength) {
+    RequestParseState stateBefore = request->state;
     for (size_t i = 0; i < requestFragmentLength; i++) {
         char c = requestFragment[i];
         switch (request->state) {
@@ -1367,6 +2821,8 @@ static void requestParse(struct Request* request, const char* requestFragment, s
                             }
                             if (contentLength > 0) {
                                 request->body.contents = (char*)calloc(1, contentLength + 1);
+                                request->body.allocationTagIndex = allocationProfileCurrentTagIndex();
+                                allocationProfileAdd(request->body.allocationTagIndex, AllocationKindHeapString, contentLength, true);
                             }
                             request->body.capacity = contentLength;
                             request->body.length = 0;
@@ -1402,6 +2858,9 @@ static void requestParse(struct Request* request, const char* requestFragment, s
                 break;
         }
     }
+    if (RequestParseStateDone == request->state && RequestParseStateDone != stateBefore) {
+        EWS_PROBE3(request__parsed, request->method, request->path, request->body.length);
+    }
 }
 
 static void requestPrintWarnings(const struct Request* request, const char* remoteHost, const char* remotePort) {
@@ -1429,14 +2888,235 @@ static struct Connection* connectionAlloc(struct Server* server) {
     struct Connection* connection = (struct Connection*) calloc(1, sizeof(*connection)); // calloc 0's everything which requestParse depends on
     connection->remoteAddrLength = sizeof(connection->remoteAddr);
     connection->server = server;
+    connection->incomingCPU = -1;
+    connection->priority = ConnectionPriorityNormal;
+    connection->registrySlot = -1;
+    connection->allocationTagIndex = allocationProfileCurrentTagIndex();
+    allocationProfileAdd(connection->allocationTagIndex, AllocationKindConnection, sizeof(*connection), true);
     return connection;
 }
 
+/* The acceptor thread allocated (and calloc touched) this connection, so on a multi-socket machine its buffers
+ live on the acceptor's NUMA node. Once the connection thread is pinned we allocate a fresh one from here so the
+ pages are first-touched on the node doing the work, and copy over the few fields accept filled out. */
+static struct Connection* connectionMoveToLocalMemory(struct Connection* connection) {
+    struct Connection* localConnection = connectionAlloc(connection->server);
+    localConnection->socketfd = connection->socketfd;
+    memcpy(&localConnection->remoteAddr, &connection->remoteAddr, sizeof(connection->remoteAddr));
+    localConnection->remoteAddrLength = connection->remoteAddrLength;
+    localConnection->incomingCPU = connection->incomingCPU;
+    localConnection->trace = connection->trace;
+    connectionFree(connection);
+    return localConnection;
+}
+
 static void connectionFree(struct Connection* connection) {
     heapStringFreeContents(&connection->request.body);
+    allocationProfileAdd(connection->allocationTagIndex, AllocationKindConnection, -(int64_t) sizeof(*connection), false);
     free(connection);
 }
 
+struct BatchedSubRequest {
+    struct Connection* connection;
+    struct Response* response;
+    pthread_t thread;
+    bool threadStarted;
+};
+
+static THREAD_RETURN_TYPE STDCALL_ON_WIN32 batchedSubRequestThread(void* subRequestPointer) {
+    struct BatchedSubRequest* subRequest = (struct BatchedSubRequest*) subRequestPointer;
+    /* the first sub-request runs on the batch's thread so don't let its route tag stick */
+    int allocationTagIndex = allocationProfileThreadTagIndex;
+    subRequest->response = createResponseForRequest(&subRequest->connection->request, subRequest->connection);
+    allocationProfileThreadTagIndex = allocationTagIndex;
+    return (THREAD_RETURN_TYPE) NULL;
+}
+
+/* Builds "GET path HTTP/1.1" + the batch's headers and parses it like it came off the socket, so handlers see exactly
+ what they would have if the client asked for path by itself */
+static struct Connection* batchedSubRequestConnectionAlloc(const struct Connection* parent, const struct Request* request, const char* path, size_t pathLength) {
+    struct Connection* connection = connectionAlloc(parent->server);
+    connection->socketfd = -1;
+    connection->batchParent = parent;
+    connection->priority = parent->priority;
+    memcpy(connection->remoteHost, parent->remoteHost, sizeof(connection->remoteHost));
+    memcpy(connection->remotePort, parent->remotePort, sizeof(connection->remotePort));
+    struct HeapString requestText;
+    heapStringInit(&requestText);
+    heapStringAppendString(&requestText, "GET ");
+    heapStringAppendFormat(&requestText, "%.*s", (int) pathLength, path);
+    heapStringAppendString(&requestText, " HTTP/1.1\r\n");
+    for (size_t i = 0; i < request->headersCount; i++) {
+        const struct Header* header = &request->headers[i];
+        if (NULL == header->name.contents || NULL == header->value.contents) {
+            continue;
+        }
+        /* the sub-request has no body */
+        if (0 == strcasecmp(header->name.contents, "Content-Length") || 0 == strcasecmp(header->name.contents, "Content-Type")) {
+            continue;
+        }
+        heapStringAppendFormat(&requestText, "%s: %s\r\n", header->name.contents, header->value.contents);
+    }
+    heapStringAppendString(&requestText, "\r\n");
+    requestParse(&connection->request, requestText.contents, requestText.length);
+    heapStringFreeContents(&requestText);
+    return connection;
+}
+
+/* The body exactly as it would have gone out after the HTTP header */
+static void batchedSubResponseBodyAppend(struct HeapString* body, const struct Response* response) {
+    if (response->isStatic) {
+        for (size_t i = 0; i + 4 <= response->serializedLength; i++) {
+            if (0 == memcmp(&response->serialized[i], "\r\n\r\n", 4)) {
+                size_t bodyOffset = i + 4;
+                heapStringReallocIfNeeded(body, body->length + response->serializedLength - bodyOffset + 1);
+                memcpy(&body->contents[body->length], &response->serialized[bodyOffset], response->serializedLength - bodyOffset);
+                body->length += response->serializedLength - bodyOffset;
+                body->contents[body->length] = '\0';
+                break;
+            }
+        }
+        return;
+    }
+    heapStringAppendHeapString(body, &response->body);
+    for (size_t i = 0; i < response->segmentsCount; i++) {
+        const struct ResponseSegment* segment = &response->segments[i];
+        heapStringReallocIfNeeded(body, body->length + segment->length + 1);
+        memcpy(&body->contents[body->length], segment->data, segment->length);
+        body->length += segment->length;
+        body->contents[body->length] = '\0';
+    }
+}
+
+static void batchedSubResponseAppendJSON(struct HeapString* json, const char* path, size_t pathLength, const struct Response* response) {
+    heapStringAppendString(json, "{\"path\":");
+    heapStringAppendJSONString(json, path, pathLength);
+    if (NULL == response) {
+        heapStringAppendString(json, ",\"status\":500,\"contentType\":null,\"body\":\"The handler took over the connection, which can't be done in a batch\"}");
+        return;
+    }
+    if (NULL != response->filenameToSend || response->fdToSend >= 0) {
+        heapStringAppendString(json, ",\"status\":500,\"contentType\":null,\"body\":\"File responses can't be batched\"}");
+        return;
+    }
+    heapStringAppendFormat(json, ",\"status\":%d,\"contentType\":", response->code);
+    if (NULL != response->contentType) {
+        heapStringAppendJSONString(json, response->contentType, strlen(response->contentType));
+    } else {
+        heapStringAppendString(json, "null");
+    }
+    heapStringAppendString(json, ",\"body\":");
+    struct HeapString body;
+    heapStringInit(&body);
+    batchedSubResponseBodyAppend(&body, response);
+    bool bodyIsJSON = NULL != response->contentType && 0 == strncmp(response->contentType, "application/json", strlen("application/json"));
+    if (bodyIsJSON && body.length > 0) {
+        heapStringAppendHeapString(json, &body);
+    } else {
+        heapStringAppendJSONString(json, body.contents, body.length);
+    }
+    heapStringFreeContents(&body);
+    heapStringAppendChar(json, '}');
+}
+
+static bool batchedSubRequestMayRunInParallel(const struct Server* server, const struct Request* request) {
+    if (NULL == server) {
+        return false;
+    }
+    for (size_t i = 0; i < server->parallelBatchPathPrefixesCount; i++) {
+        if (requestMatchesPathPrefix(request->pathDecoded, server->parallelBatchPathPrefixes[i], NULL)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+struct Response* responseAllocBatchedSubRequests(struct Connection* connection, const struct Request* request, bool parallel) {
+    if (NULL != connection->batchParent) {
+        return responseAllocHTMLWithStatus(400, "Bad Request", "<html><head><title>400 - Bad Request</title></head><body>Batches can't contain batches</body></html>");
+    }
+    /* POST: one path per line. GET: ?paths=/a,/b */
+    char* pathList;
+    char separator;
+    if (0 == strcmp(request->method, "POST")) {
+        pathList = strdup(NULL != request->body.contents ? request->body.contents : "");
+        separator = '\n';
+    } else {
+        pathList = strdupDecodeGETParam("paths=", request, "");
+        separator = ',';
+    }
+    struct BatchedSubRequest subRequests[BATCH_MAX_SUBREQUESTS];
+    const char* paths[BATCH_MAX_SUBREQUESTS];
+    size_t pathLengths[BATCH_MAX_SUBREQUESTS];
+    size_t subRequestsCount = 0;
+    const char* pathStart = pathList;
+    while ('\0' != *pathStart) {
+        const char* pathEnd = strchr(pathStart, separator);
+        if (NULL == pathEnd) {
+            pathEnd = pathStart + strlen(pathStart);
+        }
+        size_t pathLength = pathEnd - pathStart;
+        /* tolerate \r\n line endings and blank lines */
+        if (pathLength > 0 && '\r' == pathStart[pathLength - 1]) {
+            pathLength--;
+        }
+        if (pathLength > 0) {
+            if (BATCH_MAX_SUBREQUESTS == subRequestsCount) {
+                free(pathList);
+                return responseAllocHTMLWithStatus(400, "Bad Request", "<html><head><title>400 - Bad Request</title></head><body>Too many paths in the batch</body></html>");
+            }
+            if ('/' != pathStart[0] || pathLength >= sizeof(request->path) || NULL != memchr(pathStart, ' ', pathLength)) {
+                free(pathList);
+                return responseAllocHTMLWithStatus(400, "Bad Request", "<html><head><title>400 - Bad Request</title></head><body>Every path in a batch has to start with / and fit in a request</body></html>");
+            }
+            paths[subRequestsCount] = pathStart;
+            pathLengths[subRequestsCount] = pathLength;
+            subRequestsCount++;
+        }
+        pathStart = '\0' == *pathEnd ? pathEnd : pathEnd + 1;
+    }
+    if (0 == subRequestsCount) {
+        free(pathList);
+        return responseAllocHTMLWithStatus(400, "Bad Request", "<html><head><title>400 - Bad Request</title></head><body>Pass the paths to batch as ?paths=/a,/b or POST them one per line</body></html>");
+    }
+    for (size_t i = 0; i < subRequestsCount; i++) {
+        subRequests[i].connection = batchedSubRequestConnectionAlloc(connection, request, paths[i], pathLengths[i]);
+        subRequests[i].response = NULL;
+        subRequests[i].threadStarted = false;
+    }
+    /* the first one runs on this thread while the rest of the opted in ones run on their own */
+    if (parallel) {
+        for (size_t i = 1; i < subRequestsCount; i++) {
+            if (batchedSubRequestMayRunInParallel(connection->server, &subRequests[i].connection->request)) {
+                subRequests[i].threadStarted = 0 == pthread_create(&subRequests[i].thread, NULL, &batchedSubRequestThread, &subRequests[i]);
+            }
+        }
+    }
+    for (size_t i = 0; i < subRequestsCount; i++) {
+        if (!subRequests[i].threadStarted) {
+            batchedSubRequestThread(&subRequests[i]);
+        }
+    }
+    struct Response* response = responseAlloc(200, "OK", "application/json", 0);
+    heapStringAppendString(&response->body, "{\"responses\":[");
+    for (size_t i = 0; i < subRequestsCount; i++) {
+        if (subRequests[i].threadStarted) {
+            pthread_join(subRequests[i].thread, NULL);
+        }
+        if (i > 0) {
+            heapStringAppendChar(&response->body, ',');
+        }
+        batchedSubResponseAppendJSON(&response->body, paths[i], pathLengths[i], subRequests[i].response);
+        if (NULL != subRequests[i].response) {
+            responseFree(subRequests[i].response);
+        }
+        connectionFree(subRequests[i].connection);
+    }
+    heapStringAppendString(&response->body, "]}");
+    free(pathList);
+    return response;
+}
+
 static void SIGPIPEHandler(int signal) {
     /* SIGPIPE happens any time we try to send() and the connection is closed. So we just ignore it and check the return code of send...*/
     ews_printf_debug("Ignoring SIGPIPE\n");
@@ -1452,13 +3132,45 @@ void serverInit(struct Server* server) {
     pthread_cond_init(&server->stoppedCond, NULL);
     pthread_cond_init(&server->connectionFinishedCond, NULL);
     pthread_mutex_init(&server->connectionFinishedLock, NULL);
+    memset(&server->globalMutexStatistics, 0, sizeof(server->globalMutexStatistics));
+    server->globalMutexStatistics.name = "server globalMutex";
+    memset(&server->connectionFinishedLockStatistics, 0, sizeof(server->connectionFinishedLockStatistics));
+    server->connectionFinishedLockStatistics.name = "server connectionFinishedLock";
     server->activeConnectionCount = 0;
+    serverStoreInit(&server->store);
+    diskIOPoolStart(&server->diskIOPool);
+    bandwidthLimiterInit(&server->bandwidthLimiter, 0, 0);
+    server->connectionBandwidthLimitBytesPerSecond = 0;
+    server->defaultPriority = ConnectionPriorityNormal;
+    server->pathPrioritiesCount = 0;
+    server->parallelBatchPathPrefixesCount = 0;
+    server->controlRequestsInFlight = 0;
+    heavyHittersInit(&server->heavyHitterRemoteHosts);
+    heavyHittersInit(&server->heavyHitterPaths);
+    server->tcpInfoSampleEvery = 16;
+    tcpInfoStatisticsInit(&server->tcpInfoStatistics);
+    server->traceSampleEvery = 0;
+    server->traceSlowRequestMilliseconds = 500;
+    server->traceRing = (struct TraceRing*) calloc(1, sizeof(*server->traceRing));
+    server->traceRing->epochTicks = traceTicks();
+    server->traceRing->epochNanoseconds = monotonicNanoseconds();
+    server->slowRequestLogMilliseconds = 0;
+    server->slowRequestLogFile = stdout;
+    server->slowRequestLog = (struct SlowRequestLog*) calloc(1, sizeof(*server->slowRequestLog));
+    slowRequestLogInit(server->slowRequestLog, server);
+    server->connectionRegistry = (struct ConnectionRegistry*) calloc(1, sizeof(*server->connectionRegistry));
+    server->statsPublisher = NULL;
+    server->acceptThreadCPU = -1;
     server->shouldRun = true;
     server->initialized = true;
     ignoreSIGPIPE();
+    staticResponsesInit();
+    missingPathCacheInit();
+    allocationProfileInit();
     /* kind of hacky and not thread-safe but I'm ok with that for just these counters */
     if (!counters.lockInitialized) {
         pthread_mutex_init(&counters.lock, NULL);
+        counters.lockStatistics.name = "counters lock";
         counters.lockInitialized = true;
     }
 }
@@ -1482,6 +3194,32 @@ void serverStop(struct Server* server) {
 }
 
 void serverDeInit(struct Server* server) {
+    /* connection threads are detached and use the disk I/O pool, trace ring and registry until they finish. After
+     serverStop this doesn't wait at all */
+    pthread_mutex_lock(&server->connectionFinishedLock);
+    while (server->activeConnectionCount > 0) {
+        ews_printf_debug("Waiting for %d connections to finish before deinitializing the server...\n", server->activeConnectionCount);
+        pthread_cond_wait(&server->connectionFinishedCond, &server->connectionFinishedLock);
+    }
+    pthread_mutex_unlock(&server->connectionFinishedLock);
+    /* before the registry goes away since it reads it */
+    if (NULL != server->statsPublisher) {
+        statsPublisherStop(server->statsPublisher);
+        server->statsPublisher = NULL;
+    }
+    diskIOPoolStop(&server->diskIOPool);
+    bandwidthLimiterDestroy(&server->bandwidthLimiter);
+    heavyHittersDestroy(&server->heavyHitterRemoteHosts);
+    heavyHittersDestroy(&server->heavyHitterPaths);
+    pthread_mutex_destroy(&server->tcpInfoStatistics.lock);
+    free(server->traceRing);
+    server->traceRing = NULL;
+    slowRequestLogStop(server->slowRequestLog);
+    free(server->slowRequestLog);
+    server->slowRequestLog = NULL;
+    free(server->connectionRegistry);
+    server->connectionRegistry = NULL;
+    serverStoreFree(&server->store);
     pthread_mutex_destroy(&server->globalMutex);
     pthread_mutex_destroy(&server->stoppedMutex);
     pthread_cond_destroy(&server->stoppedCond);
@@ -1521,6 +3259,9 @@ static int acceptConnectionsUntilStoppedInternal(struct Server* server, const st
     assert(NULL != server && "Why was there no valid server when we got to acceptConnectionsUntilStoppedInternal? We should have something");
     assert(server->initialized && "The server was not initialized. Can you please call serverInit(&server) or pass NULL?");
     callWSAStartupIfNecessary();
+    if (server->acceptThreadCPU >= 0) {
+        threadPinToCPU(server->acceptThreadCPU);
+    }
     /* resolve the local address we are binding to so we can print it out later */
     char addressHost[256];
     char addressPort[20];
@@ -1582,9 +3323,14 @@ static int acceptConnectionsUntilStoppedInternal(struct Server* server, const st
             ews_printf("exiting because accept failed (probably interrupted) %s = %d\n", strerror(errno), errno);
             break;
         }
-        pthread_mutex_lock(&server->connectionFinishedLock);
+        connectionTraceStart(nextConnection);
+        EWS_PROBE1(connection__accept, nextConnection->socketfd);
+        if (OptionPinConnectionThreadsToIncomingCPU) {
+            nextConnection->incomingCPU = socketIncomingCPU(nextConnection->socketfd);
+        }
+        mutexLockWithStatistics(&server->connectionFinishedLock, &server->connectionFinishedLockStatistics);
         server->activeConnectionCount++;
-        pthread_mutex_unlock(&server->connectionFinishedLock);
+        mutexUnlockWithStatistics(&server->connectionFinishedLock, &server->connectionFinishedLockStatistics);
         
         pthread_t connectionThread;
         /* we just received a new connection, spawn a thread */
@@ -1619,8 +3365,25 @@ static int acceptConnectionsUntilStoppedInternal(struct Server* server, const st
 
 
 static int sendResponse(struct Connection* connection, const struct Response* response, ssize_t* bytesSent) {
+    if (NULL != response->serialized) {
+        return sendResponseSerialized(connection, response, bytesSent);
+    }
+    char etag[24];
+    const char* etagOrNULL = NULL;
+    if (OptionETagsForGeneratedResponses && responseETagCreate(response, etag, sizeof(etag))) {
+        if (requestIfNoneMatchMatches(&connection->request, etag)) {
+            return sendResponseNotModified(connection, etag, response->extraHeaders, bytesSent);
+        }
+        etagOrNULL = etag;
+    }
+    if (response->segmentsCount > 0) {
+        return sendResponseSegments(connection, response, etagOrNULL, bytesSent);
+    }
+    if (response->fdToSend >= 0) {
+        return sendResponseFileDescriptor(connection, response, bytesSent);
+    }
     if (response->body.length > 0) {
-        return sendResponseBody(connection, response, bytesSent);
+        return sendResponseBody(connection, response, etagOrNULL, bytesSent);
     }
     if (NULL != response->filenameToSend) {
         return sendResponseFile(connection, response, bytesSent);
@@ -1630,49 +3393,543 @@ static int sendResponse(struct Connection* connection, const struct Response* re
     return 1;
 }
 
-static int sendResponseBody(struct Connection* connection, const struct Response* response, ssize_t* bytesSent) {
-    /* First send the response HTTP headers */
-    int headerLength = snprintfResponseHeader(connection->responseHeader, sizeof(connection->responseHeader), response->code, response->status, response->contentType, response->extraHeaders, response->body.length);
-    ssize_t sendResult;
-    sendResult = send(connection->socketfd, connection->responseHeader, headerLength, 0);
-    if (sendResult != headerLength) {
-        ews_printf("Failed to respond to %s:%s because we could not send the HTTP response *header*. send returned %ld with %s = %d\n",
-               connection->remoteHost,
-               connection->remotePort,
-               (long) sendResult,
-               strerror(errno),
-               errno);
-        return -1;
-    }
-    if (OptionPrintResponse) {
-        fwrite(connection->responseHeader, 1, headerLength, stdout);
-    }
-    *bytesSent = *bytesSent + sendResult;
-    /* Second, if a response body exists, send that */
-    if (response->body.length > 0) {
-        sendResult = send(connection->socketfd, response->body.contents, response->body.length, 0);
-        if (sendResult != response->body.length) {
-            ews_printf("Failed to respond to %s:%s because we could not send the HTTP response *body*. send returned %" PRId64 " with %s = %d\n",
-                   connection->remoteHost,
-                   connection->remotePort,
-                   (int64_t) sendResult,
-                   strerror(errno),
-                   errno);
-            return -1;
-        }
-        if (OptionPrintResponse) {
-            fwrite(response->body.contents, 1, response->body.length, stdout);
-        }
-        *bytesSent = *bytesSent + sendResult;
+/* xxHash64 (https://github.com/Cyan4973/xxHash). Fast enough that hashing a response costs less than sending it */
+#define XXH64_PRIME1 11400714785074694791ULL
+#define XXH64_PRIME2 14029467366897019727ULL
+#define XXH64_PRIME3 1609587929392839161ULL
+#define XXH64_PRIME4 9650029242287828579ULL
+#define XXH64_PRIME5 2870177450012600261ULL
+
+struct XXH64State {
+    uint64_t accumulators[4];
+    uint8_t stripe[32];
+    size_t stripeLength;
+    uint64_t totalLength;
+};
+
+static uint64_t xxh64RotateLeft(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+/* the hash is defined on little endian reads */
+static uint64_t xxh64Read64(const uint8_t* bytes) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) {
+        value = (value << 8) | bytes[i];
     }
-    return 0;
+    return value;
 }
 
-static int sendResponseFile(struct Connection* connection, const struct Response* response, ssize_t* bytesSent) {
-    /* If you were writing a high-performance web server you could use 
-    sendfile, memory map the file, or any number of exciting things. But
-    here we just fread the first 100 bytes to figure out MIME type, then rewind
-    and send the file ~16KB at a time. */
+static uint64_t xxh64Round(uint64_t accumulator, uint64_t input) {
+    accumulator += input * XXH64_PRIME2;
+    accumulator = xxh64RotateLeft(accumulator, 31);
+    return accumulator * XXH64_PRIME1;
+}
+
+static uint64_t xxh64MergeRound(uint64_t hash, uint64_t accumulator) {
+    hash ^= xxh64Round(0, accumulator);
+    return hash * XXH64_PRIME1 + XXH64_PRIME4;
+}
+
+static void xxh64Init(struct XXH64State* state, uint64_t seed) {
+    memset(state, 0, sizeof(*state));
+    state->accumulators[0] = seed + XXH64_PRIME1 + XXH64_PRIME2;
+    state->accumulators[1] = seed + XXH64_PRIME2;
+    state->accumulators[2] = seed;
+    state->accumulators[3] = seed - XXH64_PRIME1;
+}
+
+static void xxh64Stripe(struct XXH64State* state, const uint8_t* stripe) {
+    for (int i = 0; i < 4; i++) {
+        state->accumulators[i] = xxh64Round(state->accumulators[i], xxh64Read64(stripe + i * 8));
+    }
+}
+
+static void xxh64Update(struct XXH64State* state, const void* data, size_t length) {
+    const uint8_t* bytes = (const uint8_t*) data;
+    if (0 == length) {
+        return;
+    }
+    state->totalLength += length;
+    if (state->stripeLength > 0) {
+        size_t fill = MIN(length, sizeof(state->stripe) - state->stripeLength);
+        memcpy(state->stripe + state->stripeLength, bytes, fill);
+        state->stripeLength += fill;
+        bytes += fill;
+        length -= fill;
+        if (state->stripeLength < sizeof(state->stripe)) {
+            return;
+        }
+        xxh64Stripe(state, state->stripe);
+        state->stripeLength = 0;
+    }
+    /* the hot loop: 4 independent lanes the CPU can run in parallel */
+    while (length >= 32) {
+        xxh64Stripe(state, bytes);
+        bytes += 32;
+        length -= 32;
+    }
+    memcpy(state->stripe, bytes, length);
+    state->stripeLength = length;
+}
+
+static uint64_t xxh64Digest(const struct XXH64State* state) {
+    uint64_t hash;
+    if (state->totalLength >= 32) {
+        hash = xxh64RotateLeft(state->accumulators[0], 1) + xxh64RotateLeft(state->accumulators[1], 7) +
+            xxh64RotateLeft(state->accumulators[2], 12) + xxh64RotateLeft(state->accumulators[3], 18);
+        for (int i = 0; i < 4; i++) {
+            hash = xxh64MergeRound(hash, state->accumulators[i]);
+        }
+    } else {
+        /* accumulators[2] is the seed */
+        hash = state->accumulators[2] + XXH64_PRIME5;
+    }
+    hash += state->totalLength;
+    const uint8_t* bytes = state->stripe;
+    size_t length = state->stripeLength;
+    while (length >= 8) {
+        hash ^= xxh64Round(0, xxh64Read64(bytes));
+        hash = xxh64RotateLeft(hash, 27) * XXH64_PRIME1 + XXH64_PRIME4;
+        bytes += 8;
+        length -= 8;
+    }
+    if (length >= 4) {
+        uint64_t value = (uint64_t) bytes[0] | ((uint64_t) bytes[1] << 8) | ((uint64_t) bytes[2] << 16) | ((uint64_t) bytes[3] << 24);
+        hash ^= value * XXH64_PRIME1;
+        hash = xxh64RotateLeft(hash, 23) * XXH64_PRIME2 + XXH64_PRIME3;
+        bytes += 4;
+        length -= 4;
+    }
+    while (length > 0) {
+        hash ^= (*bytes) * XXH64_PRIME5;
+        hash = xxh64RotateLeft(hash, 11) * XXH64_PRIME1;
+        bytes++;
+        length--;
+    }
+    hash ^= hash >> 33;
+    hash *= XXH64_PRIME2;
+    hash ^= hash >> 29;
+    hash *= XXH64_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/* Only for 200s with a body we have in memory. The content type goes in too so the same bytes as JSON and HTML differ */
+static bool responseETagCreate(const struct Response* response, char* etag, size_t etagCapacity) {
+    if (200 != response->code || NULL != response->filenameToSend || response->fdToSend >= 0 || (0 == response->body.length && 0 == response->segmentsCount)) {
+        return false;
+    }
+    struct XXH64State state;
+    xxh64Init(&state, 0);
+    if (NULL != response->contentType) {
+        xxh64Update(&state, response->contentType, strlen(response->contentType) + 1);
+    }
+    xxh64Update(&state, response->body.contents, response->body.length);
+    for (size_t i = 0; i < response->segmentsCount; i++) {
+        xxh64Update(&state, response->segments[i].data, response->segments[i].length);
+    }
+    snprintf(etag, etagCapacity, "%016" PRIx64, xxh64Digest(&state));
+    return true;
+}
+
+/* If-None-Match: "abc", W/"def" or * */
+static bool requestIfNoneMatchMatches(const struct Request* request, const char* etag) {
+    const struct Header* ifNoneMatch = headerInRequest("If-None-Match", request);
+    if (NULL == ifNoneMatch) {
+        return false;
+    }
+    const char* value = ifNoneMatch->value.contents;
+    if (0 == strcmp(value, "*")) {
+        return true;
+    }
+    size_t etagLength = strlen(etag);
+    for (const char* quote = strchr(value, '"'); NULL != quote; quote = strchr(quote + 1, '"')) {
+        if (0 == strncmp(quote + 1, etag, etagLength) && '"' == quote[1 + etagLength]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* The 304 has to carry the headers a 200 would for caching (Cache-Control, Vary, Expires...) so extraHeaders go out too */
+static int sendResponseNotModified(struct Connection* connection, const char* etag, const char* extraHeaders, ssize_t* bytesSent) {
+    int headerLength = snprintf(connection->responseHeader, sizeof(connection->responseHeader),
+        "HTTP/1.1 304 Not Modified\r\n"
+        "ETag: \"%s\"\r\n"
+        "Server: Embeddable Web Server/" EMBEDDABLE_WEB_SERVER_VERSION_STRING "\r\n"
+        "%s"
+        "\r\n",
+        etag,
+        NULL != extraHeaders ? extraHeaders : "");
+    ssize_t sendResult = send(connection->socketfd, connection->responseHeader, headerLength, 0);
+    if (sendResult != headerLength) {
+        ews_printf("Failed to respond to %s:%s because we could not send the 304 response. send returned %" PRId64 " with %s = %d\n",
+               connection->remoteHost,
+               connection->remotePort,
+               (int64_t) sendResult,
+               strerror(errno),
+               errno);
+        return -1;
+    }
+    if (OptionPrintResponse) {
+        fwrite(connection->responseHeader, 1, headerLength, stdout);
+    }
+    *bytesSent = *bytesSent + sendResult;
+    return 0;
+}
+
+static int sendResponseSerialized(struct Connection* connection, const struct Response* response, ssize_t* bytesSent) {
+    ssize_t sendResult = send(connection->socketfd, response->serialized, response->serializedLength, 0);
+    if (sendResult != (ssize_t) response->serializedLength) {
+        ews_printf("Failed to respond to %s:%s because we could not send the pre-rendered HTTP %d response. send returned %" PRId64 " with %s = %d\n",
+               connection->remoteHost,
+               connection->remotePort,
+               response->code,
+               (int64_t) sendResult,
+               strerror(errno),
+               errno);
+        return -1;
+    }
+    if (OptionPrintResponse) {
+        fwrite(response->serialized, 1, response->serializedLength, stdout);
+    }
+    *bytesSent = *bytesSent + sendResult;
+    return 0;
+}
+
+static int sendResponseSegments(struct Connection* connection, const struct Response* response, const char* etagOrNULL, ssize_t* bytesSent) {
+    size_t contentLength = response->body.length;
+    for (size_t i = 0; i < response->segmentsCount; i++) {
+        contentLength += response->segments[i].length;
+    }
+    int headerLength = snprintfResponseHeader(connection->responseHeader, sizeof(connection->responseHeader), response->code, response->status, response->contentType, response->extraHeaders, contentLength, etagOrNULL);
+    /* header, body, then the segments */
+    struct ResponseSegment stackBuffers[16];
+    struct ResponseSegment* buffers = stackBuffers;
+    size_t buffersCount = 0;
+    if (response->segmentsCount + 2 > sizeof(stackBuffers) / sizeof(stackBuffers[0])) {
+        buffers = (struct ResponseSegment*) malloc((response->segmentsCount + 2) * sizeof(struct ResponseSegment));
+    }
+    memset(buffers, 0, 2 * sizeof(struct ResponseSegment));
+    buffers[buffersCount].data = connection->responseHeader;
+    buffers[buffersCount++].length = headerLength;
+    if (response->body.length > 0) {
+        buffers[buffersCount].data = response->body.contents;
+        buffers[buffersCount++].length = response->body.length;
+    }
+    memcpy(&buffers[buffersCount], response->segments, response->segmentsCount * sizeof(struct ResponseSegment));
+    buffersCount += response->segmentsCount;
+    int result = sendBuffers(connection, buffers, buffersCount, bytesSent);
+    if (buffers != stackBuffers) {
+        free(buffers);
+    }
+    return result;
+}
+
+/* Gathers buffers into as few send calls as possible. Modifies buffers as it goes */
+static int sendBuffers(struct Connection* connection, struct ResponseSegment* buffers, size_t buffersCount, ssize_t* bytesSent) {
+    if (OptionPrintResponse) {
+        for (size_t i = 0; i < buffersCount; i++) {
+            fwrite(buffers[i].data, 1, buffers[i].length, stdout);
+        }
+    }
+    size_t current = 0;
+    while (current < buffersCount) {
+        if (0 == buffers[current].length) {
+            current++;
+            continue;
+        }
+        ssize_t sendResult;
+        /* with a bandwidth limit send one chunk at a time */
+        size_t maxSendLength = connectionBandwidthLimited(connection) ? BANDWIDTH_LIMITED_CHUNK_SIZE : (size_t) -1;
+#if defined(WIN32) || defined(EWS_FUZZ_TEST)
+        /* WSASend could gather these but it's not worth another code path */
+        size_t sendLength = MIN(buffers[current].length, maxSendLength);
+        if (maxSendLength != (size_t) -1) {
+            connectionBandwidthWait(connection, sendLength);
+        }
+        sendResult = send(connection->socketfd, (const char*) buffers[current].data, sendLength, 0);
+#else
+        struct iovec iov[16];
+        int iovCount = 0;
+        size_t sendLength = 0;
+        for (size_t i = current; i < buffersCount && iovCount < (int) (sizeof(iov) / sizeof(iov[0])) && sendLength < maxSendLength; i++) {
+            iov[iovCount].iov_base = (void*) buffers[i].data;
+            iov[iovCount].iov_len = MIN(buffers[i].length, maxSendLength - sendLength);
+            sendLength += iov[iovCount].iov_len;
+            iovCount++;
+        }
+        if (maxSendLength != (size_t) -1) {
+            connectionBandwidthWait(connection, sendLength);
+        }
+        sendResult = writev(connection->socketfd, iov, iovCount);
+#endif
+        if (sendResult <= 0) {
+            ews_printf("Failed to respond to %s:%s because we could not send the HTTP response. send returned %" PRId64 " with %s = %d\n",
+                   connection->remoteHost,
+                   connection->remotePort,
+                   (int64_t) sendResult,
+                   strerror(errno),
+                   errno);
+            return -1;
+        }
+        *bytesSent = *bytesSent + sendResult;
+        connectionRegistryBytesSent(connection, *bytesSent);
+        /* skip over what was sent, which can end in the middle of a buffer */
+        size_t sent = (size_t) sendResult;
+        while (sent > 0) {
+            if (sent >= buffers[current].length) {
+                sent -= buffers[current].length;
+                current++;
+            } else {
+                buffers[current].data = (const char*) buffers[current].data + sent;
+                buffers[current].length -= sent;
+                sent = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+#ifdef WIN32
+static int sendResponseFileDescriptor(struct Connection* connection, const struct Response* response, ssize_t* bytesSent) {
+    assert(0 && "responseAllocWithFileDescriptor isn't available on Windows");
+    return 1;
+}
+#else
+/* Copies through connection->sendRecvBuffer. Works for anything. Returns the bytes sent or -1. bytesSentBefore is the
+ header, so the connection registry shows the whole response going out */
+static int64_t fileDescriptorSendWithReadAndSend(struct Connection* connection, int fd, int64_t lengthOrNegative, int64_t bytesSentBefore) {
+    int64_t totalSent = 0;
+    while (lengthOrNegative < 0 || totalSent < lengthOrNegative) {
+        size_t readSize = sizeof(connection->sendRecvBuffer);
+        if (lengthOrNegative >= 0 && (int64_t) readSize > lengthOrNegative - totalSent) {
+            readSize = (size_t) (lengthOrNegative - totalSent);
+        }
+        ssize_t bytesRead = read(fd, connection->sendRecvBuffer, readSize);
+        if (bytesRead < 0 && EINTR == errno) {
+            continue;
+        }
+        if (bytesRead < 0) {
+            return -1;
+        }
+        if (0 == bytesRead) {
+            break;
+        }
+        if (connectionBandwidthLimited(connection)) {
+            connectionBandwidthWait(connection, bytesRead);
+        }
+        ssize_t sendResult = send(connection->socketfd, connection->sendRecvBuffer, bytesRead, 0);
+        if (sendResult != bytesRead) {
+            return -1;
+        }
+        if (OptionPrintResponse) {
+            fwrite(connection->sendRecvBuffer, 1, bytesRead, stdout);
+        }
+        totalSent += sendResult;
+        connectionRegistryBytesSent(connection, bytesSentBefore + totalSent);
+    }
+    return totalSent;
+}
+
+#if defined(__linux__) && !defined(EWS_FUZZ_TEST)
+/* Regular files -> socket in the kernel. *unsupported is set if sendfile refused the file before sending anything */
+static int64_t fileDescriptorSendWithSendfile(struct Connection* connection, int fd, int64_t lengthOrNegative, int64_t bytesSentBefore, bool* unsupported) {
+    int64_t totalSent = 0;
+    *unsupported = false;
+    while (lengthOrNegative < 0 || totalSent < lengthOrNegative) {
+        bool bandwidthLimited = connectionBandwidthLimited(connection);
+        size_t chunk = bandwidthLimited ? BANDWIDTH_LIMITED_CHUNK_SIZE : 1024 * 1024;
+        if (lengthOrNegative >= 0 && (int64_t) chunk > lengthOrNegative - totalSent) {
+            chunk = (size_t) (lengthOrNegative - totalSent);
+        }
+        if (bandwidthLimited) {
+            connectionBandwidthWait(connection, chunk);
+        }
+        ssize_t sent = sendfile(connection->socketfd, fd, NULL, chunk);
+        if (sent < 0 && EINTR == errno) {
+            continue;
+        }
+        if (sent < 0) {
+            *unsupported = 0 == totalSent && (EINVAL == errno || ENOSYS == errno);
+            return -1;
+        }
+        if (0 == sent) {
+            break;
+        }
+        totalSent += sent;
+        connectionRegistryBytesSent(connection, bytesSentBefore + totalSent);
+    }
+    return totalSent;
+}
+
+/* splice needs _GNU_SOURCE, which isn't in effect if a system header was included before this one */
+#ifdef SPLICE_F_MOVE
+/* Pipes, devices and sockets -> a pipe -> socket, all in the kernel. The pipe is just a page reference buffer */
+static int64_t fileDescriptorSendWithSplice(struct Connection* connection, int fd, int64_t lengthOrNegative, int64_t bytesSentBefore, bool* unsupported) {
+    int64_t totalSent = 0;
+    *unsupported = false;
+    int pipefds[2];
+    if (0 != pipe(pipefds)) {
+        *unsupported = true;
+        return -1;
+    }
+    while (lengthOrNegative < 0 || totalSent < lengthOrNegative) {
+        bool bandwidthLimited = connectionBandwidthLimited(connection);
+        size_t chunk = bandwidthLimited ? BANDWIDTH_LIMITED_CHUNK_SIZE : 64 * 1024;
+        if (lengthOrNegative >= 0 && (int64_t) chunk > lengthOrNegative - totalSent) {
+            chunk = (size_t) (lengthOrNegative - totalSent);
+        }
+        if (bandwidthLimited) {
+            connectionBandwidthWait(connection, chunk);
+        }
+        ssize_t spliced = splice(fd, NULL, pipefds[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (spliced < 0 && EINTR == errno) {
+            continue;
+        }
+        if (spliced < 0) {
+            *unsupported = 0 == totalSent && EINVAL == errno;
+            totalSent = -1;
+            break;
+        }
+        if (0 == spliced) {
+            break;
+        }
+        /* drain the pipe completely before reading more */
+        while (spliced > 0) {
+            ssize_t sent = splice(pipefds[0], NULL, connection->socketfd, NULL, spliced, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (sent < 0 && EINTR == errno) {
+                continue;
+            }
+            if (sent <= 0) {
+                close(pipefds[0]);
+                close(pipefds[1]);
+                return -1;
+            }
+            spliced -= sent;
+            totalSent += sent;
+        }
+        connectionRegistryBytesSent(connection, bytesSentBefore + totalSent);
+    }
+    close(pipefds[0]);
+    close(pipefds[1]);
+    return totalSent;
+}
+#endif // SPLICE_F_MOVE
+#endif
+
+static int sendResponseFileDescriptor(struct Connection* connection, const struct Response* response, ssize_t* bytesSent) {
+    int fd = response->fdToSend;
+    int64_t length = response->fdLength;
+    struct stat fdStat;
+    if (0 != fstat(fd, &fdStat)) {
+        ews_printf("Unable to satisfy request for '%s' because we could not fstat fd %d. %s = %d\n", connection->request.path, fd, strerror(errno), errno);
+        struct Response* errorResponse = responseShared500InternalError();
+        int result = sendResponse(connection, errorResponse, bytesSent);
+        responseFree(errorResponse);
+        return result;
+    }
+    bool isRegularFile = S_ISREG(fdStat.st_mode);
+    /* files in /proc claim to be 0 bytes so only trust a size if there is one */
+    if (length < 0 && isRegularFile && fdStat.st_size > 0) {
+        off_t position = lseek(fd, 0, SEEK_CUR);
+        if (position >= 0 && position <= fdStat.st_size) {
+            length = fdStat.st_size - position;
+        }
+    }
+    int headerLength = snprintfResponseHeader(connection->responseHeader, sizeof(connection->responseHeader), response->code, response->status, response->contentType, response->extraHeaders, length < 0 ? RESPONSE_CONTENT_LENGTH_UNKNOWN : (size_t) length, NULL);
+    ssize_t sendResult = send(connection->socketfd, connection->responseHeader, headerLength, 0);
+    if (sendResult != headerLength) {
+        ews_printf("Unable to satisfy request for '%s' because we could not send the HTTP header. %s = %d\n", connection->request.path, strerror(errno), errno);
+        return 1;
+    }
+    if (OptionPrintResponse) {
+        fwrite(connection->responseHeader, 1, headerLength, stdout);
+    }
+    *bytesSent = *bytesSent + sendResult;
+    int64_t bodySent = -1;
+    bool unsupported = true;
+#if defined(__linux__) && !defined(EWS_FUZZ_TEST)
+    /* OptionPrintResponse needs to see the bytes so it has to go through user space */
+    if (!OptionPrintResponse) {
+        if (isRegularFile) {
+            bodySent = fileDescriptorSendWithSendfile(connection, fd, length, *bytesSent, &unsupported);
+        } else {
+#ifdef SPLICE_F_MOVE
+            bodySent = fileDescriptorSendWithSplice(connection, fd, length, *bytesSent, &unsupported);
+#endif
+        }
+    }
+#endif
+    if (bodySent < 0 && unsupported) {
+        bodySent = fileDescriptorSendWithReadAndSend(connection, fd, length, *bytesSent);
+    }
+    if (bodySent < 0) {
+        ews_printf("Failed to respond to %s:%s because we could not send from fd %d. %s = %d\n", connection->remoteHost, connection->remotePort, fd, strerror(errno), errno);
+        return 1;
+    }
+    *bytesSent = *bytesSent + bodySent;
+    if (length >= 0 && bodySent != length) {
+        /* we promised a Content-Length we couldn't deliver. Closing the connection tells the client */
+        ews_printf("Warning: fd %d ended after %" PRId64 " of %" PRId64 " bytes for request '%s'\n", fd, bodySent, length, connection->request.path);
+        return 1;
+    }
+    return 0;
+}
+#endif // WIN32
+
+static int sendResponseBody(struct Connection* connection, const struct Response* response, const char* etagOrNULL, ssize_t* bytesSent) {
+    /* First send the response HTTP headers */
+    int headerLength = snprintfResponseHeader(connection->responseHeader, sizeof(connection->responseHeader), response->code, response->status, response->contentType, response->extraHeaders, response->body.length, etagOrNULL);
+    ssize_t sendResult;
+    sendResult = send(connection->socketfd, connection->responseHeader, headerLength, 0);
+    if (sendResult != headerLength) {
+        ews_printf("Failed to respond to %s:%s because we could not send the HTTP response *header*. send returned %ld with %s = %d\n",
+               connection->remoteHost,
+               connection->remotePort,
+               (long) sendResult,
+               strerror(errno),
+               errno);
+        return -1;
+    }
+    if (OptionPrintResponse) {
+        fwrite(connection->responseHeader, 1, headerLength, stdout);
+    }
+    *bytesSent = *bytesSent + sendResult;
+    /* Second, if a response body exists, send that */
+    if (response->body.length > 0 && connectionBandwidthLimited(connection)) {
+        /* the same path responses with segments take, which sends one chunk at a time */
+        struct ResponseSegment body;
+        memset(&body, 0, sizeof(body));
+        body.data = response->body.contents;
+        body.length = response->body.length;
+        return sendBuffers(connection, &body, 1, bytesSent);
+    }
+    if (response->body.length > 0) {
+        sendResult = send(connection->socketfd, response->body.contents, response->body.length, 0);
+        if (sendResult != response->body.length) {
+            ews_printf("Failed to respond to %s:%s because we could not send the HTTP response *body*. send returned %" PRId64 " with %s = %d\n",
+                   connection->remoteHost,
+                   connection->remotePort,
+                   (int64_t) sendResult,
+                   strerror(errno),
+                   errno);
+            return -1;
+        }
+        if (OptionPrintResponse) {
+            fwrite(response->body.contents, 1, response->body.length, stdout);
+        }
+        *bytesSent = *bytesSent + sendResult;
+    }
+    return 0;
+}
+
+static int sendResponseFile(struct Connection* connection, const struct Response* response, ssize_t* bytesSent) {
+    /* If you were writing a high-performance web server you could use 
+    sendfile, memory map the file, or any number of exciting things. But
+    here we just fread the first 100 bytes to figure out MIME type, then rewind
+    and send the file ~16KB at a time. */
     struct Response* errorResponse = NULL;
     FILE* fp = fopen_utf8_path(response->filenameToSend, "rb");
     int result = 0;
@@ -1682,9 +3939,14 @@ static int sendResponseFile(struct Connection* connection, const struct Response
     size_t actualMIMEReadSize;
     const char* contentType = NULL;
     const size_t MIMEReadSize = 100;
+    struct DiskIOPool* diskIOPool = NULL != connection->server ? &connection->server->diskIOPool : NULL;
+    struct DiskRead reads[2];
+    char* readBuffers[2] = {NULL, NULL};
+    int currentRead = 0;
+    bool readInFlight = false;
     if (NULL == fp) {
         ews_printf("Unable to satisfy request for '%s' because we could not open the file '%s' %s = %d\n", connection->request.path, response->filenameToSend, strerror(errno), errno);
-        errorResponse = responseAlloc404NotFoundHTML(connection->request.path);
+        errorResponse = responseShared404NotFound();
         goto exit;
     }
     /* If the MIME type if specified in the response->contentType, use that. Otherwise try to guess with MIMETypeFromFile */
@@ -1708,154 +3970,1965 @@ static int sendResponseFile(struct Connection* connection, const struct Response
         errorResponse = responseAlloc500InternalErrorHTML("fseek to end of file failed");
         goto exit;
     }
-    fileLength = ftell(fp);
-    if (fileLength < 0) {
-        ews_printf("Unable to satisfy request for '%s' because we could not ftell on the file '%s' %s = %d\n", connection->request.path, response->filenameToSend, strerror(errno), errno);
-        errorResponse = responseAlloc500InternalErrorHTML("ftell to determine file length failed");
-        goto exit;
+    fileLength = ftell(fp);
+    if (fileLength < 0) {
+        ews_printf("Unable to satisfy request for '%s' because we could not ftell on the file '%s' %s = %d\n", connection->request.path, response->filenameToSend, strerror(errno), errno);
+        errorResponse = responseAlloc500InternalErrorHTML("ftell to determine file length failed");
+        goto exit;
+    }
+    result = fseek(fp, 0, SEEK_SET);
+    if (0 != result) {
+        ews_printf("Unable to satisfy request for '%s' because we could not fseek to the beginning of the file '%s' %s = %d\n", connection->request.path, response->filenameToSend, strerror(errno), errno);
+        errorResponse = responseAlloc500InternalErrorHTML("fseek to beginning of file to start sending failed");
+        goto exit;
+    }
+    
+    readBuffers[0] = connection->sendRecvBuffer;
+    readBuffers[1] = (char*) malloc(sizeof(connection->sendRecvBuffer));
+    if (NULL == readBuffers[1]) {
+        ews_printf("Unable to satisfy request for '%s' because we could not allocate a second read buffer for '%s'\n", connection->request.path, response->filenameToSend);
+        errorResponse = responseAlloc500InternalErrorHTML("Out of memory for the file read buffer");
+        goto exit;
+    }
+    /* now we have the file length + MIME TYpe and we can send the header */
+    headerLength = snprintfResponseHeader(connection->responseHeader, sizeof(connection->responseHeader), response->code, response->status, contentType, response->extraHeaders, fileLength, NULL);
+    sendResult = send(connection->socketfd, connection->responseHeader, headerLength, 0);
+    if (sendResult != headerLength) {
+        ews_printf("Unable to satisfy request for '%s' because we could not send the HTTP header '%s' %s = %d\n", connection->request.path, response->filenameToSend, strerror(errno), errno);
+        result = 1;
+        goto exit;
+    }
+    if (OptionPrintResponse) {
+        fwrite(connection->responseHeader, 1, headerLength, stdout);
+    }
+    *bytesSent = sendResult;
+    /* read the file into one buffer on a disk I/O thread while we send the other one */
+    currentRead = 0;
+    diskReadStart(diskIOPool, &reads[currentRead], fp, readBuffers[currentRead], sizeof(connection->sendRecvBuffer));
+    while (true) {
+        struct DiskRead* read = &reads[currentRead];
+        diskReadWait(diskIOPool, read);
+        readInFlight = false;
+        if (read->failed) {
+            ews_printf("Unable to satisfy request for '%s' because there was an error freading. '%s' %s = %d\n", connection->request.path, response->filenameToSend, strerror(read->errorNumber), read->errorNumber);
+            /* the header is already out so all we can do is hang up */
+            result = 1;
+            goto exit;
+        }
+        if (0 == read->bytesRead) { /* peacefull end of file */
+            break;
+        }
+        if (read->bytesRead == read->capacity) {
+            diskReadStart(diskIOPool, &reads[1 - currentRead], fp, readBuffers[1 - currentRead], sizeof(connection->sendRecvBuffer));
+            readInFlight = true;
+        }
+        if (connectionBandwidthLimited(connection)) {
+            connectionBandwidthWait(connection, read->bytesRead);
+        }
+        /* send the data out the socket to the network */
+        sendResult = send(connection->socketfd, (const char*) read->buffer, read->bytesRead, 0);
+        if (sendResult != read->bytesRead) {
+            ews_printf("Unable to satisfy request for '%s' because there was an error sending bytes. '%s' %s = %d\n", connection->request.path, response->filenameToSend, strerror(errno), errno);
+            result = 1;
+            goto exit;
+        }
+        if (OptionPrintResponse) {
+            fwrite(read->buffer, 1, read->bytesRead, stdout);
+        }
+
+        *bytesSent = *bytesSent + sendResult;
+        connectionRegistryBytesSent(connection, *bytesSent);
+        if (!readInFlight) {
+            break;
+        }
+        currentRead = 1 - currentRead;
+    }
+exit:
+    /* the disk I/O thread might still be reading into our buffer */
+    if (readInFlight) {
+        diskReadWait(diskIOPool, &reads[1 - currentRead]);
+    }
+    free(readBuffers[1]);
+    if (NULL != fp) {
+        fclose(fp);
+    }
+    if (NULL != errorResponse) {
+        ews_printf("Instead of satisfying the request for '%s' we encountered an error and will return %d %s\n", connection->request.path, response->code, response->status);
+        ssize_t errorBytesSent = 0;
+        result = sendResponse(connection, errorResponse, &errorBytesSent);
+        *bytesSent = *bytesSent + errorBytesSent;
+        responseFree(errorResponse);
+        return result;
+    }
+    return result;
+}
+
+/* Runs your handler on the parsed request and sends what it returns. connectionHandlerThread calls it once the whole
+ request is in, and the persistent fuzzer (EWSFuzzPersistent.c) calls it directly */
+static void connectionRespond(struct Connection* connection) {
+    ssize_t bytesSent = 0;
+    if (NULL != connection->server) {
+        connectionSetPriority(connection, connectionPriorityForRequest(connection->server, &connection->request));
+    }
+    if (NULL != connection->server && OptionTrackHeavyHitters) {
+        heavyHittersRecord(&connection->server->heavyHitterRemoteHosts, connection->remoteHost, strlen(connection->remoteHost));
+        heavyHittersRecord(&connection->server->heavyHitterPaths, connection->request.path, strcspn(connection->request.path, "?"));
+    }
+    connectionTraceMark(connection, ConnectionTraceHandlerStart);
+    connectionRegistryUpdate(connection, ConnectionStateInHandler);
+    EWS_PROBE2(handler__start, connection->request.method, connection->request.path);
+    struct Response* response = createResponseForRequest(&connection->request, connection);
+    connectionTraceMark(connection, ConnectionTraceHandlerEnd);
+    EWS_PROBE2(handler__done, connection->request.path, NULL != response ? response->code : -1);
+    if (NULL != response) {
+        connection->trace.responseCode = response->code;
+    }
+    if (NULL != response && OptionSkipResponseIfPeerClosed && connectionPeerClosed(connection)) {
+        ews_printf_debug("%s:%s: Not sending HTTP %d %s because the client already closed the connection\n", connection->remoteHost, connection->remotePort, response->code, response->status);
+        responseFree(response);
+    } else if (NULL != response) {
+        connectionTraceMark(connection, ConnectionTraceSendStart);
+        connectionRegistryUpdate(connection, ConnectionStateSending);
+        int result = sendResponse(connection, response, &bytesSent);
+        connectionTraceMark(connection, ConnectionTraceSendEnd);
+        connectionRegistryBytesSent(connection, bytesSent);
+        EWS_PROBE4(response__sent, connection->request.path, response->code, (int64_t) bytesSent, result);
+        if (0 == result) {
+            connectionTCPInfoSample(connection);
+            ews_printf_debug("%s:%s: Responded with HTTP %d %s length %" PRId64 "\n", connection->remoteHost, connection->remotePort, response->code, response->status, (int64_t)bytesSent);
+        } else {
+            /* sendResponse already printed something out, don't add another ews_printf */
+        }
+        responseFree(response);
+        connection->status.bytesSent = bytesSent;
+    } else {
+        ews_printf("%s:%s: You have returned a NULL response - I'm assuming you took over the request handling yourself.\n", connection->remoteHost, connection->remotePort);
+    }
+    if (connection->countedAsControlRequest) {
+        ews_atomic_add64(&connection->server->controlRequestsInFlight, -1);
+        connection->countedAsControlRequest = false;
+    }
+}
+
+static THREAD_RETURN_TYPE STDCALL_ON_WIN32 connectionHandlerThread(void* connectionPointer) {
+    struct Connection* connection = (struct Connection*) connectionPointer;
+    if (OptionPinConnectionThreadsToIncomingCPU && connection->incomingCPU >= 0) {
+        if (0 == threadPinToCPU(connection->incomingCPU)) {
+            connection = connectionMoveToLocalMemory(connection);
+        }
+    }
+    getnameinfo((struct sockaddr*) &connection->remoteAddr, connection->remoteAddrLength,
+                connection->remoteHost, sizeof(connection->remoteHost),
+                connection->remotePort, sizeof(connection->remotePort), NI_NUMERICHOST | NI_NUMERICSERV);
+    ews_printf_debug("New connection from %s:%s...\n", connection->remoteHost, connection->remotePort);
+    EWS_PROBE3(connection__start, connection->socketfd, connection->remoteHost, connection->remotePort);
+    connectionRegistryAdd(connection);
+    if (OptionIncludeStatusPageAndCounters) {
+        countersLock();
+        counters.activeConnections++;
+        counters.totalConnections++;
+        countersUnlock();
+    }
+    /* first read the request + request body */
+    bool madeRequestPrintf = false;
+    bool foundRequest = false;
+    ssize_t bytesRead;
+    while ((bytesRead = recv(connection->socketfd, connection->sendRecvBuffer, SEND_RECV_BUFFER_SIZE, 0)) > 0) {
+        if (OptionPrintWholeRequest) {
+            fwrite(connection->sendRecvBuffer, 1, bytesRead, stdout);
+        }
+        if (0 == connection->status.bytesReceived) {
+            connectionTraceMark(connection, ConnectionTraceFirstByteReceived);
+        }
+        connection->status.bytesReceived += bytesRead;
+        requestParse(&connection->request, connection->sendRecvBuffer, bytesRead);
+        if ((RequestParseStateBody == connection->request.state || RequestParseStateDone == connection->request.state) && 0 == connection->trace.ticks[ConnectionTraceHeadersParsed]) {
+            connectionTraceMark(connection, ConnectionTraceHeadersParsed);
+        }
+        connectionRegistryUpdate(connection, connection->request.state >= RequestParseStateBody ? ConnectionStateReadingBody : ConnectionStateReadingHeaders);
+        if (connection->request.state >= RequestParseStateVersion && !madeRequestPrintf) {
+            ews_printf_debug("Request from %s:%s: %s to %s HTTP version %s\n",
+                   connection->remoteHost,
+                   connection->remotePort,
+                   connection->request.method,
+                   connection->request.path,
+                   connection->request.version);
+            madeRequestPrintf = true;
+        }
+        if (connection->request.state == RequestParseStateDone) {
+            foundRequest = true;
+            break;
+        }
+#ifdef EWS_FUZZ_TESTING /* This enables us to fuzz test different content lengths */
+        if (connection->request.state == RequestParseStateBody) {
+            foundRequest = true;
+        }
+#endif
+    }
+    requestPrintWarnings(&connection->request, connection->remoteHost, connection->remotePort);
+    if (foundRequest) {
+        connectionRespond(connection);
+    } else {
+        ews_printf("No request found from %s:%s? Closing connection. Here's the last bytes we received in the request (length %" PRIi64 "). The total bytes received on this connection: %" PRIi64 " :\n", connection->remoteHost, connection->remotePort, (int64_t) bytesRead, connection->status.bytesReceived);
+        if (bytesRead > 0) {
+            fwrite(connection->sendRecvBuffer, 1, bytesRead, stdout);
+        }
+    }
+    /* Alright - we're done */
+    connectionRegistryRemove(connection);
+    close(connection->socketfd);
+    EWS_PROBE3(connection__close, connection->socketfd, connection->status.bytesReceived, connection->status.bytesSent);
+    connectionTraceMark(connection, ConnectionTraceClose);
+    connectionTraceFinish(connection);
+    countersLock();
+    counters.bytesSent += (ssize_t) connection->status.bytesSent;
+    counters.bytesReceived += (ssize_t) connection->status.bytesReceived;
+    counters.activeConnections--;
+    countersUnlock();
+    ews_printf_debug("Connection from %s:%s closed\n", connection->remoteHost, connection->remotePort);
+    mutexLockWithStatistics(&connection->server->connectionFinishedLock, &connection->server->connectionFinishedLockStatistics);
+    connection->server->activeConnectionCount--;
+    pthread_cond_signal(&connection->server->connectionFinishedCond);
+    mutexUnlockWithStatistics(&connection->server->connectionFinishedLock, &connection->server->connectionFinishedLockStatistics);
+    connectionFree(connection);
+    return (THREAD_RETURN_TYPE) NULL;
+}
+
+int serverMutexLock(struct Server* server) {
+    return mutexLockWithStatistics(&server->globalMutex, &server->globalMutexStatistics);
+}
+
+int serverMutexUnlock(struct Server* server) {
+    return mutexUnlockWithStatistics(&server->globalMutex, &server->globalMutexStatistics);
+}
+
+static void countersLock() {
+    mutexLockWithStatistics(&counters.lock, &counters.lockStatistics);
+}
+
+static void countersUnlock() {
+    mutexUnlockWithStatistics(&counters.lock, &counters.lockStatistics);
+}
+
+/* Records a wait that's already over. The max is updated without a lock so it can lose a race, which is fine for statistics */
+static void lockStatisticsRecordWait(struct LockStatistics* statistics, bool contended, int64_t waitNanoseconds) {
+    ews_atomic_add64(&statistics->acquisitions, 1);
+    if (contended) {
+        ews_atomic_add64(&statistics->contendedAcquisitions, 1);
+        ews_atomic_add64(&statistics->totalWaitNanoseconds, waitNanoseconds);
+        if (waitNanoseconds > statistics->maxWaitNanoseconds) {
+            statistics->maxWaitNanoseconds = waitNanoseconds;
+        }
+    }
+}
+
+/* call right before releasing an exclusive lock */
+static void lockStatisticsRecordHold(struct LockStatistics* statistics) {
+    /* lockedAtNanoseconds is 0 if OptionLockStatistics was turned on while the lock was held, or for a reader */
+    if (0 == statistics->lockedAtNanoseconds) {
+        return;
+    }
+    int64_t holdNanoseconds = monotonicNanoseconds() - statistics->lockedAtNanoseconds;
+    statistics->lockedAtNanoseconds = 0;
+    statistics->exclusiveAcquisitions++;
+    statistics->totalHoldNanoseconds += holdNanoseconds;
+    if (holdNanoseconds > statistics->maxHoldNanoseconds) {
+        statistics->maxHoldNanoseconds = holdNanoseconds;
+    }
+}
+
+static int mutexLockWithStatistics(pthread_mutex_t* mutex, struct LockStatistics* statistics) {
+    if (!OptionLockStatistics) {
+        return pthread_mutex_lock(mutex);
+    }
+    /* only read the clock for the wait if we actually have to wait */
+    bool contended = false;
+    int64_t waitNanoseconds = 0;
+    if (0 != pthread_mutex_trylock(mutex)) {
+        contended = true;
+        int64_t waitStart = monotonicNanoseconds();
+        int result = pthread_mutex_lock(mutex);
+        if (0 != result) {
+            return result;
+        }
+        waitNanoseconds = monotonicNanoseconds() - waitStart;
+    }
+    lockStatisticsRecordWait(statistics, contended, waitNanoseconds);
+    statistics->lockedAtNanoseconds = monotonicNanoseconds();
+    return 0;
+}
+
+static int mutexUnlockWithStatistics(pthread_mutex_t* mutex, struct LockStatistics* statistics) {
+    lockStatisticsRecordHold(statistics);
+    return pthread_mutex_unlock(mutex);
+}
+
+void rwLockInit(struct RWLock* rwLock, const char* name) {
+    memset(&rwLock->statistics, 0, sizeof(rwLock->statistics));
+    rwLock->statistics.name = name;
+    pthread_rwlock_init(&rwLock->lock, NULL);
+}
+
+void rwLockDestroy(struct RWLock* rwLock) {
+    pthread_rwlock_destroy(&rwLock->lock);
+}
+
+int rwLockReadLock(struct RWLock* rwLock) {
+    if (!OptionLockStatistics) {
+        return pthread_rwlock_rdlock(&rwLock->lock);
+    }
+    bool contended = false;
+    int64_t waitNanoseconds = 0;
+    if (0 != pthread_rwlock_tryrdlock(&rwLock->lock)) {
+        contended = true;
+        int64_t waitStart = monotonicNanoseconds();
+        int result = pthread_rwlock_rdlock(&rwLock->lock);
+        if (0 != result) {
+            return result;
+        }
+        waitNanoseconds = monotonicNanoseconds() - waitStart;
+    }
+    lockStatisticsRecordWait(&rwLock->statistics, contended, waitNanoseconds);
+    return 0;
+}
+
+int rwLockWriteLock(struct RWLock* rwLock) {
+    if (!OptionLockStatistics) {
+        return pthread_rwlock_wrlock(&rwLock->lock);
+    }
+    bool contended = false;
+    int64_t waitNanoseconds = 0;
+    if (0 != pthread_rwlock_trywrlock(&rwLock->lock)) {
+        contended = true;
+        int64_t waitStart = monotonicNanoseconds();
+        int result = pthread_rwlock_wrlock(&rwLock->lock);
+        if (0 != result) {
+            return result;
+        }
+        waitNanoseconds = monotonicNanoseconds() - waitStart;
+    }
+    lockStatisticsRecordWait(&rwLock->statistics, contended, waitNanoseconds);
+    rwLock->statistics.lockedAtNanoseconds = monotonicNanoseconds();
+    return 0;
+}
+
+int rwLockUnlock(struct RWLock* rwLock) {
+    /* readers never set lockedAtNanoseconds and can't hold the lock at the same time as a writer, so this only counts writers */
+    lockStatisticsRecordHold(&rwLock->statistics);
+    return pthread_rwlock_unlock(&rwLock->lock);
+}
+
+void lockStatisticsStringAppend(struct HeapString* string, const struct LockStatistics* statistics) {
+    double averageWaitMicroseconds = 0;
+    if (statistics->contendedAcquisitions > 0) {
+        averageWaitMicroseconds = statistics->totalWaitNanoseconds / 1000.0 / statistics->contendedAcquisitions;
+    }
+    double averageHoldMicroseconds = 0;
+    if (statistics->exclusiveAcquisitions > 0) {
+        averageHoldMicroseconds = statistics->totalHoldNanoseconds / 1000.0 / statistics->exclusiveAcquisitions;
+    }
+    heapStringAppendFormat(string, "%-32s %12" PRId64 " %12" PRId64 " %14.2f %14.2f %14.2f %14.2f\n",
+        NULL != statistics->name ? statistics->name : "(unnamed)",
+        statistics->acquisitions,
+        statistics->contendedAcquisitions,
+        averageWaitMicroseconds,
+        statistics->maxWaitNanoseconds / 1000.0,
+        averageHoldMicroseconds,
+        statistics->maxHoldNanoseconds / 1000.0);
+}
+
+struct HeapString serverLockStatisticsStringCreate(struct Server* server) {
+    struct HeapString statisticsString;
+    heapStringInit(&statisticsString);
+    if (!OptionLockStatistics) {
+        heapStringAppendString(&statisticsString, "Lock statistics are off. Turn on OptionLockStatistics to collect them\n");
+    }
+    heapStringAppendFormat(&statisticsString, "%-32s %12s %12s %14s %14s %14s %14s\n", "lock", "acquisitions", "contended", "avg wait (us)", "max wait (us)", "avg hold (us)", "max hold (us)");
+    lockStatisticsStringAppend(&statisticsString, &server->globalMutexStatistics);
+    lockStatisticsStringAppend(&statisticsString, &server->connectionFinishedLockStatistics);
+    lockStatisticsStringAppend(&statisticsString, &counters.lockStatistics);
+    /* the shards add up to one row so a table with SERVER_STORE_SHARDS rows doesn't drown out the rest */
+    struct LockStatistics storeStatistics;
+    memset(&storeStatistics, 0, sizeof(storeStatistics));
+    storeStatistics.name = "store shards (all)";
+    for (size_t i = 0; i < SERVER_STORE_SHARDS; i++) {
+        const struct LockStatistics* shardStatistics = &server->store.shards[i].lock.statistics;
+        storeStatistics.acquisitions += shardStatistics->acquisitions;
+        storeStatistics.contendedAcquisitions += shardStatistics->contendedAcquisitions;
+        storeStatistics.totalWaitNanoseconds += shardStatistics->totalWaitNanoseconds;
+        storeStatistics.exclusiveAcquisitions += shardStatistics->exclusiveAcquisitions;
+        storeStatistics.totalHoldNanoseconds += shardStatistics->totalHoldNanoseconds;
+        if (shardStatistics->maxWaitNanoseconds > storeStatistics.maxWaitNanoseconds) {
+            storeStatistics.maxWaitNanoseconds = shardStatistics->maxWaitNanoseconds;
+        }
+        if (shardStatistics->maxHoldNanoseconds > storeStatistics.maxHoldNanoseconds) {
+            storeStatistics.maxHoldNanoseconds = shardStatistics->maxHoldNanoseconds;
+        }
+    }
+    lockStatisticsStringAppend(&statisticsString, &storeStatistics);
+    return statisticsString;
+}
+
+/* The key + null, value + null are allocated right after the entry so each entry is one malloc */
+struct ServerStoreEntry {
+    struct ServerStoreEntry* nextInBucket;
+    struct ServerStoreEntry* older;
+    struct ServerStoreEntry* newer;
+    uint64_t hash;
+    time_t expires; // 0 is never
+    size_t allocationSize;
+    size_t keyLength;
+    size_t valueLength;
+    char* key;
+    char* value;
+};
+
+static uint64_t hashFNV1a64(const void* data, size_t length) {
+    return hashFNV1a64Continue(14695981039346656037ULL, data, length);
+}
+
+/* so you can hash a few strings as if they were concatenated without concatenating them */
+static uint64_t hashFNV1a64Continue(uint64_t hash, const void* data, size_t length) {
+    const uint8_t* bytes = (const uint8_t*) data;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void serverStoreInit(struct ServerStore* store) {
+    memset(store, 0, sizeof(*store));
+    for (size_t i = 0; i < SERVER_STORE_SHARDS; i++) {
+        rwLockInit(&store->shards[i].lock, "store shard");
+    }
+}
+
+static void serverStoreFree(struct ServerStore* store) {
+    for (size_t i = 0; i < SERVER_STORE_SHARDS; i++) {
+        struct ServerStoreEntry* entry = store->shards[i].oldest;
+        while (NULL != entry) {
+            struct ServerStoreEntry* newer = entry->newer;
+            free(entry);
+            entry = newer;
+        }
+        rwLockDestroy(&store->shards[i].lock);
+    }
+    memset(store, 0, sizeof(*store));
+}
+
+static THREAD_RETURN_TYPE STDCALL_ON_WIN32 diskIOThread(void* poolPointer) {
+    struct DiskIOPool* pool = (struct DiskIOPool*) poolPointer;
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (NULL == pool->queueHead && !pool->stopping) {
+            pthread_cond_wait(&pool->readQueued, &pool->lock);
+        }
+        if (NULL == pool->queueHead) {
+            break;
+        }
+        struct DiskRead* read = pool->queueHead;
+        pool->queueHead = read->next;
+        if (NULL == pool->queueHead) {
+            pool->queueTail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        read->bytesRead = fread(read->buffer, 1, read->capacity, read->fp);
+        bool failed = read->bytesRead < read->capacity && 0 != ferror(read->fp);
+        int errorNumber = errno;
+        pthread_mutex_lock(&pool->lock);
+        read->failed = failed;
+        read->errorNumber = errorNumber;
+        read->done = true;
+        /* connection threads all wait on the one condition and check their own read */
+        pthread_cond_broadcast(&pool->readDone);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return (THREAD_RETURN_TYPE) 0;
+}
+
+static void diskIOPoolStart(struct DiskIOPool* pool) {
+    memset(pool, 0, sizeof(*pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->readQueued, NULL);
+    pthread_cond_init(&pool->readDone, NULL);
+    for (int i = 0; i < SERVER_DISK_IO_THREADS; i++) {
+        int result = pthread_create(&pool->threads[pool->threadsCount], NULL, &diskIOThread, pool);
+        if (0 != result) {
+            ews_printf("Could not start disk I/O thread %d. pthread_create returned %d. Continuing with %d threads\n", i, result, pool->threadsCount);
+            break;
+        }
+        pool->threadsCount++;
+    }
+}
+
+/* Any queued reads are finished first */
+static void diskIOPoolStop(struct DiskIOPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->readQueued);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->threadsCount; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pool->threadsCount = 0;
+    pthread_cond_destroy(&pool->readQueued);
+    pthread_cond_destroy(&pool->readDone);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+static void diskReadInline(struct DiskRead* read) {
+    read->bytesRead = fread(read->buffer, 1, read->capacity, read->fp);
+    read->failed = read->bytesRead < read->capacity && 0 != ferror(read->fp);
+    read->errorNumber = errno;
+    read->done = true;
+}
+
+/* Without any threads (or after the pool was stopped) the read just happens right here */
+static void diskReadStart(struct DiskIOPool* pool, struct DiskRead* read, FILE* fp, void* buffer, size_t capacity) {
+    memset(read, 0, sizeof(*read));
+    read->fp = fp;
+    read->buffer = buffer;
+    read->capacity = capacity;
+    if (NULL == pool || 0 == pool->threadsCount) {
+        diskReadInline(read);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    if (pool->stopping) {
+        pthread_mutex_unlock(&pool->lock);
+        diskReadInline(read);
+        return;
+    }
+    read->queued = true;
+    if (NULL == pool->queueTail) {
+        pool->queueHead = read;
+    } else {
+        pool->queueTail->next = read;
+    }
+    pool->queueTail = read;
+    pthread_cond_signal(&pool->readQueued);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void diskReadWait(struct DiskIOPool* pool, struct DiskRead* read) {
+    if (!read->queued) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    while (!read->done) {
+        pthread_cond_wait(&pool->readDone, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void bandwidthLimiterInit(struct BandwidthLimiter* limiter, int64_t bytesPerSecond, int64_t burstBytes) {
+    memset(limiter, 0, sizeof(*limiter));
+    pthread_mutex_init(&limiter->lock, NULL);
+    pthread_cond_init(&limiter->nextWaiter, NULL);
+    bandwidthLimiterSetRate(limiter, bytesPerSecond, burstBytes);
+}
+
+void bandwidthLimiterDestroy(struct BandwidthLimiter* limiter) {
+    pthread_cond_destroy(&limiter->nextWaiter);
+    pthread_mutex_destroy(&limiter->lock);
+}
+
+void bandwidthLimiterSetRate(struct BandwidthLimiter* limiter, int64_t bytesPerSecond, int64_t burstBytes) {
+    pthread_mutex_lock(&limiter->lock);
+    limiter->bytesPerSecond = bytesPerSecond > 0 ? bytesPerSecond : 0;
+    /* a burst smaller than a chunk would never fill up enough to send one */
+    limiter->burstBytes = burstBytes > BANDWIDTH_LIMITED_CHUNK_SIZE ? burstBytes : BANDWIDTH_LIMITED_CHUNK_SIZE;
+    limiter->tokens = limiter->burstBytes;
+    limiter->lastRefillNanoseconds = monotonicNanoseconds();
+    pthread_mutex_unlock(&limiter->lock);
+}
+
+void bandwidthLimiterAcquire(struct BandwidthLimiter* limiter, int64_t bytes) {
+    pthread_mutex_lock(&limiter->lock);
+    if (0 == limiter->bytesPerSecond) {
+        pthread_mutex_unlock(&limiter->lock);
+        return;
+    }
+    uint64_t ticket = limiter->nextTicket++;
+    while (ticket != limiter->nowServing) {
+        pthread_cond_wait(&limiter->nextWaiter, &limiter->lock);
+    }
+    /* we're at the front. Wait for enough tokens - anything over a burst goes into debt that the next waiter pays off */
+    int64_t tokensNeeded = bytes < limiter->burstBytes ? bytes : limiter->burstBytes;
+    while (true) {
+        int64_t now = monotonicNanoseconds();
+        /* after a long idle, elapsed * bytesPerSecond would overflow. Anything past a full bucket doesn't matter anyway */
+        int64_t elapsed = now - limiter->lastRefillNanoseconds;
+        int64_t fullAfterNanoseconds = (limiter->burstBytes / limiter->bytesPerSecond + 1) * 1000000000;
+        if (elapsed > fullAfterNanoseconds) {
+            elapsed = fullAfterNanoseconds;
+        }
+        int64_t refill = elapsed / 1000000000 * limiter->bytesPerSecond + elapsed % 1000000000 * limiter->bytesPerSecond / 1000000000;
+        if (refill > 0) {
+            limiter->tokens += refill;
+            if (limiter->tokens > limiter->burstBytes) {
+                limiter->tokens = limiter->burstBytes;
+            }
+            limiter->lastRefillNanoseconds = now;
+        }
+        if (limiter->tokens >= tokensNeeded || 0 == limiter->bytesPerSecond) {
+            break;
+        }
+        int64_t sleepNanosecondsNeeded = (tokensNeeded - limiter->tokens) * 1000000000 / limiter->bytesPerSecond + 1;
+        pthread_mutex_unlock(&limiter->lock);
+        sleepNanoseconds(sleepNanosecondsNeeded);
+        pthread_mutex_lock(&limiter->lock);
+    }
+    limiter->tokens -= bytes;
+    limiter->nowServing++;
+    pthread_cond_broadcast(&limiter->nextWaiter);
+    pthread_mutex_unlock(&limiter->lock);
+}
+
+void connectionSetBandwidthLimit(struct Connection* connection, int64_t bytesPerSecond, struct BandwidthLimiter* routeLimiterOrNULL) {
+    connection->bandwidthLimitBytesPerSecond = bytesPerSecond;
+    connection->routeBandwidthLimiter = routeLimiterOrNULL;
+}
+
+static int64_t connectionBandwidthLimitEffective(const struct Connection* connection) {
+    if (0 != connection->bandwidthLimitBytesPerSecond || NULL == connection->server) {
+        return connection->bandwidthLimitBytesPerSecond > 0 ? connection->bandwidthLimitBytesPerSecond : 0;
+    }
+    return connection->server->connectionBandwidthLimitBytesPerSecond;
+}
+
+/* Reading the rates without the locks is fine - a rate change shows up a chunk later */
+static bool connectionBandwidthLimited(const struct Connection* connection) {
+    return connectionBandwidthLimitEffective(connection) > 0 ||
+        (ConnectionPriorityBulk == connection->priority && OptionBulkYieldsToControl && NULL != connection->server && connection->server->controlRequestsInFlight > 0) ||
+        (NULL != connection->routeBandwidthLimiter && connection->routeBandwidthLimiter->bytesPerSecond > 0) ||
+        (NULL != connection->server && connection->server->bandwidthLimiter.bytesPerSecond > 0);
+}
+
+/* Blocks until bytes of body can be sent. The connection's own limit is just pacing against the clock since only this thread uses it */
+static void connectionBandwidthWait(struct Connection* connection, size_t bytes) {
+    if (ConnectionPriorityBulk == connection->priority && OptionBulkYieldsToControl && NULL != connection->server) {
+        /* control requests are usually done in a few ms. Don't wait forever if one is stuck */
+        for (int i = 0; i < 50 && connection->server->controlRequestsInFlight > 0; i++) {
+            sleepNanoseconds(1000000);
+        }
+    }
+    int64_t connectionLimit = connectionBandwidthLimitEffective(connection);
+    if (connectionLimit > 0) {
+        int64_t now = monotonicNanoseconds();
+        if (0 == connection->bandwidthStartNanoseconds) {
+            connection->bandwidthStartNanoseconds = now;
+        }
+        /* the first chunk goes out right away. Whole seconds first: bytes * 1000000000 would overflow after ~9GB */
+        int64_t sendAtNanoseconds = connection->bandwidthStartNanoseconds + connection->bandwidthBytesSent / connectionLimit * 1000000000 +
+            connection->bandwidthBytesSent % connectionLimit * 1000000000 / connectionLimit;
+        if (sendAtNanoseconds > now) {
+            sleepNanoseconds(sendAtNanoseconds - now);
+        }
+        connection->bandwidthBytesSent += bytes;
+    }
+    if (NULL != connection->routeBandwidthLimiter) {
+        bandwidthLimiterAcquire(connection->routeBandwidthLimiter, bytes);
+    }
+    if (NULL != connection->server) {
+        bandwidthLimiterAcquire(&connection->server->bandwidthLimiter, bytes);
+    }
+}
+
+int serverSetPathPriority(struct Server* server, const char* pathPrefix, ConnectionPriority priority) {
+    if (server->pathPrioritiesCount == SERVER_MAX_PATH_PRIORITIES || strlen(pathPrefix) >= sizeof(server->pathPriorities[0].pathPrefix)) {
+        ews_printf("Could not set the priority for path prefix '%s': there are already %d prefixes (SERVER_MAX_PATH_PRIORITIES) or the prefix is too long\n", pathPrefix, SERVER_MAX_PATH_PRIORITIES);
+        return 1;
+    }
+    struct PathPriority* pathPriority = &server->pathPriorities[server->pathPrioritiesCount++];
+    strcpy(pathPriority->pathPrefix, pathPrefix);
+    pathPriority->priority = priority;
+    return 0;
+}
+
+int serverSetPathParallelBatching(struct Server* server, const char* pathPrefix) {
+    if (server->parallelBatchPathPrefixesCount == SERVER_MAX_PARALLEL_BATCH_PATHS || strlen(pathPrefix) >= sizeof(server->parallelBatchPathPrefixes[0])) {
+        ews_printf("Could not allow parallel batching for path prefix '%s': there are already %d prefixes (SERVER_MAX_PARALLEL_BATCH_PATHS) or the prefix is too long\n", pathPrefix, SERVER_MAX_PARALLEL_BATCH_PATHS);
+        return 1;
+    }
+    strcpy(server->parallelBatchPathPrefixes[server->parallelBatchPathPrefixesCount++], pathPrefix);
+    return 0;
+}
+
+/* The longest matching path prefix, then the urgency from an RFC 9218 "Priority: u=N" header, then the server default.
+The header comes from the client so it can only ask to be treated as background, never as Control. */
+static ConnectionPriority connectionPriorityForRequest(const struct Server* server, const struct Request* request) {
+    size_t longestMatchLength = 0;
+    bool foundPathPriority = false;
+    ConnectionPriority priority = server->defaultPriority;
+    for (size_t i = 0; i < server->pathPrioritiesCount; i++) {
+        size_t matchLength = 0;
+        if (requestMatchesPathPrefix(request->pathDecoded, server->pathPriorities[i].pathPrefix, &matchLength) && (!foundPathPriority || matchLength > longestMatchLength)) {
+            priority = server->pathPriorities[i].priority;
+            longestMatchLength = matchLength;
+            foundPathPriority = true;
+        }
+    }
+    if (foundPathPriority) {
+        return priority;
+    }
+    const struct Header* priorityHeader = headerInRequest("Priority", request);
+    if (NULL != priorityHeader) {
+        const char* urgency = strstr(priorityHeader->value.contents, "u=");
+        /* the default urgency is 3 and 5-7 are background */
+        if (NULL != urgency && urgency[2] >= '5' && urgency[2] <= '7') {
+            return ConnectionPriorityBulk;
+        }
+    }
+    return priority;
+}
+
+void connectionSetPriority(struct Connection* connection, ConnectionPriority priority) {
+    bool isControl = ConnectionPriorityControl == priority;
+    if (NULL != connection->server && isControl != connection->countedAsControlRequest) {
+        ews_atomic_add64(&connection->server->controlRequestsInFlight, isControl ? 1 : -1);
+        connection->countedAsControlRequest = isControl;
+    }
+    if (priority != connection->priority) {
+        threadAndSocketSetPriority(connection->socketfd, priority);
+    }
+    connection->priority = priority;
+}
+
+static void heavyHittersInit(struct HeavyHitters* heavyHitters) {
+    memset(heavyHitters->sketch, 0, sizeof(heavyHitters->sketch));
+    heavyHitters->total = 0;
+    pthread_mutex_init(&heavyHitters->topLock, NULL);
+    heavyHitters->topCount = 0;
+    heavyHitters->topUpdatesSkipped = 0;
+}
+
+static void heavyHittersDestroy(struct HeavyHitters* heavyHitters) {
+    pthread_mutex_destroy(&heavyHitters->topLock);
+}
+
+static void heavyHitterSwap(struct HeavyHitter* a, struct HeavyHitter* b) {
+    struct HeavyHitter temporary = *a;
+    *a = *b;
+    *b = temporary;
+}
+
+/* the top list is a min-heap on estimate so the one to evict is always top[0]. Call with topLock held */
+static void heavyHittersTopFix(struct HeavyHitters* heavyHitters, size_t index) {
+    struct HeavyHitter* top = heavyHitters->top;
+    while (index > 0 && top[index].estimate < top[(index - 1) / 2].estimate) {
+        heavyHitterSwap(&top[index], &top[(index - 1) / 2]);
+        index = (index - 1) / 2;
+    }
+    while (true) {
+        size_t smallest = index;
+        size_t left = index * 2 + 1;
+        size_t right = index * 2 + 2;
+        if (left < heavyHitters->topCount && top[left].estimate < top[smallest].estimate) {
+            smallest = left;
+        }
+        if (right < heavyHitters->topCount && top[right].estimate < top[smallest].estimate) {
+            smallest = right;
+        }
+        if (smallest == index) {
+            break;
+        }
+        heavyHitterSwap(&top[index], &top[smallest]);
+        index = smallest;
+    }
+}
+
+/* call with topLock held */
+static void heavyHittersTopUpdate(struct HeavyHitters* heavyHitters, uint64_t hash, const char* key, size_t keyLength, int64_t estimate) {
+    for (size_t i = 0; i < heavyHitters->topCount; i++) {
+        struct HeavyHitter* heavyHitter = &heavyHitters->top[i];
+        if (hash == heavyHitter->keyHash && 0 == strncmp(heavyHitter->key, key, keyLength) && '\0' == heavyHitter->key[keyLength]) {
+            heavyHitter->estimate = estimate;
+            heavyHittersTopFix(heavyHitters, i);
+            return;
+        }
+    }
+    size_t index;
+    if (heavyHitters->topCount < HEAVY_HITTERS_TOP_K) {
+        index = heavyHitters->topCount;
+        heavyHitters->topCount++;
+    } else if (estimate > heavyHitters->top[0].estimate) {
+        index = 0;
+    } else {
+        return;
+    }
+    struct HeavyHitter* heavyHitter = &heavyHitters->top[index];
+    memcpy(heavyHitter->key, key, keyLength);
+    heavyHitter->key[keyLength] = '\0';
+    heavyHitter->keyHash = hash;
+    heavyHitter->estimate = estimate;
+    heavyHittersTopFix(heavyHitters, index);
+}
+
+/* Halving with atomic subtracts means we don't lose increments that race with it */
+static void heavyHittersHalve(struct HeavyHitters* heavyHitters) {
+    for (size_t row = 0; row < HEAVY_HITTERS_SKETCH_DEPTH; row++) {
+        for (size_t column = 0; column < HEAVY_HITTERS_SKETCH_WIDTH; column++) {
+            int64_t* cell = &heavyHitters->sketch[row][column];
+            int64_t count = ews_atomic_add64(cell, 0);
+            if (count > 1) {
+                ews_atomic_add64(cell, -(count / 2));
+            }
+        }
+    }
+    pthread_mutex_lock(&heavyHitters->topLock);
+    for (size_t i = 0; i < heavyHitters->topCount; i++) {
+        heavyHitters->top[i].estimate /= 2;
+    }
+    pthread_mutex_unlock(&heavyHitters->topLock);
+}
+
+static void heavyHittersRecord(struct HeavyHitters* heavyHitters, const char* key, size_t keyLength) {
+    keyLength = MIN(keyLength, (size_t) HEAVY_HITTERS_MAX_KEY_LENGTH - 1);
+    uint64_t hash = hashFNV1a64(key, keyLength);
+    /* derive the row hashes from one 64 bit hash (Kirsch + Mitzenmacher) */
+    uint32_t hash1 = (uint32_t) hash;
+    uint32_t hash2 = (uint32_t) (hash >> 32) | 1;
+    int64_t estimate = INT64_MAX;
+    for (uint32_t row = 0; row < HEAVY_HITTERS_SKETCH_DEPTH; row++) {
+        int64_t* cell = &heavyHitters->sketch[row][(hash1 + row * hash2) % HEAVY_HITTERS_SKETCH_WIDTH];
+        int64_t count = ews_atomic_add64(cell, 1) + 1;
+        estimate = MIN(estimate, count);
+    }
+    int64_t total = ews_atomic_add64(&heavyHitters->total, 1) + 1;
+    if (0 == total % HEAVY_HITTERS_HALVE_EVERY) {
+        heavyHittersHalve(heavyHitters);
+    }
+    /* Never wait on the top list. The sketch has the count either way and a real heavy hitter will be back soon */
+    if (0 != pthread_mutex_trylock(&heavyHitters->topLock)) {
+        ews_atomic_add64(&heavyHitters->topUpdatesSkipped, 1);
+        return;
+    }
+    heavyHittersTopUpdate(heavyHitters, hash, key, keyLength, estimate);
+    pthread_mutex_unlock(&heavyHitters->topLock);
+}
+
+static int heavyHitterCompareEstimateDescending(const void* a, const void* b) {
+    int64_t estimateA = ((const struct HeavyHitter*) a)->estimate;
+    int64_t estimateB = ((const struct HeavyHitter*) b)->estimate;
+    return estimateA > estimateB ? -1 : (estimateA < estimateB ? 1 : 0);
+}
+
+static void heavyHittersJSONAppend(struct HeapString* json, struct HeavyHitters* heavyHitters) {
+    struct HeavyHitter top[HEAVY_HITTERS_TOP_K];
+    pthread_mutex_lock(&heavyHitters->topLock);
+    size_t topCount = heavyHitters->topCount;
+    memcpy(top, heavyHitters->top, topCount * sizeof(top[0]));
+    pthread_mutex_unlock(&heavyHitters->topLock);
+    qsort(top, topCount, sizeof(top[0]), heavyHitterCompareEstimateDescending);
+    heapStringAppendFormat(json, "{\n\t\t\"total\" : %" PRId64 ",\n\t\t\"top_updates_skipped\" : %" PRId64 ",\n\t\t\"top\" : [",
+        ews_atomic_add64(&heavyHitters->total, 0), ews_atomic_add64(&heavyHitters->topUpdatesSkipped, 0));
+    for (size_t i = 0; i < topCount; i++) {
+        heapStringAppendString(json, i > 0 ? ",\n\t\t\t{ \"key\" : " : "\n\t\t\t{ \"key\" : ");
+        heapStringAppendJSONString(json, top[i].key, strlen(top[i].key));
+        heapStringAppendFormat(json, ", \"estimate\" : %" PRId64 " }", top[i].estimate);
+    }
+    heapStringAppendString(json, "\n\t\t]\n\t}");
+}
+
+struct HeapString serverHeavyHittersJSONCreate(struct Server* server) {
+    struct HeapString json;
+    heapStringInit(&json);
+    heapStringAppendString(&json, "{\n\t\"remote_hosts\" : ");
+    heavyHittersJSONAppend(&json, &server->heavyHitterRemoteHosts);
+    heapStringAppendString(&json, ",\n\t\"paths\" : ");
+    heavyHittersJSONAppend(&json, &server->heavyHitterPaths);
+    heapStringAppendString(&json, "\n}");
+    return json;
+}
+
+/* called from serverInit, which happens before there are any connections */
+static void allocationProfileInit() {
+    if (allocationProfile.initialized) {
+        return;
+    }
+    pthread_mutex_init(&allocationProfile.lock, NULL);
+    allocationProfile.tags[0].tag = NULL;
+    allocationProfile.tagsCount = 1;
+    allocationProfile.initialized = true;
+}
+
+static int allocationProfileCurrentTagIndex() {
+    if (!OptionAllocationProfile) {
+        return 0;
+    }
+    return 0 != allocationProfileThreadTagIndex ? allocationProfileThreadTagIndex : 1;
+}
+
+/* Returns index + 1. Tags are almost always string literals so the pointer compare usually finds them */
+static int allocationProfileTagIndexFind(const char* tag) {
+    if (NULL == tag) {
+        return 1;
+    }
+    int64_t tagsCount = ews_atomic_add64(&allocationProfile.tagsCount, 0);
+    for (int64_t i = 1; i < tagsCount; i++) {
+        if (tag == allocationProfile.tags[i].tag) {
+            return (int) i + 1;
+        }
+    }
+    int tagIndex = 1;
+    pthread_mutex_lock(&allocationProfile.lock);
+    tagsCount = allocationProfile.tagsCount;
+    for (int64_t i = 1; i < tagsCount; i++) {
+        if (0 == strcmp(tag, allocationProfile.tags[i].tag)) {
+            tagIndex = (int) i + 1;
+            break;
+        }
+    }
+    if (1 == tagIndex && tagsCount < ALLOCATION_PROFILE_MAX_TAGS) {
+        allocationProfile.tags[tagsCount].tag = tag;
+        /* publish the tag before the count (the atomic add is a full barrier) */
+        ews_atomic_add64(&allocationProfile.tagsCount, 1);
+        tagIndex = (int) tagsCount + 1;
+    }
+    pthread_mutex_unlock(&allocationProfile.lock);
+    return tagIndex;
+}
+
+static void allocationProfileAdd(int tagIndex, AllocationKind kind, int64_t bytesDelta, bool isNewAllocation) {
+    if (0 == tagIndex) {
+        return;
+    }
+    struct AllocationTagStatistics* statistics = &allocationProfile.tags[tagIndex - 1];
+    if (isNewAllocation) {
+        ews_atomic_add64(&statistics->allocations[kind], 1);
+    }
+    if (bytesDelta > 0) {
+        ews_atomic_add64(&statistics->bytesAllocated, bytesDelta);
+    }
+    ews_atomic_add64(&statistics->liveBytes[kind], bytesDelta);
+    int64_t liveBytesTotal = ews_atomic_add64(&statistics->liveBytesTotal, bytesDelta) + bytesDelta;
+    int64_t highWaterMark = ews_atomic_add64(&statistics->liveBytesHighWaterMark, 0);
+    while (liveBytesTotal > highWaterMark && !ews_atomic_cas64(&statistics->liveBytesHighWaterMark, highWaterMark, liveBytesTotal)) {
+        highWaterMark = ews_atomic_add64(&statistics->liveBytesHighWaterMark, 0);
+    }
+}
+
+static int allocationTagStatisticsCompareLiveBytesDescending(const void* a, const void* b) {
+    int64_t liveBytesA = ((const struct AllocationTagStatistics*) a)->liveBytesTotal;
+    int64_t liveBytesB = ((const struct AllocationTagStatistics*) b)->liveBytesTotal;
+    return liveBytesA > liveBytesB ? -1 : (liveBytesA < liveBytesB ? 1 : 0);
+}
+
+struct HeapString allocationProfileStringCreate(size_t topN) {
+    struct HeapString string;
+    heapStringInit(&string);
+    if (!OptionAllocationProfile) {
+        heapStringAppendString(&string, "Allocation profiling is off. Turn on OptionAllocationProfile to collect it\n");
+    }
+    struct AllocationTagStatistics tags[ALLOCATION_PROFILE_MAX_TAGS];
+    size_t tagsCount = allocationProfile.initialized ? (size_t) ews_atomic_add64(&allocationProfile.tagsCount, 0) : 0;
+    /* a snapshot - the counters keep moving while we copy them, which is fine for a report */
+    for (size_t i = 0; i < tagsCount; i++) {
+        struct AllocationTagStatistics* statistics = &allocationProfile.tags[i];
+        tags[i].tag = statistics->tag;
+        for (int kind = 0; kind < AllocationKindsCount; kind++) {
+            tags[i].allocations[kind] = ews_atomic_add64(&statistics->allocations[kind], 0);
+            tags[i].liveBytes[kind] = ews_atomic_add64(&statistics->liveBytes[kind], 0);
+        }
+        tags[i].bytesAllocated = ews_atomic_add64(&statistics->bytesAllocated, 0);
+        tags[i].liveBytesTotal = ews_atomic_add64(&statistics->liveBytesTotal, 0);
+        tags[i].liveBytesHighWaterMark = ews_atomic_add64(&statistics->liveBytesHighWaterMark, 0);
+    }
+    qsort(tags, tagsCount, sizeof(tags[0]), allocationTagStatisticsCompareLiveBytesDescending);
+    heapStringAppendFormat(&string, "%-20s %12s %12s %12s %14s %12s %12s %12s\n", "tag", "live bytes", "high water", "allocations", "bytes total", "strings", "responses", "connections");
+    for (size_t i = 0; i < tagsCount && i < topN; i++) {
+        const struct AllocationTagStatistics* statistics = &tags[i];
+        heapStringAppendFormat(&string, "%-20s %12" PRId64 " %12" PRId64 " %12" PRId64 " %14" PRId64 " %12" PRId64 " %12" PRId64 " %12" PRId64 "\n",
+            NULL != statistics->tag ? statistics->tag : "(untagged)",
+            statistics->liveBytesTotal,
+            statistics->liveBytesHighWaterMark,
+            statistics->allocations[AllocationKindHeapString] + statistics->allocations[AllocationKindResponse] + statistics->allocations[AllocationKindConnection],
+            statistics->bytesAllocated,
+            statistics->liveBytes[AllocationKindHeapString],
+            statistics->liveBytes[AllocationKindResponse],
+            statistics->liveBytes[AllocationKindConnection]);
+    }
+    return string;
+}
+
+void connectionSetRouteTag(struct Connection* connection, const char* routeTag) {
+    connection->routeTag = routeTag;
+    connectionRegistryUpdate(connection, connection->registryState);
+    if (!OptionAllocationProfile || !allocationProfile.initialized) {
+        return;
+    }
+    allocationProfileThreadTagIndex = allocationProfileTagIndexFind(routeTag);
+    /* the connection was allocated by the accept thread - charge it to the route that's using it */
+    if (0 != connection->allocationTagIndex && allocationProfileThreadTagIndex != connection->allocationTagIndex) {
+        allocationProfileAdd(connection->allocationTagIndex, AllocationKindConnection, -(int64_t) sizeof(*connection), false);
+        connection->allocationTagIndex = allocationProfileThreadTagIndex;
+        allocationProfileAdd(connection->allocationTagIndex, AllocationKindConnection, sizeof(*connection), false);
+    }
+}
+
+static void tcpInfoStatisticsInit(struct TCPInfoStatistics* statistics) {
+    pthread_mutex_init(&statistics->lock, NULL);
+    statistics->responses = 0;
+    memset(&statistics->server, 0, sizeof(statistics->server));
+    memset(statistics->routes, 0, sizeof(statistics->routes));
+    statistics->routesCount = 0;
+}
+
+static size_t log2HistogramBucket(int64_t value) {
+    size_t bucket = 0;
+    while (value > 0 && bucket < TCP_INFO_HISTOGRAM_BUCKETS - 1) {
+        value >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+/* the largest value that lands in bucket */
+static int64_t log2HistogramBucketMaximum(size_t bucket) {
+    return 0 == bucket ? 0 : ((int64_t) 1 << bucket) - 1;
+}
+
+static int64_t log2HistogramPercentile(const int64_t* histogram, int64_t samples, int percentile) {
+    int64_t target = (samples * percentile + 99) / 100;
+    int64_t seen = 0;
+    for (size_t bucket = 0; bucket < TCP_INFO_HISTOGRAM_BUCKETS; bucket++) {
+        seen += histogram[bucket];
+        if (seen >= target && seen > 0) {
+            return log2HistogramBucketMaximum(bucket);
+        }
+    }
+    return -1;
+}
+
+/* call with the statistics lock held */
+static void tcpInfoHistogramsRecord(struct TCPInfoHistograms* histograms, const struct TCPInfoSample* sample) {
+    histograms->samples++;
+    if (sample->rttMicroseconds >= 0) {
+        histograms->rttMicroseconds[log2HistogramBucket(sample->rttMicroseconds)]++;
+    }
+    if (sample->totalRetransmits >= 0) {
+        histograms->totalRetransmits[log2HistogramBucket(sample->totalRetransmits)]++;
+    }
+    if (sample->congestionWindowSegments >= 0) {
+        histograms->congestionWindowSegments[log2HistogramBucket(sample->congestionWindowSegments)]++;
+    }
+    if (sample->deliveryRateBytesPerSecond >= 0) {
+        histograms->deliveryRateBytesPerSecond[log2HistogramBucket(sample->deliveryRateBytesPerSecond)]++;
+    }
+}
+
+static void tcpInfoStatisticsRecord(struct TCPInfoStatistics* statistics, const char* routeTag, const struct TCPInfoSample* sample) {
+    pthread_mutex_lock(&statistics->lock);
+    tcpInfoHistogramsRecord(&statistics->server, sample);
+    if (NULL != routeTag) {
+        struct TCPInfoHistograms* route = NULL;
+        for (size_t i = 0; i < statistics->routesCount; i++) {
+            if (0 == strcmp(statistics->routes[i].routeTag, routeTag)) {
+                route = &statistics->routes[i];
+                break;
+            }
+        }
+        if (NULL == route && statistics->routesCount < SERVER_MAX_ROUTE_TAGS) {
+            route = &statistics->routes[statistics->routesCount];
+            route->routeTag = routeTag;
+            statistics->routesCount++;
+        }
+        if (NULL != route) {
+            tcpInfoHistogramsRecord(route, sample);
+        }
+    }
+    pthread_mutex_unlock(&statistics->lock);
+}
+
+/* Called once the response has been sent. Batched sub-requests and the NULL server don't get here */
+static void connectionTCPInfoSample(struct Connection* connection) {
+    struct Server* server = connection->server;
+    if (NULL == server || server->tcpInfoSampleEvery <= 0) {
+        return;
+    }
+    if (0 != ews_atomic_add64(&server->tcpInfoStatistics.responses, 1) % server->tcpInfoSampleEvery) {
+        return;
+    }
+    struct TCPInfoSample sample;
+    if (0 != socketTCPInfoGet(connection->socketfd, &sample)) {
+        return;
+    }
+    tcpInfoStatisticsRecord(&server->tcpInfoStatistics, connection->routeTag, &sample);
+}
+
+static void tcpInfoHistogramsStringAppend(struct HeapString* string, const char* name, const struct TCPInfoHistograms* histograms) {
+    int64_t samples = histograms->samples;
+    heapStringAppendFormat(string, "%-20s %8" PRId64 " %10" PRId64 " %10" PRId64 " %10" PRId64 " %10" PRId64 " %10" PRId64 " %10" PRId64 " %14" PRId64 "\n",
+        name,
+        samples,
+        log2HistogramPercentile(histograms->rttMicroseconds, samples, 50),
+        log2HistogramPercentile(histograms->rttMicroseconds, samples, 90),
+        log2HistogramPercentile(histograms->rttMicroseconds, samples, 99),
+        log2HistogramPercentile(histograms->totalRetransmits, samples, 50),
+        log2HistogramPercentile(histograms->totalRetransmits, samples, 99),
+        log2HistogramPercentile(histograms->congestionWindowSegments, samples, 50),
+        log2HistogramPercentile(histograms->deliveryRateBytesPerSecond, samples, 50));
+}
+
+struct HeapString serverTCPInfoStringCreate(struct Server* server) {
+    struct HeapString string;
+    heapStringInit(&string);
+    if (server->tcpInfoSampleEvery <= 0) {
+        heapStringAppendString(&string, "TCP_INFO sampling is off. Set Server.tcpInfoSampleEvery to turn it on\n");
+        return string;
+    }
+    heapStringAppendFormat(&string, "TCP_INFO from 1 in %d responses. Percentiles are the top of a power of 2 bucket, -1 if there's no data\n", server->tcpInfoSampleEvery);
+    heapStringAppendFormat(&string, "%-20s %8s %10s %10s %10s %10s %10s %10s %14s\n", "route", "samples", "rtt p50", "rtt p90", "rtt p99", "retx p50", "retx p99", "cwnd p50", "delivery p50");
+    heapStringAppendFormat(&string, "%-20s %8s %10s %10s %10s %10s %10s %10s %14s\n", "", "", "(us)", "(us)", "(us)", "", "", "(segments)", "(bytes/s)");
+    pthread_mutex_lock(&server->tcpInfoStatistics.lock);
+    tcpInfoHistogramsStringAppend(&string, "(server)", &server->tcpInfoStatistics.server);
+    for (size_t i = 0; i < server->tcpInfoStatistics.routesCount; i++) {
+        tcpInfoHistogramsStringAppend(&string, server->tcpInfoStatistics.routes[i].routeTag, &server->tcpInfoStatistics.routes[i]);
+    }
+    pthread_mutex_unlock(&server->tcpInfoStatistics.lock);
+    return string;
+}
+
+static uint64_t traceTicks() {
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+    /* a few ns instead of a clock_gettime. Every x86 from the last 15 years has a constant rate TSC */
+    return __rdtsc();
+#else
+    return (uint64_t) monotonicNanoseconds();
+#endif
+}
+
+/* Calibrates ticks against the clock over everything since the epoch pair was taken */
+static double traceTicksPerNanosecond(uint64_t epochTicks, int64_t epochNanoseconds) {
+    uint64_t nowTicks = traceTicks();
+    int64_t elapsedNanoseconds = monotonicNanoseconds() - epochNanoseconds;
+    double ticksPerNanosecond = elapsedNanoseconds > 0 ? (double) (nowTicks - epochTicks) / (double) elapsedNanoseconds : 0;
+    if (ticksPerNanosecond <= 0) {
+        ticksPerNanosecond = 1.0;
+    }
+    return ticksPerNanosecond;
+}
+
+static void connectionTraceStart(struct Connection* connection) {
+    struct Server* server = connection->server;
+    if (NULL == server) {
+        connection->trace.enabled = false;
+        return;
+    }
+    bool tracing = NULL != server->traceRing && (server->traceSampleEvery > 0 || server->traceSlowRequestMilliseconds > 0);
+    bool slowRequestLogging = NULL != server->slowRequestLog && server->slowRequestLogMilliseconds > 0;
+    connection->trace.enabled = tracing || slowRequestLogging;
+    if (!connection->trace.enabled) {
+        return;
+    }
+    connection->trace.acceptNanoseconds = monotonicNanoseconds();
+    connectionTraceMark(connection, ConnectionTraceAccept);
+}
+
+static void connectionTraceMark(struct Connection* connection, ConnectionTracePoint point) {
+    if (connection->trace.enabled) {
+        connection->trace.ticks[point] = traceTicks();
+    }
+}
+
+/* Seqlocks for the trace ring, the connection registry and the stats segment. The sequence is odd while a writer is in
+ the middle. Readers copy and keep the copy only if the sequence was even and hadn't changed by the end. The atomic adds
+ are full barriers so the writes can't move outside of them */
+static void seqlockWriteBegin(int64_t* sequence) {
+    ews_atomic_add64(sequence, 1);
+}
+
+/* For more than one writer. false if another writer has it */
+static bool seqlockTryWriteBegin(int64_t* sequence) {
+    int64_t sequenceBefore = ews_atomic_add64(sequence, 0);
+    return 0 == (sequenceBefore & 1) && ews_atomic_cas64(sequence, sequenceBefore, sequenceBefore + 1);
+}
+
+static void seqlockWriteEnd(int64_t* sequence) {
+    ews_atomic_add64(sequence, 1);
+}
+
+/* Returns what to hand to seqlockReadValid after the copy, or -1 if a writer is in the middle */
+static int64_t seqlockReadBegin(int64_t* sequence) {
+    int64_t sequenceBefore = ews_atomic_add64(sequence, 0);
+    return 0 != (sequenceBefore & 1) ? -1 : sequenceBefore;
+}
+
+static bool seqlockReadValid(int64_t* sequence, int64_t sequenceBefore) {
+    return sequenceBefore == ews_atomic_add64(sequence, 0);
+}
+
+/* The request line and the client, truncated to fit, for the trace ring, the slow request log and the connection
+ registry. remoteHostOrNULL can be NULL. The precision is what tells the compiler the truncation is on purpose */
+static void connectionRequestSummaryCopy(const struct Connection* connection, char* method, size_t methodSize, char* path, size_t pathSize, char* remoteHostOrNULL, size_t remoteHostSize) {
+    snprintf(method, methodSize, "%.*s", (int) (methodSize - 1), connection->request.method);
+    snprintf(path, pathSize, "%.*s", (int) (pathSize - 1), connection->request.path);
+    if (NULL != remoteHostOrNULL) {
+        snprintf(remoteHostOrNULL, remoteHostSize, "%.*s", (int) (remoteHostSize - 1), connection->remoteHost);
+    }
+}
+
+/* Lock-free. If a writer lapped the whole ring and is still writing this slot we just drop the record */
+static void traceRingPush(struct TraceRing* ring, struct TraceRecord* record) {
+    int64_t number = ews_atomic_add64(&ring->nextSlot, 1);
+    struct TraceRingSlot* slot = &ring->slots[number % TRACE_RING_RECORDS];
+    if (!seqlockTryWriteBegin(&slot->sequence)) {
+        return;
+    }
+    record->number = (uint64_t) number;
+    slot->record = *record;
+    seqlockWriteEnd(&slot->sequence);
+}
+
+static void connectionTraceFinish(struct Connection* connection) {
+    if (!connection->trace.enabled) {
+        return;
+    }
+    struct Server* server = connection->server;
+    int64_t durationNanoseconds = monotonicNanoseconds() - connection->trace.acceptNanoseconds;
+    if (NULL != server->slowRequestLog && server->slowRequestLogMilliseconds > 0 && durationNanoseconds >= (int64_t) server->slowRequestLogMilliseconds * 1000000) {
+        slowRequestLogPush(server->slowRequestLog, connection, durationNanoseconds);
+    }
+    if (NULL == server->traceRing || (server->traceSampleEvery <= 0 && server->traceSlowRequestMilliseconds <= 0)) {
+        return;
+    }
+    bool slow = server->traceSlowRequestMilliseconds > 0 && durationNanoseconds >= (int64_t) server->traceSlowRequestMilliseconds * 1000000;
+    int64_t requestNumber = ews_atomic_add64(&server->traceRing->requests, 1);
+    bool sampled = server->traceSampleEvery > 0 && 0 == requestNumber % server->traceSampleEvery;
+    if (!slow && !sampled) {
+        return;
+    }
+    struct TraceRecord record;
+    memset(&record, 0, sizeof(record));
+    memcpy(record.ticks, connection->trace.ticks, sizeof(record.ticks));
+    connectionRequestSummaryCopy(connection, record.method, sizeof(record.method), record.path, sizeof(record.path), record.remoteHost, sizeof(record.remoteHost));
+    record.responseCode = connection->trace.responseCode;
+    record.bytesSent = connection->status.bytesSent;
+    record.bytesReceived = connection->status.bytesReceived;
+    record.slow = slow;
+    traceRingPush(server->traceRing, &record);
+}
+
+static void traceEventAppend(struct HeapString* json, bool* first, const char* name, const struct TraceRecord* record, ConnectionTracePoint start, ConnectionTracePoint end, uint64_t epochTicks, double ticksPerMicrosecond) {
+    if (0 == record->ticks[start] || 0 == record->ticks[end] || record->ticks[end] < record->ticks[start]) {
+        return;
+    }
+    double timestampMicroseconds = (double) (int64_t) (record->ticks[start] - epochTicks) / ticksPerMicrosecond;
+    double durationMicroseconds = (double) (record->ticks[end] - record->ticks[start]) / ticksPerMicrosecond;
+    heapStringAppendString(json, *first ? "\n" : ",\n");
+    *first = false;
+    heapStringAppendString(json, "{\"name\":");
+    heapStringAppendJSONString(json, name, strlen(name));
+    heapStringAppendFormat(json, ",\"ph\":\"X\",\"pid\":1,\"tid\":%" PRIu64 ",\"ts\":%.3f,\"dur\":%.3f", record->number, timestampMicroseconds, durationMicroseconds);
+    if (ConnectionTraceAccept == start && ConnectionTraceClose == end) {
+        heapStringAppendString(json, ",\"args\":{\"remote_host\":");
+        heapStringAppendJSONString(json, record->remoteHost, strlen(record->remoteHost));
+        heapStringAppendFormat(json, ",\"status\":%d,\"bytes_sent\":%" PRId64 ",\"bytes_received\":%" PRId64 ",\"slow\":%s}",
+            record->responseCode, record->bytesSent, record->bytesReceived, record->slow ? "true" : "false");
+    }
+    heapStringAppendChar(json, '}');
+}
+
+struct HeapString serverTraceChromeJSONCreate(struct Server* server) {
+    struct HeapString json;
+    heapStringInit(&json);
+    struct TraceRing* ring = server->traceRing;
+    double ticksPerMicrosecond = 1000.0 * traceTicksPerNanosecond(ring->epochTicks, ring->epochNanoseconds);
+    struct TraceRecord* records = (struct TraceRecord*) malloc(sizeof(struct TraceRecord) * TRACE_RING_RECORDS);
+    size_t recordsCount = 0;
+    for (size_t i = 0; i < TRACE_RING_RECORDS; i++) {
+        struct TraceRingSlot* slot = &ring->slots[i];
+        /* 0 is a slot that was never written */
+        int64_t sequenceBefore = seqlockReadBegin(&slot->sequence);
+        if (sequenceBefore <= 0) {
+            continue;
+        }
+        records[recordsCount] = slot->record;
+        /* if a writer got in while we were copying the record is torn - skip it */
+        if (seqlockReadValid(&slot->sequence, sequenceBefore)) {
+            recordsCount++;
+        }
+    }
+    heapStringAppendString(&json, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    bool first = true;
+    char name[192];
+    for (size_t i = 0; i < recordsCount; i++) {
+        const struct TraceRecord* record = &records[i];
+        snprintf(name, sizeof(name), "%s %s", record->method, record->path);
+        traceEventAppend(&json, &first, name, record, ConnectionTraceAccept, ConnectionTraceClose, ring->epochTicks, ticksPerMicrosecond);
+        traceEventAppend(&json, &first, "wait for first byte", record, ConnectionTraceAccept, ConnectionTraceFirstByteReceived, ring->epochTicks, ticksPerMicrosecond);
+        traceEventAppend(&json, &first, "read headers", record, ConnectionTraceFirstByteReceived, ConnectionTraceHeadersParsed, ring->epochTicks, ticksPerMicrosecond);
+        traceEventAppend(&json, &first, "read body", record, ConnectionTraceHeadersParsed, ConnectionTraceHandlerStart, ring->epochTicks, ticksPerMicrosecond);
+        traceEventAppend(&json, &first, "handler", record, ConnectionTraceHandlerStart, ConnectionTraceHandlerEnd, ring->epochTicks, ticksPerMicrosecond);
+        traceEventAppend(&json, &first, "send", record, ConnectionTraceSendStart, ConnectionTraceSendEnd, ring->epochTicks, ticksPerMicrosecond);
+        traceEventAppend(&json, &first, "close", record, ConnectionTraceSendEnd, ConnectionTraceClose, ring->epochTicks, ticksPerMicrosecond);
+    }
+    heapStringAppendString(&json, "\n]}");
+    free(records);
+    return json;
+}
+
+static THREAD_RETURN_TYPE STDCALL_ON_WIN32 slowRequestLogThread(void* slowLogPointer) {
+    struct SlowRequestLog* slowLog = (struct SlowRequestLog*) slowLogPointer;
+    struct SlowRequestRecord record;
+    struct HeapString line;
+    heapStringInit(&line);
+    int64_t droppedReported = 0;
+    pthread_mutex_lock(&slowLog->lock);
+    while (true) {
+        while (0 == slowLog->count && !slowLog->stopping) {
+            pthread_cond_wait(&slowLog->recordAdded, &slowLog->lock);
+        }
+        if (0 == slowLog->count) {
+            break;
+        }
+        record = slowLog->records[slowLog->head];
+        slowLog->head = (slowLog->head + 1) % SLOW_REQUEST_LOG_RECORDS;
+        slowLog->count--;
+        int64_t dropped = slowLog->dropped;
+        pthread_mutex_unlock(&slowLog->lock);
+        heapStringSetToCString(&line, "");
+        slowRequestRecordFormat(&line, &record, traceTicksPerNanosecond(slowLog->epochTicks, slowLog->epochNanoseconds));
+        if (dropped != droppedReported) {
+            heapStringAppendFormat(&line, "%" PRId64 " more slow requests weren't logged because the log was busy or full\n", dropped - droppedReported);
+            droppedReported = dropped;
+        }
+        /* read every time because you can change it after serverInit */
+        FILE* file = NULL != slowLog->server->slowRequestLogFile ? slowLog->server->slowRequestLogFile : stdout;
+        fwrite(line.contents, 1, line.length, file);
+        fflush(file);
+        pthread_mutex_lock(&slowLog->lock);
+    }
+    pthread_mutex_unlock(&slowLog->lock);
+    heapStringFreeContents(&line);
+    return (THREAD_RETURN_TYPE) 0;
+}
+
+static void slowRequestLogInit(struct SlowRequestLog* slowLog, const struct Server* server) {
+    memset(slowLog, 0, sizeof(*slowLog));
+    pthread_mutex_init(&slowLog->lock, NULL);
+    pthread_cond_init(&slowLog->recordAdded, NULL);
+    slowLog->server = server;
+    slowLog->epochTicks = traceTicks();
+    slowLog->epochNanoseconds = monotonicNanoseconds();
+}
+
+/* Anything still queued is written first */
+static void slowRequestLogStop(struct SlowRequestLog* slowLog) {
+    pthread_mutex_lock(&slowLog->lock);
+    slowLog->stopping = true;
+    pthread_cond_signal(&slowLog->recordAdded);
+    bool threadStarted = slowLog->threadStarted;
+    pthread_mutex_unlock(&slowLog->lock);
+    if (threadStarted) {
+        pthread_join(slowLog->thread, NULL);
+        slowLog->threadStarted = false;
+    }
+    pthread_cond_destroy(&slowLog->recordAdded);
+    pthread_mutex_destroy(&slowLog->lock);
+}
+
+static void slowRequestLogPush(struct SlowRequestLog* slowLog, const struct Connection* connection, int64_t durationNanoseconds) {
+    if (slowLog->threadFailed) {
+        return;
+    }
+    /* build the record before taking the lock so it's only held for the copy */
+    struct SlowRequestRecord record;
+    memset(&record, 0, sizeof(record));
+    record.durationNanoseconds = durationNanoseconds;
+    memcpy(record.ticks, connection->trace.ticks, sizeof(record.ticks));
+    connectionRequestSummaryCopy(connection, record.method, sizeof(record.method), record.path, sizeof(record.path), record.remoteHost, sizeof(record.remoteHost));
+    snprintf(record.remotePort, sizeof(record.remotePort), "%.*s", (int) sizeof(record.remotePort) - 1, connection->remotePort);
+    record.routeTag = connection->routeTag;
+    record.responseCode = connection->trace.responseCode;
+    record.bytesSent = connection->status.bytesSent;
+    record.bytesReceived = connection->status.bytesReceived;
+    record.bodyLength = connection->request.body.length;
+    record.headersCount = connection->request.headersCount;
+    const char* warningNames[6];
+    size_t warningsCount = 0;
+    if (connection->request.warnings.headersStringPoolExhausted) {
+        warningNames[warningsCount++] = "headersStringPoolExhausted";
+    }
+    if (connection->request.warnings.tooManyHeaders) {
+        warningNames[warningsCount++] = "tooManyHeaders";
+    }
+    if (connection->request.warnings.methodTruncated) {
+        warningNames[warningsCount++] = "methodTruncated";
+    }
+    if (connection->request.warnings.pathTruncated) {
+        warningNames[warningsCount++] = "pathTruncated";
+    }
+    if (connection->request.warnings.versionTruncated) {
+        warningNames[warningsCount++] = "versionTruncated";
+    }
+    if (connection->request.warnings.bodyTruncated) {
+        warningNames[warningsCount++] = "bodyTruncated";
+    }
+    size_t warningsLength = 0;
+    for (size_t i = 0; i < warningsCount && warningsLength < sizeof(record.warnings); i++) {
+        int written = snprintf(record.warnings + warningsLength, sizeof(record.warnings) - warningsLength, "%s%s", 0 == i ? "" : " ", warningNames[i]);
+        if (written < 0) {
+            break;
+        }
+        warningsLength += (size_t) written;
+    }
+    if (0 != pthread_mutex_trylock(&slowLog->lock)) {
+        ews_atomic_add64(&slowLog->dropped, 1);
+        return;
+    }
+    if (!slowLog->threadStarted && !slowLog->stopping) {
+        /* it waits for the lock we're holding before it looks at the records */
+        int result = pthread_create(&slowLog->thread, NULL, &slowRequestLogThread, slowLog);
+        if (0 != result) {
+            ews_printf("Could not start the slow request log thread. pthread_create returned %d. Slow requests won't be logged\n", result);
+            slowLog->threadFailed = true;
+            pthread_mutex_unlock(&slowLog->lock);
+            return;
+        }
+        slowLog->threadStarted = true;
+    }
+    if (!slowLog->threadStarted || slowLog->count == SLOW_REQUEST_LOG_RECORDS) {
+        ews_atomic_add64(&slowLog->dropped, 1);
+    } else {
+        slowLog->records[(slowLog->head + slowLog->count) % SLOW_REQUEST_LOG_RECORDS] = record;
+        slowLog->count++;
+        pthread_cond_signal(&slowLog->recordAdded);
+    }
+    pthread_mutex_unlock(&slowLog->lock);
+}
+
+static void slowRequestStageAppend(struct HeapString* line, const char* separator, const char* name, const struct SlowRequestRecord* record, ConnectionTracePoint start, ConnectionTracePoint end, double ticksPerNanosecond) {
+    if (0 == record->ticks[start] || 0 == record->ticks[end] || record->ticks[end] < record->ticks[start]) {
+        heapStringAppendFormat(line, "%s%s -", separator, name);
+        return;
+    }
+    double milliseconds = (double) (record->ticks[end] - record->ticks[start]) / ticksPerNanosecond / 1000000.0;
+    heapStringAppendFormat(line, "%s%s %.1fms", separator, name, milliseconds);
+}
+
+static void slowRequestRecordFormat(struct HeapString* line, const struct SlowRequestRecord* record, double ticksPerNanosecond) {
+    heapStringAppendFormat(line, "Slow request: %.1fms %s %s from %s:%s -> %d",
+        (double) record->durationNanoseconds / 1000000.0, record->method, record->path, record->remoteHost, record->remotePort, record->responseCode);
+    if (NULL != record->routeTag) {
+        heapStringAppendFormat(line, " (%s)", record->routeTag);
+    }
+    slowRequestStageAppend(line, ". ", "wait", record, ConnectionTraceAccept, ConnectionTraceFirstByteReceived, ticksPerNanosecond);
+    slowRequestStageAppend(line, ", ", "read headers", record, ConnectionTraceFirstByteReceived, ConnectionTraceHeadersParsed, ticksPerNanosecond);
+    slowRequestStageAppend(line, ", ", "read body", record, ConnectionTraceHeadersParsed, ConnectionTraceHandlerStart, ticksPerNanosecond);
+    slowRequestStageAppend(line, ", ", "handler", record, ConnectionTraceHandlerStart, ConnectionTraceHandlerEnd, ticksPerNanosecond);
+    slowRequestStageAppend(line, ", ", "send", record, ConnectionTraceSendStart, ConnectionTraceSendEnd, ticksPerNanosecond);
+    heapStringAppendFormat(line, ". Received %" PRId64 " bytes (%" PRIu64 " headers, %" PRIu64 " byte body), sent %" PRId64 " bytes",
+        record->bytesReceived, (uint64_t) record->headersCount, (uint64_t) record->bodyLength, record->bytesSent);
+    if ('\0' != record->warnings[0]) {
+        heapStringAppendFormat(line, ". Warnings: %s", record->warnings);
+    }
+    heapStringAppendChar(line, '\n');
+}
+
+static struct ConnectionRegistrySlot* connectionRegistrySlot(struct Connection* connection) {
+    if (connection->registrySlot < 0) {
+        return NULL;
+    }
+    return &connection->server->connectionRegistry->slots[connection->registrySlot];
+}
+
+static void connectionRegistryAdd(struct Connection* connection) {
+    struct Server* server = connection->server;
+    if (NULL == server || NULL == server->connectionRegistry) {
+        return;
+    }
+    struct ConnectionRegistry* registry = server->connectionRegistry;
+    int64_t start = ews_atomic_add64(&registry->nextSlot, 1);
+    for (int64_t i = 0; i < SERVER_CONNECTION_REGISTRY_SLOTS; i++) {
+        int slotIndex = (int) ((start + i) % SERVER_CONNECTION_REGISTRY_SLOTS);
+        struct ConnectionRegistrySlot* slot = &registry->slots[slotIndex];
+        if (!ews_atomic_cas64(&slot->inUse, 0, 1)) {
+            continue;
+        }
+        connection->registrySlot = slotIndex;
+        connection->registryState = ConnectionStateReadingHeaders;
+        seqlockWriteBegin(&slot->sequence);
+        slot->index = slotIndex;
+        slot->generation++;
+        slot->state = ConnectionStateReadingHeaders;
+        slot->startNanoseconds = monotonicNanoseconds();
+        slot->stateNanoseconds = slot->startNanoseconds;
+        slot->bytesReceived = 0;
+        slot->bytesSent = 0;
+        snprintf(slot->remoteHost, sizeof(slot->remoteHost), "%.*s", (int) sizeof(slot->remoteHost) - 1, connection->remoteHost);
+        snprintf(slot->remotePort, sizeof(slot->remotePort), "%.*s", (int) sizeof(slot->remotePort) - 1, connection->remotePort);
+        slot->method[0] = '\0';
+        slot->path[0] = '\0';
+        slot->routeTag = NULL;
+        seqlockWriteEnd(&slot->sequence);
+        return;
+    }
+    ews_atomic_add64(&registry->unregistered, 1);
+}
+
+static void connectionRegistryUpdate(struct Connection* connection, ConnectionState state) {
+    struct ConnectionRegistrySlot* slot = connectionRegistrySlot(connection);
+    if (NULL == slot) {
+        return;
+    }
+    seqlockWriteBegin(&slot->sequence);
+    if (state != connection->registryState) {
+        slot->state = state;
+        slot->stateNanoseconds = monotonicNanoseconds();
+        connection->registryState = state;
+    }
+    slot->bytesReceived = connection->status.bytesReceived;
+    /* the request line is done by the time we're past the headers. We own the slot so we can read it */
+    if ('\0' == slot->path[0] && ConnectionStateReadingHeaders != state) {
+        connectionRequestSummaryCopy(connection, slot->method, sizeof(slot->method), slot->path, sizeof(slot->path), NULL, 0);
+    }
+    slot->routeTag = connection->routeTag;
+    seqlockWriteEnd(&slot->sequence);
+}
+
+static void connectionRegistryBytesSent(struct Connection* connection, int64_t bytesSent) {
+    struct ConnectionRegistrySlot* slot = connectionRegistrySlot(connection);
+    if (NULL == slot) {
+        return;
+    }
+    seqlockWriteBegin(&slot->sequence);
+    slot->bytesSent = bytesSent;
+    seqlockWriteEnd(&slot->sequence);
+}
+
+static void connectionRegistryRemove(struct Connection* connection) {
+    struct ConnectionRegistrySlot* slot = connectionRegistrySlot(connection);
+    if (NULL == slot) {
+        return;
+    }
+    connection->registrySlot = -1;
+    ews_atomic_cas64(&slot->inUse, 1, 0);
+}
+
+static int connectionRegistrySlotCompareOldestFirst(const void* aPointer, const void* bPointer) {
+    const struct ConnectionRegistrySlot* a = (const struct ConnectionRegistrySlot*) aPointer;
+    const struct ConnectionRegistrySlot* b = (const struct ConnectionRegistrySlot*) bPointer;
+    if (a->startNanoseconds == b->startNanoseconds) {
+        return 0;
+    }
+    return a->startNanoseconds < b->startNanoseconds ? -1 : 1;
+}
+
+/* Copies the live connections into connections (SERVER_CONNECTION_REGISTRY_SLOTS of them), oldest first. Slots that are
+ being written while we copy are tried again a few times and then skipped */
+static size_t connectionRegistrySnapshot(struct ConnectionRegistry* registry, struct ConnectionRegistrySlot* connections) {
+    size_t connectionsCount = 0;
+    for (size_t i = 0; i < SERVER_CONNECTION_REGISTRY_SLOTS; i++) {
+        struct ConnectionRegistrySlot* slot = &registry->slots[i];
+        for (int attempt = 0; attempt < 4; attempt++) {
+            if (0 == ews_atomic_add64(&slot->inUse, 0)) {
+                break;
+            }
+            int64_t sequenceBefore = seqlockReadBegin(&slot->sequence);
+            if (sequenceBefore < 0) {
+                continue;
+            }
+            connections[connectionsCount] = *slot;
+            if (seqlockReadValid(&slot->sequence, sequenceBefore)) {
+                connectionsCount++;
+                break;
+            }
+        }
+    }
+    qsort(connections, connectionsCount, sizeof(connections[0]), connectionRegistrySlotCompareOldestFirst);
+    return connectionsCount;
+}
+
+static const char* connectionStateName(ConnectionState state) {
+    switch (state) {
+        case ConnectionStateReadingHeaders:
+            return "reading headers";
+        case ConnectionStateReadingBody:
+            return "reading body";
+        case ConnectionStateInHandler:
+            return "in handler";
+        case ConnectionStateSending:
+            return "sending";
+    }
+    return "unknown";
+}
+
+struct HeapString serverConnectionsJSONCreate(struct Server* server) {
+    struct HeapString json;
+    heapStringInit(&json);
+    struct ConnectionRegistry* registry = server->connectionRegistry;
+    struct ConnectionRegistrySlot* connections = (struct ConnectionRegistrySlot*) malloc(sizeof(struct ConnectionRegistrySlot) * SERVER_CONNECTION_REGISTRY_SLOTS);
+    size_t connectionsCount = connectionRegistrySnapshot(registry, connections);
+    int64_t nowNanoseconds = monotonicNanoseconds();
+    heapStringAppendFormat(&json, "{\"unregistered\":%" PRId64 ",\"connections\":[", ews_atomic_add64(&registry->unregistered, 0));
+    for (size_t i = 0; i < connectionsCount; i++) {
+        const struct ConnectionRegistrySlot* connection = &connections[i];
+        heapStringAppendString(&json, 0 == i ? "\n" : ",\n");
+        heapStringAppendFormat(&json, "{\"id\":\"%d.%" PRId64 "\",\"remote_host\":", connection->index, connection->generation);
+        heapStringAppendJSONString(&json, connection->remoteHost, strlen(connection->remoteHost));
+        heapStringAppendString(&json, ",\"remote_port\":");
+        heapStringAppendJSONString(&json, connection->remotePort, strlen(connection->remotePort));
+        heapStringAppendFormat(&json, ",\"state\":\"%s\",\"age_ms\":%" PRId64 ",\"in_state_ms\":%" PRId64 ",\"bytes_received\":%" PRId64 ",\"bytes_sent\":%" PRId64 ",\"method\":",
+            connectionStateName(connection->state),
+            (nowNanoseconds - connection->startNanoseconds) / 1000000,
+            (nowNanoseconds - connection->stateNanoseconds) / 1000000,
+            connection->bytesReceived,
+            connection->bytesSent);
+        heapStringAppendJSONString(&json, connection->method, strlen(connection->method));
+        heapStringAppendString(&json, ",\"path\":");
+        heapStringAppendJSONString(&json, connection->path, strlen(connection->path));
+        heapStringAppendString(&json, ",\"route\":");
+        if (NULL != connection->routeTag) {
+            heapStringAppendJSONString(&json, connection->routeTag, strlen(connection->routeTag));
+        } else {
+            heapStringAppendString(&json, "null");
+        }
+        heapStringAppendChar(&json, '}');
     }
-    result = fseek(fp, 0, SEEK_SET);
-    if (0 != result) {
-        ews_printf("Unable to satisfy request for '%s' because we could not fseek to the beginning of the file '%s' %s = %d\n", connection->request.path, response->filenameToSend, strerror(errno), errno);
-        errorResponse = responseAlloc500InternalErrorHTML("fseek to beginning of file to start sending failed");
-        goto exit;
+    heapStringAppendString(&json, "\n]}");
+    free(connections);
+    return json;
+}
+
+static void heapStringAppendEscapedForHTML(struct HeapString* string, const char* unescaped) {
+    char* escaped = strdupEscapeForHTML(unescaped);
+    heapStringAppendString(string, escaped);
+    free(escaped);
+}
+
+struct HeapString serverConnectionsHTMLCreate(struct Server* server) {
+    struct HeapString html;
+    heapStringInit(&html);
+    struct ConnectionRegistry* registry = server->connectionRegistry;
+    struct ConnectionRegistrySlot* connections = (struct ConnectionRegistrySlot*) malloc(sizeof(struct ConnectionRegistrySlot) * SERVER_CONNECTION_REGISTRY_SLOTS);
+    size_t connectionsCount = connectionRegistrySnapshot(registry, connections);
+    int64_t nowNanoseconds = monotonicNanoseconds();
+    int64_t unregistered = ews_atomic_add64(&registry->unregistered, 0);
+    heapStringAppendFormat(&html, "<p>%" PRIu64 " connections, oldest first", (uint64_t) connectionsCount);
+    if (unregistered > 0) {
+        heapStringAppendFormat(&html, " (%" PRId64 " connections didn't fit since the server started - see SERVER_CONNECTION_REGISTRY_SLOTS)", unregistered);
     }
-    
-    /* now we have the file length + MIME TYpe and we can send the header */
-    headerLength = snprintfResponseHeader(connection->responseHeader, sizeof(connection->responseHeader), response->code, response->status, contentType, response->extraHeaders, fileLength);
-    sendResult = send(connection->socketfd, connection->responseHeader, headerLength, 0);
-    if (sendResult != headerLength) {
-        ews_printf("Unable to satisfy request for '%s' because we could not send the HTTP header '%s' %s = %d\n", connection->request.path, response->filenameToSend, strerror(errno), errno);
-        result = 1;
-        goto exit;
+    heapStringAppendString(&html, "</p>\n<table>\n<tr><th>Client</th><th>State</th><th>Age (ms)</th><th>In state (ms)</th><th>Received</th><th>Sent</th><th>Request</th><th>Route</th></tr>\n");
+    for (size_t i = 0; i < connectionsCount; i++) {
+        const struct ConnectionRegistrySlot* connection = &connections[i];
+        heapStringAppendString(&html, "<tr><td>");
+        heapStringAppendEscapedForHTML(&html, connection->remoteHost);
+        heapStringAppendChar(&html, ':');
+        heapStringAppendEscapedForHTML(&html, connection->remotePort);
+        heapStringAppendFormat(&html, "</td><td>%s</td><td>%" PRId64 "</td><td>%" PRId64 "</td><td>%" PRId64 "</td><td>%" PRId64 "</td><td>",
+            connectionStateName(connection->state),
+            (nowNanoseconds - connection->startNanoseconds) / 1000000,
+            (nowNanoseconds - connection->stateNanoseconds) / 1000000,
+            connection->bytesReceived,
+            connection->bytesSent);
+        heapStringAppendEscapedForHTML(&html, connection->method);
+        heapStringAppendChar(&html, ' ');
+        heapStringAppendEscapedForHTML(&html, connection->path);
+        heapStringAppendString(&html, "</td><td>");
+        if (NULL != connection->routeTag) {
+            heapStringAppendEscapedForHTML(&html, connection->routeTag);
+        }
+        heapStringAppendString(&html, "</td></tr>\n");
     }
-    if (OptionPrintResponse) {
-        fwrite(connection->responseHeader, 1, headerLength, stdout);
+    heapStringAppendString(&html, "</table>\n");
+    free(connections);
+    return html;
+}
+
+/* Runs on the publisher thread. The counters and the registry are read without locks. A counter can be a little stale
+ but that's fine for a live view, and we only trylock the TCP_INFO histograms so a busy lock just means the previous
+ histograms get published again */
+static void statsSegmentFill(struct Server* server, struct StatsSegment* staging, struct ConnectionRegistrySlot* connections) {
+    staging->publishedUnixSeconds = (int64_t) time(NULL);
+    staging->publishes++;
+    staging->bytesReceived = counters.bytesReceived;
+    staging->bytesSent = counters.bytesSent;
+    staging->totalConnections = counters.totalConnections;
+    staging->activeConnections = counters.activeConnections;
+    staging->heapStringAllocations = counters.heapStringAllocations;
+    staging->heapStringReallocations = counters.heapStringReallocations;
+    staging->heapStringFrees = counters.heapStringFrees;
+    staging->heapStringTotalBytesReallocated = counters.heapStringTotalBytesReallocated;
+    staging->responsesForClosedConnections = counters.responsesForClosedConnections;
+    staging->missingPathCacheHits = counters.missingPathCacheHits;
+    staging->controlRequestsInFlight = ews_atomic_add64(&server->controlRequestsInFlight, 0);
+    if (0 == pthread_mutex_trylock(&server->tcpInfoStatistics.lock)) {
+        const struct TCPInfoHistograms* histograms = &server->tcpInfoStatistics.server;
+        staging->tcpInfoSamples = histograms->samples;
+        memcpy(staging->tcpInfoRTTMicroseconds, histograms->rttMicroseconds, sizeof(staging->tcpInfoRTTMicroseconds));
+        memcpy(staging->tcpInfoTotalRetransmits, histograms->totalRetransmits, sizeof(staging->tcpInfoTotalRetransmits));
+        memcpy(staging->tcpInfoCongestionWindowSegments, histograms->congestionWindowSegments, sizeof(staging->tcpInfoCongestionWindowSegments));
+        memcpy(staging->tcpInfoDeliveryRateBytesPerSecond, histograms->deliveryRateBytesPerSecond, sizeof(staging->tcpInfoDeliveryRateBytesPerSecond));
+        pthread_mutex_unlock(&server->tcpInfoStatistics.lock);
     }
-    *bytesSent = sendResult;
-    /* read the whole file, just buffering into the connection buffer, and sending it out to the socket */
-    while (!feof(fp)) {
-        size_t bytesRead = fread(connection->sendRecvBuffer, 1, sizeof(connection->sendRecvBuffer), fp);
-        if (0 == bytesRead) { /* peacefull end of file */
-            break;
+    memset(staging->connectionsByState, 0, sizeof(staging->connectionsByState));
+    memset(staging->connections, 0, sizeof(staging->connections));
+    size_t connectionsCount = connectionRegistrySnapshot(server->connectionRegistry, connections);
+    int64_t nowNanoseconds = monotonicNanoseconds();
+    for (size_t i = 0; i < connectionsCount; i++) {
+        if ((size_t) connections[i].state < sizeof(staging->connectionsByState) / sizeof(staging->connectionsByState[0])) {
+            staging->connectionsByState[connections[i].state]++;
         }
-        if (-1 == bytesRead) {
-            ews_printf("Unable to satisfy request for '%s' because there was an error freading. '%s' %s = %d\n", connection->request.path, response->filenameToSend, strerror(errno), errno);
-            errorResponse = responseAlloc500InternalErrorHTML("Could not fread to send over socket");
-            goto exit;
+        if (i >= STATS_SEGMENT_CONNECTIONS) {
+            continue;
         }
-        /* send the data out the socket to the network */
-        sendResult = send(connection->socketfd, connection->sendRecvBuffer, bytesRead, 0);
-        if (sendResult != bytesRead) {
-            ews_printf("Unable to satisfy request for '%s' because there was an error sending bytes. '%s' %s = %d\n", connection->request.path, response->filenameToSend, strerror(errno), errno);
-            result = 1;
-            goto exit;
+        struct StatsSegmentConnection* connection = &staging->connections[i];
+        connection->state = (int32_t) connections[i].state;
+        connection->ageMilliseconds = (nowNanoseconds - connections[i].startNanoseconds) / 1000000;
+        connection->inStateMilliseconds = (nowNanoseconds - connections[i].stateNanoseconds) / 1000000;
+        connection->bytesReceived = connections[i].bytesReceived;
+        connection->bytesSent = connections[i].bytesSent;
+        memcpy(connection->remoteHost, connections[i].remoteHost, sizeof(connection->remoteHost));
+        memcpy(connection->method, connections[i].method, sizeof(connection->method));
+        memcpy(connection->path, connections[i].path, sizeof(connection->path));
+    }
+    staging->connectionsUnregistered = ews_atomic_add64(&server->connectionRegistry->unregistered, 0);
+    staging->connectionsCount = (int64_t) MIN(connectionsCount, (size_t) STATS_SEGMENT_CONNECTIONS);
+}
+
+/* We're the only writer. Readers in other processes retry while sequence is odd or changes under them */
+static void statsSegmentPublish(struct StatsSegment* segment, const struct StatsSegment* staging) {
+    seqlockWriteBegin(&segment->sequence);
+    size_t offset = offsetof(struct StatsSegment, publisherProcessID);
+    memcpy((char*) segment + offset, (const char*) staging + offset, sizeof(*segment) - offset);
+    seqlockWriteEnd(&segment->sequence);
+}
+
+static THREAD_RETURN_TYPE STDCALL_ON_WIN32 statsPublisherThread(void* publisherPointer) {
+    struct StatsPublisher* publisher = (struct StatsPublisher*) publisherPointer;
+    while (0 == ews_atomic_add64(&publisher->stopping, 0)) {
+        statsSegmentFill(publisher->server, &publisher->staging, publisher->connections);
+        statsSegmentPublish(publisher->segment, &publisher->staging);
+        /* sleep in small steps so serverDeInit doesn't wait a whole interval */
+        int64_t remainingMilliseconds = publisher->intervalMilliseconds;
+        while (remainingMilliseconds > 0 && 0 == ews_atomic_add64(&publisher->stopping, 0)) {
+            int64_t sleepMilliseconds = MIN(remainingMilliseconds, 50);
+            sleepNanoseconds(sleepMilliseconds * 1000000);
+            remainingMilliseconds -= sleepMilliseconds;
         }
-        if (OptionPrintResponse) {
-            fwrite(connection->sendRecvBuffer, 1, bytesRead, stdout);
+    }
+    return (THREAD_RETURN_TYPE) 0;
+}
+
+int serverStatsSharedMemoryPublish(struct Server* server, const char* name, int intervalMilliseconds) {
+    if (NULL != server->statsPublisher) {
+        ews_printf("Warning: Server %p is already publishing stats to '%s'. Ignoring '%s'\n", server, server->statsPublisher->name, name);
+        return 1;
+    }
+    if (strlen(name) >= sizeof(server->statsPublisher->name) || intervalMilliseconds <= 0) {
+        ews_printf("Can't publish stats to '%s' every %d ms. The name can be %d characters and the interval has to be positive\n", name, intervalMilliseconds, (int) sizeof(server->statsPublisher->name) - 1);
+        return 1;
+    }
+    struct StatsSegment* segment = (struct StatsSegment*) sharedMemoryCreate(name, sizeof(struct StatsSegment), offsetof(struct StatsSegment, publisherProcessID));
+    if (NULL == segment) {
+        return 1;
+    }
+    /* sequence stays 0 until the first publish so readers don't trust the rest before then. The process ID goes in right
+     away so the next server can tell if we died */
+    segment->publisherProcessID = processID();
+    segment->magic = STATS_SEGMENT_MAGIC;
+    segment->version = STATS_SEGMENT_VERSION;
+    segment->size = sizeof(struct StatsSegment);
+    struct StatsPublisher* publisher = (struct StatsPublisher*) calloc(1, sizeof(*publisher));
+    publisher->server = server;
+    publisher->segment = segment;
+    strcpy(publisher->name, name);
+    publisher->intervalMilliseconds = intervalMilliseconds;
+    publisher->staging.publisherProcessID = processID();
+    publisher->staging.publishIntervalMilliseconds = intervalMilliseconds;
+    publisher->connections = (struct ConnectionRegistrySlot*) malloc(sizeof(struct ConnectionRegistrySlot) * SERVER_CONNECTION_REGISTRY_SLOTS);
+    int result = pthread_create(&publisher->thread, NULL, &statsPublisherThread, publisher);
+    if (0 != result) {
+        ews_printf("Could not start the stats publisher thread. pthread_create returned %d\n", result);
+        sharedMemoryDestroy(name, segment, sizeof(struct StatsSegment));
+        free(publisher->connections);
+        free(publisher);
+        return 1;
+    }
+    server->statsPublisher = publisher;
+    return 0;
+}
+
+static void statsPublisherStop(struct StatsPublisher* publisher) {
+    ews_atomic_add64(&publisher->stopping, 1);
+    pthread_join(publisher->thread, NULL);
+    sharedMemoryDestroy(publisher->name, publisher->segment, sizeof(struct StatsSegment));
+    free(publisher->connections);
+    free(publisher);
+}
+
+static struct ServerStoreShard* serverStoreShardForHash(struct ServerStore* store, uint64_t hash) {
+    return &store->shards[hash % SERVER_STORE_SHARDS];
+}
+
+static struct ServerStoreEntry** serverStoreBucketForHash(struct ServerStoreShard* shard, uint64_t hash) {
+    /* the low bits picked the shard so use the next ones for the bucket */
+    return &shard->buckets[(hash / SERVER_STORE_SHARDS) % SERVER_STORE_BUCKETS_PER_SHARD];
+}
+
+/* call with the shard lock held */
+static struct ServerStoreEntry* serverStoreShardFind(struct ServerStoreShard* shard, uint64_t hash, const char* key, size_t keyLength) {
+    struct ServerStoreEntry* entry = *serverStoreBucketForHash(shard, hash);
+    while (NULL != entry) {
+        if (entry->hash == hash && entry->keyLength == keyLength && 0 == memcmp(entry->key, key, keyLength)) {
+            return entry;
         }
+        entry = entry->nextInBucket;
+    }
+    return NULL;
+}
 
-        *bytesSent = *bytesSent + sendResult;
+/* call with the shard lock held */
+static void serverStoreShardRemove(struct ServerStoreShard* shard, struct ServerStoreEntry* entry) {
+    struct ServerStoreEntry** link = serverStoreBucketForHash(shard, entry->hash);
+    while (*link != entry) {
+        assert(NULL != *link && "A server store entry was missing from its bucket");
+        link = &(*link)->nextInBucket;
     }
-exit:
-    if (NULL != fp) {
-        fclose(fp);
+    *link = entry->nextInBucket;
+    if (NULL != entry->older) {
+        entry->older->newer = entry->newer;
+    } else {
+        shard->oldest = entry->newer;
     }
-    if (NULL != errorResponse) {
-        ews_printf("Instead of satisfying the request for '%s' we encountered an error and will return %d %s\n", connection->request.path, response->code, response->status);
-        ssize_t errorBytesSent = 0;
-        result = sendResponseBody(connection, errorResponse, &errorBytesSent);
-        *bytesSent = *bytesSent + errorBytesSent;
-        return result;
+    if (NULL != entry->newer) {
+        entry->newer->older = entry->older;
+    } else {
+        shard->newest = entry->older;
     }
-    return result;
+    shard->memoryUsed -= entry->allocationSize;
+    free(entry);
 }
 
-static THREAD_RETURN_TYPE STDCALL_ON_WIN32 connectionHandlerThread(void* connectionPointer) {
-    struct Connection* connection = (struct Connection*) connectionPointer;
-    getnameinfo((struct sockaddr*) &connection->remoteAddr, connection->remoteAddrLength,
-                connection->remoteHost, sizeof(connection->remoteHost),
-                connection->remotePort, sizeof(connection->remotePort), NI_NUMERICHOST | NI_NUMERICSERV);
-    ews_printf_debug("New connection from %s:%s...\n", connection->remoteHost, connection->remotePort);
-    if (OptionIncludeStatusPageAndCounters) {
-        pthread_mutex_lock(&counters.lock);
-        counters.activeConnections++;
-        counters.totalConnections++;
-        pthread_mutex_unlock(&counters.lock);
+static bool serverStoreEntryExpired(const struct ServerStoreEntry* entry, time_t now) {
+    return 0 != entry->expires && entry->expires <= now;
+}
+
+/* call with the shard lock held. Throw out expired entries first and then the least recently set until there's room */
+static void serverStoreShardMakeRoom(struct ServerStoreShard* shard, size_t bytesNeeded, time_t now) {
+    const size_t shardMemoryLimit = SERVER_STORE_MAX_MEMORY / SERVER_STORE_SHARDS;
+    if (shard->memoryUsed + bytesNeeded <= shardMemoryLimit) {
+        return;
     }
-    /* first read the request + request body */
-    bool madeRequestPrintf = false;
-    bool foundRequest = false;
-    ssize_t bytesRead;
-    while ((bytesRead = recv(connection->socketfd, connection->sendRecvBuffer, SEND_RECV_BUFFER_SIZE, 0)) > 0) {
-        if (OptionPrintWholeRequest) {
-            fwrite(connection->sendRecvBuffer, 1, bytesRead, stdout);
-        }
-        connection->status.bytesReceived += bytesRead;
-        requestParse(&connection->request, connection->sendRecvBuffer, bytesRead);
-        if (connection->request.state >= RequestParseStateVersion && !madeRequestPrintf) {
-            ews_printf_debug("Request from %s:%s: %s to %s HTTP version %s\n",
-                   connection->remoteHost,
-                   connection->remotePort,
-                   connection->request.method,
-                   connection->request.path,
-                   connection->request.version);
-            madeRequestPrintf = true;
-        }
-        if (connection->request.state == RequestParseStateDone) {
-            foundRequest = true;
-            break;
-        }
-#ifdef EWS_FUZZ_TESTING /* This enables us to fuzz test different content lengths */
-        if (connection->request.state == RequestParseStateBody) {
-            foundRequest = true;
+    struct ServerStoreEntry* entry = shard->oldest;
+    while (NULL != entry) {
+        struct ServerStoreEntry* newer = entry->newer;
+        if (serverStoreEntryExpired(entry, now)) {
+            serverStoreShardRemove(shard, entry);
         }
-#endif
+        entry = newer;
     }
-    requestPrintWarnings(&connection->request, connection->remoteHost, connection->remotePort);
-    ssize_t bytesSent = 0;
-    if (foundRequest) {
-        struct Response* response = createResponseForRequest(&connection->request, connection);
-        if (NULL != response) {
-            int result = sendResponse(connection, response, &bytesSent);
-            if (0 == result) {
-                ews_printf_debug("%s:%s: Responded with HTTP %d %s length %" PRId64 "\n", connection->remoteHost, connection->remotePort, response->code, response->status, (int64_t)bytesSent);
-            } else {
-                /* sendResponse already printed something out, don't add another ews_printf */
-            }
-            responseFree(response);
-            connection->status.bytesSent = bytesSent;
-        } else {
-            ews_printf("%s:%s: You have returned a NULL response - I'm assuming you took over the request handling yourself.\n", connection->remoteHost, connection->remotePort);
-        }
+    while (NULL != shard->oldest && shard->memoryUsed + bytesNeeded > shardMemoryLimit) {
+        ews_printf_debug("Server store shard %p is full - evicting '%s'\n", shard, shard->oldest->key);
+        serverStoreShardRemove(shard, shard->oldest);
+    }
+}
+
+/* call with the shard lock held */
+static int serverStoreShardSet(struct ServerStoreShard* shard, uint64_t hash, const char* key, size_t keyLength, const void* value, size_t valueLength, time_t expires) {
+    size_t allocationSize = sizeof(struct ServerStoreEntry) + keyLength + 1 + valueLength + 1;
+    if (allocationSize > SERVER_STORE_MAX_MEMORY / SERVER_STORE_SHARDS) {
+        ews_printf("Warning: Could not store %" PRIu64 " bytes for key '%s' because a store shard only holds %" PRIu64 " bytes. Try increasing SERVER_STORE_MAX_MEMORY\n",
+            (uint64_t) valueLength, key, (uint64_t) (SERVER_STORE_MAX_MEMORY / SERVER_STORE_SHARDS));
+        return 1;
+    }
+    struct ServerStoreEntry* existing = serverStoreShardFind(shard, hash, key, keyLength);
+    if (NULL != existing) {
+        serverStoreShardRemove(shard, existing);
+    }
+    serverStoreShardMakeRoom(shard, allocationSize, time(NULL));
+    struct ServerStoreEntry* entry = (struct ServerStoreEntry*) malloc(allocationSize);
+    entry->hash = hash;
+    entry->expires = expires;
+    entry->allocationSize = allocationSize;
+    entry->keyLength = keyLength;
+    entry->valueLength = valueLength;
+    entry->key = (char*) (entry + 1);
+    memcpy(entry->key, key, keyLength);
+    entry->key[keyLength] = '\0';
+    entry->value = entry->key + keyLength + 1;
+    memcpy(entry->value, value, valueLength);
+    entry->value[valueLength] = '\0';
+    struct ServerStoreEntry** bucket = serverStoreBucketForHash(shard, hash);
+    entry->nextInBucket = *bucket;
+    *bucket = entry;
+    entry->newer = NULL;
+    entry->older = shard->newest;
+    if (NULL != shard->newest) {
+        shard->newest->newer = entry;
     } else {
-        ews_printf("No request found from %s:%s? Closing connection. Here's the last bytes we received in the request (length %" PRIi64 "). The total bytes received on this connection: %" PRIi64 " :\n", connection->remoteHost, connection->remotePort, (int64_t) bytesRead, connection->status.bytesReceived);
-        if (bytesRead > 0) {
-            fwrite(connection->sendRecvBuffer, 1, bytesRead, stdout);
-        }
+        shard->oldest = entry;
     }
-    /* Alright - we're done */
-    close(connection->socketfd);
-    pthread_mutex_lock(&counters.lock);
-    counters.bytesSent += (ssize_t) connection->status.bytesSent;
-    counters.bytesReceived += (ssize_t) connection->status.bytesReceived;
-    counters.activeConnections--;
-    pthread_mutex_unlock(&counters.lock);
-    ews_printf_debug("Connection from %s:%s closed\n", connection->remoteHost, connection->remotePort);
-    pthread_mutex_lock(&connection->server->connectionFinishedLock);
-    connection->server->activeConnectionCount--;
-    pthread_cond_signal(&connection->server->connectionFinishedCond);
-    pthread_mutex_unlock(&connection->server->connectionFinishedLock);
-    connectionFree(connection);
-    return (THREAD_RETURN_TYPE) NULL;
+    shard->newest = entry;
+    shard->memoryUsed += allocationSize;
+    return 0;
 }
 
-int serverMutexLock(struct Server* server) {
-    return pthread_mutex_lock(&server->globalMutex);
+int serverStoreSet(struct Server* server, const char* key, const void* value, size_t valueLength, int ttlSeconds) {
+    size_t keyLength = strlen(key);
+    uint64_t hash = hashFNV1a64(key, keyLength);
+    time_t expires = ttlSeconds > 0 ? time(NULL) + ttlSeconds : 0;
+    struct ServerStoreShard* shard = serverStoreShardForHash(&server->store, hash);
+    rwLockWriteLock(&shard->lock);
+    int result = serverStoreShardSet(shard, hash, key, keyLength, value, valueLength, expires);
+    rwLockUnlock(&shard->lock);
+    return result;
 }
 
-int serverMutexUnlock(struct Server* server) {
-    return pthread_mutex_unlock(&server->globalMutex);
+bool serverStoreGet(struct Server* server, const char* key, struct HeapString* valueOut) {
+    size_t keyLength = strlen(key);
+    uint64_t hash = hashFNV1a64(key, keyLength);
+    struct ServerStoreShard* shard = serverStoreShardForHash(&server->store, hash);
+    bool found = false;
+    /* many handlers can read at once. Expired entries are left for the next writer to clean up */
+    rwLockReadLock(&shard->lock);
+    struct ServerStoreEntry* entry = serverStoreShardFind(shard, hash, key, keyLength);
+    if (NULL != entry && !serverStoreEntryExpired(entry, time(NULL))) {
+        /* the value can have '\0's in it so don't use heapStringSetToCString */
+        heapStringReallocIfNeeded(valueOut, entry->valueLength + 1);
+        memcpy(valueOut->contents, entry->value, entry->valueLength);
+        valueOut->length = entry->valueLength;
+        valueOut->contents[valueOut->length] = '\0';
+        found = true;
+    }
+    rwLockUnlock(&shard->lock);
+    return found;
+}
+
+bool serverStoreDelete(struct Server* server, const char* key) {
+    size_t keyLength = strlen(key);
+    uint64_t hash = hashFNV1a64(key, keyLength);
+    struct ServerStoreShard* shard = serverStoreShardForHash(&server->store, hash);
+    rwLockWriteLock(&shard->lock);
+    struct ServerStoreEntry* entry = serverStoreShardFind(shard, hash, key, keyLength);
+    if (NULL != entry) {
+        serverStoreShardRemove(shard, entry);
+    }
+    rwLockUnlock(&shard->lock);
+    return NULL != entry;
+}
+
+int64_t serverStoreIncrement(struct Server* server, const char* key, int64_t delta) {
+    size_t keyLength = strlen(key);
+    uint64_t hash = hashFNV1a64(key, keyLength);
+    struct ServerStoreShard* shard = serverStoreShardForHash(&server->store, hash);
+    rwLockWriteLock(&shard->lock);
+    int64_t value = 0;
+    time_t expires = 0;
+    struct ServerStoreEntry* entry = serverStoreShardFind(shard, hash, key, keyLength);
+    if (NULL != entry && !serverStoreEntryExpired(entry, time(NULL))) {
+        sscanf(entry->value, "%" SCNd64, &value);
+        expires = entry->expires;
+    }
+    value += delta;
+    char valueString[32];
+    int valueStringLength = snprintf(valueString, sizeof(valueString), "%" PRId64, value);
+    serverStoreShardSet(shard, hash, key, keyLength, valueString, (size_t) valueStringLength, expires);
+    rwLockUnlock(&shard->lock);
+    return value;
 }
 
 /* Apache2 has a module called MIME magic or something which does a really good version of this. */
@@ -1926,10 +5999,29 @@ static bool strEndsWith(const char* big, const char* endsWith) {
     return true;
 }
 
-static int snprintfResponseHeader(char* destination, size_t destinationCapacity, int code, const char* status, const char* contentType,  const char* extraHeaders, size_t contentLength) {
+static int snprintfResponseHeader(char* destination, size_t destinationCapacity, int code, const char* status, const char* contentType,  const char* extraHeaders, size_t contentLength, const char* etagOrNULL) {
     if (NULL == extraHeaders) {
         extraHeaders = "";
     }
+    char etagHeader[64] = "";
+    if (NULL != etagOrNULL) {
+        snprintf(etagHeader, sizeof(etagHeader), "ETag: \"%s\"\r\n", etagOrNULL);
+    }
+    if (RESPONSE_CONTENT_LENGTH_UNKNOWN == contentLength) {
+        /* the client figures out the length when we close the connection */
+        return snprintf(destination,
+            destinationCapacity,
+            "HTTP/1.1 %d %s\r\n"
+            "Content-Type: %s\r\n"
+            "Connection: close\r\n"
+            "Server: Embeddable Web Server/" EMBEDDABLE_WEB_SERVER_VERSION_STRING "\r\n"
+            "%s"
+            "\r\n",
+            code,
+            status,
+            contentType,
+            extraHeaders);
+    }
     return snprintf(destination,
         destinationCapacity,
         "HTTP/1.1 %d %s\r\n"
@@ -1937,11 +6029,13 @@ static int snprintfResponseHeader(char* destination, size_t destinationCapacity,
         "Content-Length: %" PRIu64 "\r\n"
         "Server: Embeddable Web Server/" EMBEDDABLE_WEB_SERVER_VERSION_STRING "\r\n"
         "%s"
+        "%s"
         "\r\n",
         code,
         status,
         contentType,
         (uint64_t)contentLength,
+        etagHeader,
         extraHeaders);
 }
 
@@ -2023,29 +6117,746 @@ static void teststrdupEscape() {
     assert(0 == strcmpAndFreeFirstArg( strdupDecodeGETorPOSTParam("param=", "param=value%0a&next", NULL), "value\n"));
 }
 
-static void testPathEscapesRoot() {
-    assert(pathEscapesDocumentRoot("../"));
-    assert(pathEscapesDocumentRoot("/.."));
-    assert(pathEscapesDocumentRoot("/../"));
-    assert(pathEscapesDocumentRoot("/..//"));
-    assert(pathEscapesDocumentRoot("/..///"));
-    assert(pathEscapesDocumentRoot("./.."));
-    assert(pathEscapesDocumentRoot("./../"));
-    assert(pathEscapesDocumentRoot("./..//"));
-    assert(pathEscapesDocumentRoot("./..///"));
-    assert(pathEscapesDocumentRoot("./././../"));
-    assert(pathEscapesDocumentRoot("dir1/dir2/../../../"));
-    assert(!pathEscapesDocumentRoot("dir1"));
-    assert(!pathEscapesDocumentRoot("dir1/dir2"));
-    assert(!pathEscapesDocumentRoot("dir1/dir2/."));
-    assert(!pathEscapesDocumentRoot("dir1/dir2/../."));
-    assert(!pathEscapesDocumentRoot("dir1/dir2/.././"));
-    assert(!pathEscapesDocumentRoot("dir1/dir2/../.././"));
-    assert(!pathEscapesDocumentRoot("dir1/dir2/../../."));
-    assert(!pathEscapesDocumentRoot("."));
-    assert(pathEscapesDocumentRoot(".."));
-    assert(pathEscapesDocumentRoot("../.."));
-    assert(!pathEscapesDocumentRoot("test/.."));
+static void testPathEscapesRoot() {
+    assert(pathEscapesDocumentRoot("../"));
+    assert(pathEscapesDocumentRoot("/.."));
+    assert(pathEscapesDocumentRoot("/../"));
+    assert(pathEscapesDocumentRoot("/..//"));
+    assert(pathEscapesDocumentRoot("/..///"));
+    assert(pathEscapesDocumentRoot("./.."));
+    assert(pathEscapesDocumentRoot("./../"));
+    assert(pathEscapesDocumentRoot("./..//"));
+    assert(pathEscapesDocumentRoot("./..///"));
+    assert(pathEscapesDocumentRoot("./././../"));
+    assert(pathEscapesDocumentRoot("dir1/dir2/../../../"));
+    assert(!pathEscapesDocumentRoot("dir1"));
+    assert(!pathEscapesDocumentRoot("dir1/dir2"));
+    assert(!pathEscapesDocumentRoot("dir1/dir2/."));
+    assert(!pathEscapesDocumentRoot("dir1/dir2/../."));
+    assert(!pathEscapesDocumentRoot("dir1/dir2/.././"));
+    assert(!pathEscapesDocumentRoot("dir1/dir2/../.././"));
+    assert(!pathEscapesDocumentRoot("dir1/dir2/../../."));
+    assert(!pathEscapesDocumentRoot("."));
+    assert(pathEscapesDocumentRoot(".."));
+    assert(pathEscapesDocumentRoot("../.."));
+    assert(!pathEscapesDocumentRoot("test/.."));
+}
+
+static void testServerStore() {
+    struct Server testServer;
+    memset(&testServer, 0, sizeof(testServer));
+    serverInit(&testServer);
+    struct HeapString value;
+    heapStringInit(&value);
+    assert(!serverStoreGet(&testServer, "missing", &value));
+    assert(0 == serverStoreSet(&testServer, "key", "value", 5, 0));
+    assert(serverStoreGet(&testServer, "key", &value));
+    assert(0 == strcmp(value.contents, "value"));
+    assert(0 == serverStoreSet(&testServer, "key", "a\0b", 3, 0));
+    assert(serverStoreGet(&testServer, "key", &value));
+    assert(3 == value.length && 0 == memcmp(value.contents, "a\0b", 3));
+    assert(serverStoreDelete(&testServer, "key"));
+    assert(!serverStoreGet(&testServer, "key", &value));
+    assert(1 == serverStoreIncrement(&testServer, "hits", 1));
+    assert(11 == serverStoreIncrement(&testServer, "hits", 10));
+    /* fill the store way past its limit and make sure shards stay inside their share */
+    char bigValue[4096] = {0};
+    for (int i = 0; i < 4 * SERVER_STORE_MAX_MEMORY / (int) sizeof(bigValue); i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "big%d", i);
+        assert(0 == serverStoreSet(&testServer, key, bigValue, sizeof(bigValue), 0));
+    }
+    for (size_t i = 0; i < SERVER_STORE_SHARDS; i++) {
+        assert(testServer.store.shards[i].memoryUsed <= SERVER_STORE_MAX_MEMORY / SERVER_STORE_SHARDS);
+    }
+    heapStringFreeContents(&value);
+    serverDeInit(&testServer);
+}
+
+static void testRWLock() {
+    bool lockStatisticsWasOn = OptionLockStatistics;
+    OptionLockStatistics = true;
+    struct RWLock rwLock;
+    rwLockInit(&rwLock, "test");
+    assert(0 == rwLockReadLock(&rwLock));
+    assert(0 == rwLockReadLock(&rwLock));
+    assert(0 == rwLockUnlock(&rwLock));
+    assert(0 == rwLockUnlock(&rwLock));
+    assert(0 == rwLockWriteLock(&rwLock));
+    assert(0 != rwLock.statistics.lockedAtNanoseconds);
+    assert(0 == rwLockUnlock(&rwLock));
+    assert(3 == rwLock.statistics.acquisitions);
+    /* the readers don't water down the average hold time */
+    assert(1 == rwLock.statistics.exclusiveAcquisitions);
+    assert(0 == rwLock.statistics.contendedAcquisitions);
+    assert(0 == rwLock.statistics.lockedAtNanoseconds);
+    rwLockDestroy(&rwLock);
+    OptionLockStatistics = lockStatisticsWasOn;
+}
+
+static void testSegmentRelease(void* releaseContext) {
+    (*(int*) releaseContext)++;
+}
+
+static void testResponseSegments() {
+    int releaseCount = 0;
+    struct Response* response = responseAllocHTMLNoCopy("<html>");
+    heapStringAppendString(&response->body, "<body>");
+    responseAppendSegment(response, "hello ", 6, NULL, NULL);
+    for (int i = 0; i < 20; i++) {
+        responseAppendSegment(response, "x", 1, testSegmentRelease, &releaseCount);
+    }
+    assert(22 == response->segmentsCount);
+#if !defined(WIN32) && !defined(EWS_FUZZ_TEST)
+    /* the body goes first, then the segments in order */
+    int sockets[2];
+    assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+    struct Connection* connection = connectionAlloc(NULL);
+    connection->socketfd = sockets[0];
+    ssize_t bytesSent = 0;
+    assert(0 == sendResponse(connection, response, &bytesSent));
+    char received[1024];
+    ssize_t receivedLength = recv(sockets[1], received, sizeof(received) - 1, 0);
+    assert(receivedLength == bytesSent);
+    received[receivedLength] = '\0';
+    assert(NULL != strstr(received, "Content-Length: 38\r\n"));
+    assert(NULL != strstr(received, "\r\n\r\n<body><html>hello xxxxxxxxxxxxxxxxxxxx"));
+    close(sockets[0]);
+    close(sockets[1]);
+    connectionFree(connection);
+#endif
+    responseFree(response);
+    assert(20 == releaseCount);
+}
+
+#if !defined(WIN32) && !defined(EWS_FUZZ_TEST)
+static void testFileDescriptorResponses() {
+    int sockets[2];
+    assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+    struct Connection* connection = connectionAlloc(NULL);
+    connection->socketfd = sockets[0];
+    char received[1024];
+    /* a pipe with an unknown length: no Content-Length, spliced */
+    int pipefds[2];
+    assert(0 == pipe(pipefds));
+    assert(5 == write(pipefds[1], "hello", 5));
+    close(pipefds[1]);
+    struct Response* response = responseAllocWithFileDescriptor(pipefds[0], -1, "text/plain", true);
+    ssize_t bytesSent = 0;
+    assert(0 == sendResponse(connection, response, &bytesSent));
+    responseFree(response);
+    ssize_t receivedLength = recv(sockets[1], received, sizeof(received) - 1, 0);
+    assert(receivedLength == bytesSent);
+    received[receivedLength] = '\0';
+    assert(NULL == strstr(received, "Content-Length"));
+    assert(NULL != strstr(received, "Connection: close\r\n"));
+    assert(strEndsWith(received, "\r\n\r\nhello"));
+    /* a regular file: the length comes from where we are in the file */
+    FILE* fp = tmpfile();
+    assert(NULL != fp);
+    fputs("0123456789send this!", fp);
+    fflush(fp);
+    int fd = fileno(fp);
+    lseek(fd, 10, SEEK_SET);
+    response = responseAllocWithFileDescriptor(fd, -1, "text/plain", false);
+    bytesSent = 0;
+    assert(0 == sendResponse(connection, response, &bytesSent));
+    responseFree(response);
+    fclose(fp);
+    receivedLength = recv(sockets[1], received, sizeof(received) - 1, 0);
+    assert(receivedLength == bytesSent);
+    received[receivedLength] = '\0';
+    assert(NULL != strstr(received, "Content-Length: 10\r\n"));
+    assert(strEndsWith(received, "\r\n\r\nsend this!"));
+    /* a 304 keeps the caching headers */
+    response = responseAllocJSON("{}");
+    response->extraHeaders = strdup("Cache-Control: max-age=60\r\nVary: Accept-Encoding\r\n");
+    char etag[24];
+    assert(responseETagCreate(response, etag, sizeof(etag)));
+    char requestText[256];
+    snprintf(requestText, sizeof(requestText), "GET / HTTP/1.1\r\nIf-None-Match: \"%s\"\r\n\r\n", etag);
+    requestParse(&connection->request, requestText, strlen(requestText));
+    bool etagsWereOn = OptionETagsForGeneratedResponses;
+    OptionETagsForGeneratedResponses = true;
+    bytesSent = 0;
+    assert(0 == sendResponse(connection, response, &bytesSent));
+    OptionETagsForGeneratedResponses = etagsWereOn;
+    responseFree(response);
+    receivedLength = recv(sockets[1], received, sizeof(received) - 1, 0);
+    assert(receivedLength == bytesSent);
+    received[receivedLength] = '\0';
+    assert(received == strstr(received, "HTTP/1.1 304 Not Modified\r\n"));
+    assert(strEndsWith(received, "Cache-Control: max-age=60\r\nVary: Accept-Encoding\r\n\r\n"));
+    close(sockets[0]);
+    close(sockets[1]);
+    connectionFree(connection);
+}
+#endif
+
+static size_t testTarAppend(uint8_t* tar, size_t offset, const char* name, char type, const char* contents) {
+    uint8_t* header = tar + offset;
+    memset(header, 0, TAR_BLOCK_SIZE);
+    strncpy((char*) header, name, 100);
+    size_t length = strlen(contents);
+    snprintf((char*) header + 124, 12, "%011o", (unsigned int) length);
+    header[156] = (uint8_t) type;
+    memcpy(header + 257, "ustar\0" "00", 8);
+    memset(header + 148, ' ', 8);
+    size_t checksum = 0;
+    for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+        checksum += header[i];
+    }
+    snprintf((char*) header + 148, 8, "%06o", (unsigned int) checksum);
+    memcpy(header + TAR_BLOCK_SIZE, contents, length);
+    return offset + TAR_BLOCK_SIZE + (length + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+}
+
+static struct Response* testArchiveRequest(const struct ArchiveDocumentRoot* archive, const char* path, bool acceptsGzip) {
+    struct Request* request = (struct Request*) calloc(1, sizeof(*request));
+    const char* acceptEncoding = acceptsGzip ? "Accept-Encoding: gzip, deflate\r\n" : "";
+    char requestText[2048];
+    snprintf(requestText, sizeof(requestText), "GET %s HTTP/1.1\r\n%s\r\n", path, acceptEncoding);
+    requestParse(request, requestText, strlen(requestText));
+    struct Response* response = responseAllocServeFileFromArchive("/", request, archive);
+    heapStringFreeContents(&request->body);
+    free(request);
+    return response;
+}
+
+static void testArchiveDocumentRoot() {
+    uint8_t* tar = (uint8_t*) calloc(1, 32 * TAR_BLOCK_SIZE);
+    size_t length = 0;
+    length = testTarAppend(tar, length, "./index.html", '0', "<html>home</html>");
+    length = testTarAppend(tar, length, "app.js", '0', "var a;");
+    length = testTarAppend(tar, length, "app.js.gz", '0', "not really gzip");
+    length = testTarAppend(tar, length, "docs/", '5', "");
+    length = testTarAppend(tar, length, "docs/index.html", '0', "docs");
+    length = testTarAppend(tar, length, "././@LongLink", 'L', "a/very/long/name/that/doesnt/fit/in/the/hundred/bytes/tar/gives/you/for/names/so/gnu/tar/makes/a/fake/entry.txt");
+    length = testTarAppend(tar, length, "a/very/long/name/that/doesnt", '0', "long");
+    length += 2 * TAR_BLOCK_SIZE;
+    struct ArchiveDocumentRoot* archive = archiveDocumentRootOpenFromMemory(tar, length);
+    assert(NULL != archive);
+    assert(5 == archive->entriesCount);
+    struct Response* response = testArchiveRequest(archive, "/", false);
+    assert(200 == response->code && 1 == response->segmentsCount);
+    assert(0 == memcmp(response->segments[0].data, "<html>home</html>", response->segments[0].length));
+    assert(0 == strcmp(response->contentType, "text/html; charset=UTF-8"));
+    responseFree(response);
+    response = testArchiveRequest(archive, "/docs", false);
+    assert(200 == response->code && 4 == response->segments[0].length);
+    responseFree(response);
+    response = testArchiveRequest(archive, "/app.js", false);
+    assert(NULL == response->extraHeaders && 6 == response->segments[0].length);
+    responseFree(response);
+    response = testArchiveRequest(archive, "/app.js", true);
+    assert(NULL != strstr(response->extraHeaders, "Content-Encoding: gzip"));
+    assert(0 == strcmp(response->contentType, "application/javascript"));
+    assert(15 == response->segments[0].length);
+    responseFree(response);
+    response = testArchiveRequest(archive, "/a/very/long/name/that/doesnt/fit/in/the/hundred/bytes/tar/gives/you/for/names/so/gnu/tar/makes/a/fake/entry.txt", false);
+    assert(200 == response->code && 4 == response->segments[0].length);
+    responseFree(response);
+    response = testArchiveRequest(archive, "/missing", false);
+    assert(404 == response->code);
+    responseFree(response);
+    /* the longest directory paths must not overflow the name when index.html and .gz are added */
+    char longPath[1021];
+    memset(longPath, 'd', sizeof(longPath) - 2);
+    longPath[0] = '/';
+    longPath[sizeof(longPath) - 2] = '/';
+    longPath[sizeof(longPath) - 1] = '\0';
+    response = testArchiveRequest(archive, longPath, true);
+    assert(404 == response->code);
+    responseFree(response);
+    longPath[sizeof(longPath) - 2] = 'd';
+    response = testArchiveRequest(archive, longPath, true);
+    assert(404 == response->code);
+    responseFree(response);
+    archiveDocumentRootClose(archive);
+    /* a header that claims more data than there is */
+    assert(NULL == archiveDocumentRootOpenFromMemory(tar, TAR_BLOCK_SIZE + 10));
+    /* a header with a bad checksum */
+    tar[0] = 'X';
+    assert(NULL == archiveDocumentRootOpenFromMemory(tar, length));
+    tar[0] = '.';
+    /* older tars pad numbers with leading spaces instead of zeros */
+    assert(6 == tarOctal((const uint8_t*) "     6 ", 7));
+    assert(6 == tarOctal((const uint8_t*) "\0\0 006", 6));
+    free(tar);
+}
+
+static void testBandwidthLimiter() {
+    struct BandwidthLimiter limiter;
+    /* 1MB/s with the smallest burst: the first chunk is free, the next 3 take ~16ms each */
+    bandwidthLimiterInit(&limiter, 1000 * 1000, 0);
+    assert(BANDWIDTH_LIMITED_CHUNK_SIZE == limiter.burstBytes);
+    int64_t start = monotonicNanoseconds();
+    for (int i = 0; i < 4; i++) {
+        bandwidthLimiterAcquire(&limiter, BANDWIDTH_LIMITED_CHUNK_SIZE);
+    }
+    int64_t elapsed = monotonicNanoseconds() - start;
+    assert(elapsed >= 3 * (int64_t) BANDWIDTH_LIMITED_CHUNK_SIZE * 1000 - 1000000);
+    assert(limiter.nowServing == 4 && limiter.nextTicket == 4);
+    /* a long idle at a high rate fills the bucket without overflowing */
+    bandwidthLimiterSetRate(&limiter, 1000 * 1000 * 1000, 0);
+    limiter.tokens = 0;
+    limiter.lastRefillNanoseconds = monotonicNanoseconds() - (int64_t) 100 * 365 * 24 * 3600 * 1000000000;
+    bandwidthLimiterAcquire(&limiter, BANDWIDTH_LIMITED_CHUNK_SIZE);
+    assert(0 == limiter.tokens);
+    /* unlimited doesn't wait or take a ticket */
+    bandwidthLimiterSetRate(&limiter, 0, 0);
+    bandwidthLimiterAcquire(&limiter, 1024 * 1024 * 1024);
+    assert(limiter.nextTicket == 5);
+    bandwidthLimiterDestroy(&limiter);
+}
+
+static void testConnectionPriority() {
+    struct Server testServer;
+    memset(&testServer, 0, sizeof(testServer));
+    serverInit(&testServer);
+    assert(0 == serverSetPathPriority(&testServer, "/status", ConnectionPriorityControl));
+    assert(0 == serverSetPathPriority(&testServer, "/files", ConnectionPriorityBulk));
+    assert(0 == serverSetPathPriority(&testServer, "/files/small", ConnectionPriorityNormal));
+    struct Request* request = (struct Request*) calloc(1, sizeof(*request));
+    const char* requests[] = {
+        "GET /status HTTP/1.1\r\n\r\n",
+        "GET /files/big.iso HTTP/1.1\r\nPriority: u=0\r\n\r\n",
+        "GET /files/small/a.txt HTTP/1.1\r\n\r\n",
+        "GET /other HTTP/1.1\r\nPriority: u=1, i\r\n\r\n",
+        "GET /other HTTP/1.1\r\nPriority: u=6\r\n\r\n",
+        "GET /other HTTP/1.1\r\n\r\n"
+    };
+    /* a client can't make itself Control with u=0-2 */
+    const ConnectionPriority expected[] = {ConnectionPriorityControl, ConnectionPriorityBulk, ConnectionPriorityNormal, ConnectionPriorityNormal, ConnectionPriorityBulk, ConnectionPriorityNormal};
+    for (size_t i = 0; i < sizeof(requests) / sizeof(requests[0]); i++) {
+        memset(request, 0, sizeof(*request));
+        requestParse(request, requests[i], strlen(requests[i]));
+        assert(expected[i] == connectionPriorityForRequest(&testServer, request));
+    }
+    free(request);
+    serverDeInit(&testServer);
+}
+
+static void testETags() {
+    /* reference values from the xxHash project */
+    struct XXH64State state;
+    xxh64Init(&state, 0);
+    assert(0xEF46DB3751D8E999ULL == xxh64Digest(&state));
+    xxh64Update(&state, "abc", 3);
+    assert(0x44BC2CF5AD770999ULL == xxh64Digest(&state));
+    /* feeding it in pieces has to be the same as all at once */
+    const char* longString = "The quick brown fox jumps over the lazy dog and keeps on running for a while";
+    xxh64Init(&state, 0);
+    xxh64Update(&state, longString, strlen(longString));
+    uint64_t allAtOnce = xxh64Digest(&state);
+    xxh64Init(&state, 0);
+    for (size_t i = 0; i < strlen(longString); i += 5) {
+        xxh64Update(&state, longString + i, MIN((size_t) 5, strlen(longString) - i));
+    }
+    assert(allAtOnce == xxh64Digest(&state));
+    /* a body and the same bytes split up into segments get the same ETag */
+    char etag1[24];
+    char etag2[24];
+    struct Response* response1 = responseAllocJSON("{\"a\" : 1}");
+    struct Response* response2 = responseAllocJSONNoCopy("{\"a\" ");
+    responseAppendSegment(response2, ": 1}", 4, NULL, NULL);
+    assert(responseETagCreate(response1, etag1, sizeof(etag1)));
+    assert(responseETagCreate(response2, etag2, sizeof(etag2)));
+    assert(0 == strcmp(etag1, etag2));
+    responseFree(response1);
+    responseFree(response2);
+    struct Response* notFound = responseAlloc404NotFoundHTML("/x");
+    assert(!responseETagCreate(notFound, etag1, sizeof(etag1)));
+    responseFree(notFound);
+    struct Request* request = (struct Request*) calloc(1, sizeof(*request));
+    char requestText[256];
+    snprintf(requestText, sizeof(requestText), "GET / HTTP/1.1\r\nIf-None-Match: W/\"nope\", \"%s\"\r\n\r\n", etag2);
+    requestParse(request, requestText, strlen(requestText));
+    assert(requestIfNoneMatchMatches(request, etag2));
+    assert(!requestIfNoneMatchMatches(request, "nope1"));
+    free(request);
+}
+
+static void testBatchedSubRequests() {
+    struct HeapString json;
+    heapStringInit(&json);
+    heapStringAppendJSONString(&json, "a\"b\\c\n\x01", 7);
+    assert(0 == strcmp(json.contents, "\"a\\\"b\\\\c\\n\\u0001\""));
+    heapStringFreeContents(&json);
+    /* sub-requests get the batch's headers, minus the ones about its body */
+    struct Connection* parent = connectionAlloc(NULL);
+    const char* requestText = "POST /batch HTTP/1.1\r\nCookie: session=1\r\nContent-Length: 4\r\n\r\n/a\n";
+    requestParse(&parent->request, requestText, strlen(requestText));
+    struct Connection* subConnection = batchedSubRequestConnectionAlloc(parent, &parent->request, "/a?x=1", 6);
+    assert(RequestParseStateDone == subConnection->request.state);
+    assert(0 == strcmp(subConnection->request.method, "GET"));
+    assert(0 == strcmp(subConnection->request.path, "/a?x=1"));
+    assert(NULL != headerInRequest("Cookie", &subConnection->request));
+    assert(NULL == headerInRequest("Content-Length", &subConnection->request));
+    assert(parent == subConnection->batchParent);
+    /* only opted in routes run on their own threads */
+    struct Server testServer;
+    memset(&testServer, 0, sizeof(testServer));
+    serverInit(&testServer);
+    struct Connection* optedInConnection = batchedSubRequestConnectionAlloc(parent, &parent->request, "/a/b", 4);
+    assert(!batchedSubRequestMayRunInParallel(&testServer, &optedInConnection->request));
+    assert(0 == serverSetPathParallelBatching(&testServer, "/b"));
+    assert(!batchedSubRequestMayRunInParallel(&testServer, &optedInConnection->request));
+    assert(0 == serverSetPathParallelBatching(&testServer, "/a"));
+    assert(batchedSubRequestMayRunInParallel(&testServer, &optedInConnection->request));
+    assert(!batchedSubRequestMayRunInParallel(NULL, &optedInConnection->request));
+    serverDeInit(&testServer);
+    connectionFree(optedInConnection);
+    connectionFree(subConnection);
+    connectionFree(parent);
+    /* JSON bodies are embedded, everything else is a string */
+    heapStringInit(&json);
+    struct Response* jsonResponse = responseAllocJSONNoCopy("{\"a\":");
+    responseAppendSegment(jsonResponse, "1}", 2, NULL, NULL);
+    batchedSubResponseAppendJSON(&json, "/a", 2, jsonResponse);
+    assert(0 == strcmp(json.contents, "{\"path\":\"/a\",\"status\":200,\"contentType\":\"application/json\",\"body\":{\"a\":1}}"));
+    responseFree(jsonResponse);
+    heapStringSetToCString(&json, "");
+    struct Response* htmlResponse = responseAllocHTML("<b>\"hi\"</b>");
+    batchedSubResponseAppendJSON(&json, "/b", 2, htmlResponse);
+    assert(NULL != strstr(json.contents, "\"body\":\"<b>\\\"hi\\\"</b>\"}"));
+    responseFree(htmlResponse);
+    heapStringFreeContents(&json);
+}
+
+static void testHeavyHitters() {
+    struct HeavyHitters* heavyHitters = (struct HeavyHitters*) calloc(1, sizeof(*heavyHitters));
+    heavyHittersInit(heavyHitters);
+    /* one busy client in front of many quiet ones */
+    char key[32];
+    for (int i = 0; i < 2000; i++) {
+        snprintf(key, sizeof(key), "10.0.%d.%d", i / 250, i % 250);
+        heavyHittersRecord(heavyHitters, key, strlen(key));
+        heavyHittersRecord(heavyHitters, "10.9.9.9", strlen("10.9.9.9"));
+    }
+    heavyHittersRecord(heavyHitters, "10.9.9.9?ignored", strlen("10.9.9.9"));
+    assert(4001 == heavyHitters->total);
+    assert(HEAVY_HITTERS_TOP_K == heavyHitters->topCount);
+    bool foundBusyClient = false;
+    for (size_t i = 0; i < heavyHitters->topCount; i++) {
+        if (0 == strcmp(heavyHitters->top[i].key, "10.9.9.9")) {
+            foundBusyClient = true;
+            /* count-min sketches never under count */
+            assert(heavyHitters->top[i].estimate >= 2001);
+        }
+        /* the heap property holds */
+        if (i > 0) {
+            assert(heavyHitters->top[(i - 1) / 2].estimate <= heavyHitters->top[i].estimate);
+        }
+    }
+    assert(foundBusyClient);
+    heavyHittersHalve(heavyHitters);
+    for (size_t i = 0; i < heavyHitters->topCount; i++) {
+        if (0 == strcmp(heavyHitters->top[i].key, "10.9.9.9")) {
+            assert(heavyHitters->top[i].estimate >= 1000);
+        }
+    }
+    heavyHittersDestroy(heavyHitters);
+    free(heavyHitters);
+}
+
+static void testTCPInfoHistograms() {
+    struct TCPInfoStatistics* statistics = (struct TCPInfoStatistics*) calloc(1, sizeof(*statistics));
+    tcpInfoStatisticsInit(statistics);
+    assert(0 == log2HistogramBucket(0));
+    assert(1 == log2HistogramBucket(1));
+    assert(2 == log2HistogramBucket(3));
+    assert(3 == log2HistogramBucket(4));
+    assert(TCP_INFO_HISTOGRAM_BUCKETS - 1 == log2HistogramBucket(INT64_MAX));
+    struct TCPInfoSample sample = { 0, 0, 0, 10, -1 };
+    for (int i = 0; i < 100; i++) {
+        /* 90 fast samples and 10 slow ones */
+        sample.rttMicroseconds = i < 90 ? 1000 : 100000;
+        tcpInfoStatisticsRecord(statistics, i % 2 ? "api" : NULL, &sample);
+    }
+    assert(100 == statistics->server.samples);
+    assert(1 == statistics->routesCount && 50 == statistics->routes[0].samples);
+    assert(1023 == log2HistogramPercentile(statistics->server.rttMicroseconds, 100, 50));
+    assert(1023 == log2HistogramPercentile(statistics->server.rttMicroseconds, 100, 90));
+    assert(131071 == log2HistogramPercentile(statistics->server.rttMicroseconds, 100, 99));
+    assert(-1 == log2HistogramPercentile(statistics->server.deliveryRateBytesPerSecond, 100, 50));
+    pthread_mutex_destroy(&statistics->lock);
+    free(statistics);
+}
+
+static void testTrace() {
+    struct Server* server = (struct Server*) calloc(1, sizeof(*server));
+    serverInit(server);
+    server->traceSampleEvery = 1;
+    struct Connection* connection = connectionAlloc(server);
+    const char* requestText = "GET /traced HTTP/1.1\r\n\r\n";
+    requestParse(&connection->request, requestText, strlen(requestText));
+    connectionTraceStart(connection);
+    for (int point = ConnectionTraceFirstByteReceived; point < ConnectionTracePointsCount; point++) {
+        connectionTraceMark(connection, (ConnectionTracePoint) point);
+    }
+    connection->trace.responseCode = 200;
+    connectionTraceFinish(connection);
+    /* a slot that's being written must be skipped */
+    server->traceRing->slots[1].sequence = 3;
+    struct HeapString json = serverTraceChromeJSONCreate(server);
+    assert(NULL != strstr(json.contents, "\"GET /traced\""));
+    assert(NULL != strstr(json.contents, "\"handler\""));
+    assert(NULL != strstr(json.contents, "\"status\":200"));
+    heapStringFreeContents(&json);
+    /* with sampling off only slow requests are kept */
+    server->traceSampleEvery = 0;
+    server->traceSlowRequestMilliseconds = 60 * 1000;
+    connectionTraceFinish(connection);
+    assert(1 == server->traceRing->nextSlot);
+    connectionFree(connection);
+    serverDeInit(server);
+    free(server);
+}
+
+static void testSlowRequestLog() {
+    struct Server* server = (struct Server*) calloc(1, sizeof(*server));
+    serverInit(server);
+    FILE* logFile = tmpfile();
+    server->slowRequestLogFile = logFile;
+    server->slowRequestLogMilliseconds = 5;
+    struct Connection* connection = connectionAlloc(server);
+    const char* requestText = "GET /slow HTTP/1.1\r\nHost: example.com\r\n\r\n";
+    requestParse(&connection->request, requestText, strlen(requestText));
+    connection->request.warnings.pathTruncated = true;
+    strcpy(connection->remoteHost, "192.0.2.1");
+    strcpy(connection->remotePort, "5555");
+    connectionTraceStart(connection);
+    assert(connection->trace.enabled);
+    /* a fast request isn't logged, and the logger thread isn't started until something is */
+    connectionTraceFinish(connection);
+    assert(0 == server->slowRequestLog->count);
+    assert(!server->slowRequestLog->threadStarted);
+    connection->trace.acceptNanoseconds -= 10 * 1000000;
+    connection->trace.responseCode = 200;
+    connection->status.bytesSent = 1234;
+    connectionTraceFinish(connection);
+    connectionFree(connection);
+    /* stopping writes out what's queued */
+    serverDeInit(server);
+    free(server);
+    char logged[512] = {0};
+    rewind(logFile);
+    size_t loggedLength = fread(logged, 1, sizeof(logged) - 1, logFile);
+    fclose(logFile);
+    assert(loggedLength > 0);
+    assert(NULL != strstr(logged, "Slow request: "));
+    assert(NULL != strstr(logged, "GET /slow from 192.0.2.1:5555 -> 200"));
+    assert(NULL != strstr(logged, "sent 1234 bytes"));
+    assert(NULL != strstr(logged, "1 headers"));
+    assert(NULL != strstr(logged, "Warnings: pathTruncated"));
+    /* stages that weren't reached show up as - */
+    struct SlowRequestRecord record;
+    memset(&record, 0, sizeof(record));
+    record.ticks[ConnectionTraceHandlerStart] = 1000;
+    record.ticks[ConnectionTraceHandlerEnd] = 2001000;
+    struct HeapString line;
+    heapStringInit(&line);
+    slowRequestRecordFormat(&line, &record, 1.0);
+    assert(NULL != strstr(line.contents, " handler 2.0ms"));
+    assert(NULL != strstr(line.contents, " send -"));
+    heapStringFreeContents(&line);
+}
+
+static void testConnectionRegistry() {
+    struct Server* server = (struct Server*) calloc(1, sizeof(*server));
+    serverInit(server);
+    struct Connection* connection = connectionAlloc(server);
+    strcpy(connection->remoteHost, "192.0.2.1");
+    strcpy(connection->remotePort, "5555");
+    connectionRegistryAdd(connection);
+    assert(connection->registrySlot >= 0);
+    struct HeapString json = serverConnectionsJSONCreate(server);
+    assert(NULL != strstr(json.contents, "\"remote_host\":\"192.0.2.1\""));
+    assert(NULL != strstr(json.contents, "\"state\":\"reading headers\""));
+    heapStringFreeContents(&json);
+    const char* requestText = "POST /upload<> HTTP/1.1\r\nContent-Length: 10\r\n\r\n";
+    requestParse(&connection->request, requestText, strlen(requestText));
+    connection->status.bytesReceived = (int64_t) strlen(requestText);
+    connectionRegistryUpdate(connection, ConnectionStateInHandler);
+    connectionRegistryBytesSent(connection, 42);
+    /* a slot that's being written is skipped */
+    struct Connection* busyConnection = connectionAlloc(server);
+    connectionRegistryAdd(busyConnection);
+    server->connectionRegistry->slots[busyConnection->registrySlot].sequence++;
+    json = serverConnectionsJSONCreate(server);
+    assert(NULL != strstr(json.contents, "\"state\":\"in handler\""));
+    assert(NULL != strstr(json.contents, "\"path\":\"/upload<>\""));
+    assert(NULL != strstr(json.contents, "\"bytes_sent\":42"));
+    assert(NULL == strstr(json.contents, "},\n{"));
+    heapStringFreeContents(&json);
+    struct HeapString html = serverConnectionsHTMLCreate(server);
+    assert(NULL != strstr(html.contents, "/upload&lt;&gt;"));
+    heapStringFreeContents(&html);
+    connectionRegistryRemove(connection);
+    connectionRegistryRemove(busyConnection);
+    json = serverConnectionsJSONCreate(server);
+    assert(NULL != strstr(json.contents, "\"connections\":[\n]"));
+    heapStringFreeContents(&json);
+    connectionFree(connection);
+    connectionFree(busyConnection);
+    serverDeInit(server);
+    free(server);
+}
+
+static void testStatsSegment() {
+    struct Server* server = (struct Server*) calloc(1, sizeof(*server));
+    serverInit(server);
+    struct Connection* connection = connectionAlloc(server);
+    strcpy(connection->remoteHost, "192.0.2.1");
+    connectionRegistryAdd(connection);
+    const char* requestText = "GET /stuck HTTP/1.1\r\n\r\n";
+    requestParse(&connection->request, requestText, strlen(requestText));
+    connectionRegistryUpdate(connection, ConnectionStateInHandler);
+    struct StatsSegment* staging = (struct StatsSegment*) calloc(1, sizeof(*staging));
+    struct StatsSegment* segment = (struct StatsSegment*) calloc(1, sizeof(*segment));
+    struct ConnectionRegistrySlot* connections = (struct ConnectionRegistrySlot*) malloc(sizeof(struct ConnectionRegistrySlot) * SERVER_CONNECTION_REGISTRY_SLOTS);
+    staging->publisherProcessID = 1234;
+    statsSegmentFill(server, staging, connections);
+    statsSegmentPublish(segment, staging);
+    assert(2 == segment->sequence);
+    assert(1234 == segment->publisherProcessID);
+    assert(1 == segment->publishes);
+    assert(1 == segment->connectionsCount);
+    assert(1 == segment->connectionsByState[ConnectionStateInHandler]);
+    assert(ConnectionStateInHandler == segment->connections[0].state);
+    assert(0 == strcmp(segment->connections[0].path, "/stuck"));
+    assert(0 == strcmp(segment->connections[0].remoteHost, "192.0.2.1"));
+    connectionRegistryRemove(connection);
+    statsSegmentFill(server, staging, connections);
+    statsSegmentPublish(segment, staging);
+    assert(4 == segment->sequence);
+    assert(0 == segment->connectionsCount);
+    assert(0 == segment->connectionsByState[ConnectionStateInHandler]);
+    free(connections);
+    free(segment);
+    free(staging);
+    connectionFree(connection);
+    serverDeInit(server);
+    free(server);
+#if !defined(WIN32) && !defined(EWS_FUZZ_TEST)
+    /* only we can read it, and a live owner keeps the name */
+    char name[64];
+    snprintf(name, sizeof(name), "/ews-test-%" PRId64, processID());
+    const size_t processIDOffset = offsetof(struct StatsSegment, publisherProcessID);
+    struct StatsSegment* owned = (struct StatsSegment*) sharedMemoryCreate(name, sizeof(struct StatsSegment), processIDOffset);
+    assert(NULL != owned);
+    owned->publisherProcessID = processID();
+    int fd = shm_open(name, O_RDONLY, 0);
+    struct stat st;
+    assert(fd >= 0 && 0 == fstat(fd, &st));
+    close(fd);
+    assert(0600 == (st.st_mode & 0777));
+    assert(NULL == sharedMemoryCreate(name, sizeof(struct StatsSegment), processIDOffset));
+    sharedMemoryDestroy(name, owned, sizeof(struct StatsSegment));
+#endif
+}
+
+#ifdef EWS_PROFILER_SUPPORTED
+static void testProfilerFrameNames() {
+    struct HeapString stack;
+    heapStringInit(&stack);
+    profilerFrameNameAppend(&stack, "./EWSDemo(createResponseForRequest+0x1a) [0x55d4c1a0b1a2]");
+    assert(0 == strcmp(stack.contents, "createResponseForRequest"));
+    heapStringSetToCString(&stack, "");
+    profilerFrameNameAppend(&stack, "/usr/bin/EWSDemo(+0x1234) [0x55d4c1a0b1a2]");
+    assert(0 == strcmp(stack.contents, "[EWSDemo+0x1234]"));
+    heapStringSetToCString(&stack, "");
+    profilerFrameNameAppend(&stack, "3   EWSDemo                             0x0000000100003f2a main + 42");
+    assert(0 == strcmp(stack.contents, "main"));
+    heapStringFreeContents(&stack);
+}
+#endif
+
+static void testAllocationProfile() {
+    allocationProfileInit();
+    OptionAllocationProfile = true;
+    struct Connection* connection = connectionAlloc(NULL);
+    connectionSetRouteTag(connection, "allocation test");
+    int tagIndex = allocationProfileThreadTagIndex;
+    assert(tagIndex > 1);
+    const struct AllocationTagStatistics* statistics = &allocationProfile.tags[tagIndex - 1];
+    /* the connection moved over from untagged when it got its tag */
+    assert((int64_t) sizeof(struct Connection) == statistics->liveBytes[AllocationKindConnection]);
+    struct Response* response = responseAllocHTML("<html>charged to the test</html>");
+    assert((int64_t) sizeof(struct Response) == statistics->liveBytes[AllocationKindResponse]);
+    assert(statistics->liveBytes[AllocationKindHeapString] == (int64_t) response->body.capacity);
+    heapStringAppendString(&response->body, "this is going to grow the body a little bit so it gets reallocated. It needs to be longer than the rest");
+    assert(statistics->liveBytes[AllocationKindHeapString] == (int64_t) response->body.capacity);
+    int64_t highWaterMark = statistics->liveBytesTotal;
+    responseFree(response);
+    /* escaped strings are released to the caller so they don't stay live forever */
+    free(strdupEscapeForHTML("<b>tag</b>"));
+    free(strdupEscapeForURL("a b"));
+    connectionFree(connection);
+    assert(0 == statistics->liveBytesTotal);
+    assert(highWaterMark == statistics->liveBytesHighWaterMark);
+    assert(1 == statistics->allocations[AllocationKindResponse]);
+    /* the same tag from a different pointer ends up in the same place */
+    char tagCopy[32];
+    strcpy(tagCopy, "allocation test");
+    assert(tagIndex == allocationProfileTagIndexFind(tagCopy));
+    struct HeapString report = allocationProfileStringCreate(10);
+    assert(NULL != strstr(report.contents, "allocation test"));
+    heapStringFreeContents(&report);
+    allocationProfileThreadTagIndex = 0;
+    OptionAllocationProfile = false;
+    /* don't leave the test's tag in the demo's report */
+    memset(allocationProfile.tags, 0, sizeof(allocationProfile.tags));
+    allocationProfile.tagsCount = 1;
+}
+
+static void testStaticResponses() {
+    struct Server testServer;
+    memset(&testServer, 0, sizeof(testServer));
+    serverInit(&testServer);
+    struct Response* notFound = responseShared404NotFound();
+    assert(notFound->isStatic);
+    assert(notFound == responseShared404NotFound() && "The server's own 404 should be shared");
+    assert(notFound->serialized == strstr(notFound->serialized, "HTTP/1.1 404 Not Found\r\n"));
+    const char* body = strstr(notFound->serialized, "\r\n\r\n") + 4;
+    char contentLength[64];
+    snprintf(contentLength, sizeof(contentLength), "Content-Length: %" PRIu64 "\r\n", (uint64_t) strlen(body));
+    assert(NULL != strstr(notFound->serialized, contentLength));
+    /* freeing a static response does nothing */
+    responseFree(notFound);
+    assert(404 == responseShared404NotFound()->code);
+    /* handlers get their own response they can add headers to */
+    struct Response* handlerNotFound = responseAlloc404NotFoundHTML(NULL);
+    assert(!handlerNotFound->isStatic && handlerNotFound != notFound);
+    responseFree(handlerNotFound);
+    struct Response* notFoundWithPath = responseAlloc404NotFoundHTML("/path");
+    assert(!notFoundWithPath->isStatic);
+    responseFree(notFoundWithPath);
+    serverDeInit(&testServer);
+}
+
+static void testMissingPathCache() {
+    struct Server testServer;
+    memset(&testServer, 0, sizeof(testServer));
+    serverInit(&testServer);
+    documentRootMissingPathsForget();
+    assert(!missingPathCacheContains(".", "missing.html"));
+    struct Response* response = responseAllocServeFileFromRequestPath("/", "/missing.html", "/missing.html", ".");
+    assert(404 == response->code);
+    responseFree(response);
+    assert(missingPathCacheContains(".", "missing.html"));
+    /* the path is compared, not just the hash */
+    assert(!missingPathCacheContains("./missing.html", ""));
+    assert(!missingPathCacheContains(".", "missing.htm"));
+    int64_t hitsBefore = counters.missingPathCacheHits;
+    response = responseAllocServeFileFromRequestPath("/", "/missing.html", "/missing.html", ".");
+    assert(404 == response->code);
+    responseFree(response);
+    assert(hitsBefore + (OptionIncludeStatusPageAndCounters ? 1 : 0) == counters.missingPathCacheHits);
+    documentRootMissingPathsForget();
+    assert(!missingPathCacheContains(".", "missing.html"));
+    serverDeInit(&testServer);
 }
 
 static void testPathMatching() {
@@ -2070,6 +6881,29 @@ void EWSUnitTestsRun() {
     teststrdupEscape();
     testPathEscapesRoot();
     testPathMatching();
+    testServerStore();
+    testRWLock();
+    testStaticResponses();
+    testMissingPathCache();
+    testResponseSegments();
+    testArchiveDocumentRoot();
+    testBandwidthLimiter();
+    testConnectionPriority();
+    testETags();
+    testBatchedSubRequests();
+    testHeavyHitters();
+    testTCPInfoHistograms();
+    testTrace();
+    testSlowRequestLog();
+    testConnectionRegistry();
+    testStatsSegment();
+#ifdef EWS_PROFILER_SUPPORTED
+    testProfilerFrameNames();
+#endif
+    testAllocationProfile();
+#if !defined(WIN32) && !defined(EWS_FUZZ_TEST)
+    testFileDescriptorResponses();
+#endif
     /* reset counters from tests */
     memset(&counters, 0, sizeof(counters));
 }
@@ -2167,6 +7001,7 @@ static int pathInformationGet(const char* path, struct PathInformation* info) {
     } else {
         info->isDirectory = false;
     }
+    info->isSymbolicLink = 0 != (attributes & FILE_ATTRIBUTE_REPARSE_POINT);
     return 0;
 }
 
@@ -2179,6 +7014,60 @@ static void ignoreSIGPIPE() {
     /* not needed on Windows */
 }
 
+struct HeapString profilerFoldedStacksCreate(int seconds, int samplesPerSecond) {
+    struct HeapString folded;
+    heapStringInit(&folded);
+    heapStringAppendString(&folded, "The profiler needs SIGPROF, which Windows doesn't have\n");
+    return folded;
+}
+
+static int threadPinToCPU(int cpu) {
+    if (cpu >= (int) (sizeof(DWORD_PTR) * 8)) {
+        ews_printf("Warning: Cannot pin thread to CPU %d because SetThreadAffinityMask only handles the first %d CPUs\n", cpu, (int) (sizeof(DWORD_PTR) * 8));
+        return 1;
+    }
+    if (0 == SetThreadAffinityMask(GetCurrentThread(), ((DWORD_PTR) 1) << cpu)) {
+        ews_printf("Warning: Could not pin thread to CPU %d. SetThreadAffinityMask failed with GetLastError() = %d\n", cpu, GetLastError());
+        return 1;
+    }
+    return 0;
+}
+
+static int socketIncomingCPU(sockettype socketfd) {
+    /* Windows has no SO_INCOMING_CPU */
+    return -1;
+}
+
+/* called on the connection's own thread */
+static void threadAndSocketSetPriority(sockettype socketfd, ConnectionPriority priority) {
+    int threadPriority = THREAD_PRIORITY_NORMAL;
+    if (ConnectionPriorityControl == priority) {
+        threadPriority = THREAD_PRIORITY_ABOVE_NORMAL;
+    } else if (ConnectionPriorityBulk == priority) {
+        threadPriority = THREAD_PRIORITY_BELOW_NORMAL;
+    }
+    SetThreadPriority(GetCurrentThread(), threadPriority);
+}
+
+static int socketTCPInfoGet(sockettype socketfd, struct TCPInfoSample* sample) {
+    /* SIO_TCP_INFO needs Windows 10 1703+ so we don't bother */
+    return 1;
+}
+
+static bool socketPeerClosed(sockettype socketfd) {
+    /* Windows fd_sets are arrays of sockets so there's no FD_SETSIZE trouble with select here */
+    fd_set readSet;
+    FD_ZERO(&readSet);
+    FD_SET(socketfd, &readSet);
+    struct timeval noWait = { 0, 0 };
+    if (select(0, &readSet, NULL, NULL, &noWait) <= 0) {
+        return false;
+    }
+    /* readable: either there's data (pipelined bytes), an orderly shutdown (0) or a reset (SOCKET_ERROR) */
+    char peekedByte;
+    return recv(socketfd, &peekedByte, 1, MSG_PEEK) <= 0;
+}
+
 static int strcasecmp(const char* str1, const char* str2) {
     /* lstrcmpI seems like the closest analog */
     return lstrcmpiA(str1, str2);
@@ -2210,6 +7099,17 @@ static int pthread_cond_signal(pthread_cond_t* cond) {
     return 0;
 }
 
+static int pthread_cond_broadcast(pthread_cond_t* cond) {
+    WakeAllConditionVariable(cond);
+    return 0;
+}
+
+static int pthread_join(pthread_t threadHandle, void** result) {
+    WaitForSingleObject(threadHandle, INFINITE);
+    CloseHandle(threadHandle);
+    return 0;
+}
+
 static int pthread_cond_destroy(pthread_cond_t* cond) {
     return 0;
 }
@@ -2234,6 +7134,71 @@ static int pthread_mutex_destroy(pthread_mutex_t* mutex) {
     return 0;
 }
 
+static int pthread_mutex_trylock(pthread_mutex_t* mutex) {
+    return TryEnterCriticalSection(mutex) ? 0 : EBUSY;
+}
+
+static int pthread_rwlock_init(pthread_rwlock_t* rwlock, const void* attributes) {
+    InitializeSRWLock(&rwlock->lock);
+    rwlock->exclusive = false;
+    return 0;
+}
+
+static int pthread_rwlock_rdlock(pthread_rwlock_t* rwlock) {
+    AcquireSRWLockShared(&rwlock->lock);
+    return 0;
+}
+
+static int pthread_rwlock_wrlock(pthread_rwlock_t* rwlock) {
+    AcquireSRWLockExclusive(&rwlock->lock);
+    rwlock->exclusive = true;
+    return 0;
+}
+
+static int pthread_rwlock_tryrdlock(pthread_rwlock_t* rwlock) {
+    return TryAcquireSRWLockShared(&rwlock->lock) ? 0 : EBUSY;
+}
+
+static int pthread_rwlock_trywrlock(pthread_rwlock_t* rwlock) {
+    if (!TryAcquireSRWLockExclusive(&rwlock->lock)) {
+        return EBUSY;
+    }
+    rwlock->exclusive = true;
+    return 0;
+}
+
+static int pthread_rwlock_unlock(pthread_rwlock_t* rwlock) {
+    /* only the exclusive owner could have set this, and readers can't hold the lock at the same time */
+    if (rwlock->exclusive) {
+        rwlock->exclusive = false;
+        ReleaseSRWLockExclusive(&rwlock->lock);
+    } else {
+        ReleaseSRWLockShared(&rwlock->lock);
+    }
+    return 0;
+}
+
+static int pthread_rwlock_destroy(pthread_rwlock_t* rwlock) {
+    /* SRWLOCKs don't need to be destroyed */
+    return 0;
+}
+
+static int64_t monotonicNanoseconds() {
+    static LARGE_INTEGER frequency;
+    if (0 == frequency.QuadPart) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    /* split up the multiply so we don't overflow after a few days of uptime */
+    return (counter.QuadPart / frequency.QuadPart) * 1000000000LL + ((counter.QuadPart % frequency.QuadPart) * 1000000000LL) / frequency.QuadPart;
+}
+
+static void sleepNanoseconds(int64_t nanoseconds) {
+    /* Sleep has millisecond resolution (at best) so round up */
+    Sleep((DWORD) ((nanoseconds + 999999) / 1000000));
+}
+
 static void callWSAStartupIfNecessary() {
     // nifty trick from http://stackoverflow.com/questions/1869689/is-it-possible-to-tell-if-wsastartup-has-been-called-in-a-process
     // try to create a socket, and if that fails because of uninitialized winsock, then initialize winsock
@@ -2259,6 +7224,75 @@ static FILE* fopen_utf8_path(const char* utf8Path, const char* mode) {
     return fp;
 }
 
+static int fileMapReadOnly(const char* path, void** mappingOut, size_t* lengthOut) {
+    wchar_t* widePath = strdupWideFromUTF8(path, 0);
+    HANDLE file = CreateFileW(widePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    free(widePath);
+    if (INVALID_HANDLE_VALUE == file) {
+        ews_printf("CreateFileW failed for '%s'. GetLastError() = %ld\n", path, GetLastError());
+        return 1;
+    }
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || 0 == fileSize.QuadPart) {
+        ews_printf("Could not get the size of '%s' or it's empty. GetLastError() = %ld\n", path, GetLastError());
+        CloseHandle(file);
+        return 1;
+    }
+    HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (NULL == mapping) {
+        ews_printf("CreateFileMappingW failed for '%s'. GetLastError() = %ld\n", path, GetLastError());
+        return 1;
+    }
+    /* the view keeps the mapping alive */
+    *mappingOut = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (NULL == *mappingOut) {
+        ews_printf("MapViewOfFile failed for '%s'. GetLastError() = %ld\n", path, GetLastError());
+        return 1;
+    }
+    *lengthOut = (size_t) fileSize.QuadPart;
+    return 0;
+}
+
+static void fileUnmap(void* mapping, size_t length) {
+    UnmapViewOfFile(mapping);
+}
+
+static void* sharedMemoryCreate(const char* name, size_t length, size_t processIDOffset) {
+    /* a named file mapping would do it but nobody has asked for it */
+    ews_printf("Shared memory stats aren't supported on Windows yet\n");
+    return NULL;
+}
+
+static void sharedMemoryDestroy(const char* name, void* mapping, size_t length) {
+}
+
+static int64_t processID() {
+    return (int64_t) GetCurrentProcessId();
+}
+
+/* There's no readahead hint for a whole file so just read it through the cache */
+static int64_t fileWarm(const char* path, int64_t maxFileSize) {
+    wchar_t* widePath = strdupWideFromUTF8(path, 0);
+    HANDLE file = CreateFileW(widePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    free(widePath);
+    if (INVALID_HANDLE_VALUE == file) {
+        return -1;
+    }
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart > maxFileSize) {
+        CloseHandle(file);
+        return 0;
+    }
+    char buffer[64 * 1024];
+    DWORD bytesRead = 0;
+    while (ReadFile(file, buffer, sizeof(buffer), &bytesRead, NULL) && bytesRead > 0) {
+    }
+    CloseHandle(file);
+    return fileSize.QuadPart;
+}
+
 #if UNDEFINE_CRT_SECURE_NO_WARNINGS
 #undef _CRT_SECURE_NO_WARNINGS
 #endif
@@ -2269,6 +7303,181 @@ static void callWSAStartupIfNecessary() {
 
 }
 
+#ifdef EWS_PROFILER_SUPPORTED
+/* The frames buffer is allocated the first time you profile and never freed, and the SIGPROF handler stays installed
+ once we install it. A SIGPROF that's still pending after we stop would otherwise kill the process (SIG_DFL) or
+ write into freed memory */
+static struct Profiler {
+    int64_t running;
+    int64_t collecting;
+    void** frames;
+    int* depths;
+    int64_t samplesCount;
+    bool handlerInstalled;
+} profiler;
+
+static void profilerSIGPROFHandler(int signal) {
+    if (0 == ews_atomic_add64(&profiler.collecting, 0)) {
+        return;
+    }
+    int savedErrno = errno;
+    int64_t sample = ews_atomic_add64(&profiler.samplesCount, 1);
+    if (sample < PROFILER_MAX_SAMPLES) {
+        profiler.depths[sample] = backtrace(&profiler.frames[sample * PROFILER_MAX_FRAMES], PROFILER_MAX_FRAMES);
+    }
+    errno = savedErrno;
+}
+
+/* glibc: "./EWSDemo(createResponseForRequest+0x1a) [0x55d4c1a0b1a2]" or "./EWSDemo(+0x1234) [0x...]" for static functions
+ Mac OS X: "3   EWSDemo   0x0000000100003f2a createResponseForRequest + 42" */
+static void profilerFrameNameAppend(struct HeapString* stack, const char* symbol) {
+    const char* nameStart = NULL;
+    size_t nameLength = 0;
+    const char* openParenthesis = strchr(symbol, '(');
+    if (NULL != openParenthesis) {
+        nameStart = openParenthesis + 1;
+        nameLength = strcspn(nameStart, "+)");
+        if (0 == nameLength) {
+            /* no symbol - module+offset is the best we can do. Link with -rdynamic to get names */
+            const char* moduleStart = strrchr(symbol, '/');
+            moduleStart = NULL != moduleStart && moduleStart < openParenthesis ? moduleStart + 1 : symbol;
+            heapStringAppendFormat(stack, "[%.*s%.*s]", (int) (openParenthesis - moduleStart), moduleStart, (int) strcspn(nameStart, ")"), nameStart);
+            return;
+        }
+    } else {
+        const char* address = strstr(symbol, " 0x");
+        if (NULL != address) {
+            nameStart = strchr(address + 1, ' ');
+            if (NULL != nameStart) {
+                nameStart++;
+                const char* plus = strstr(nameStart, " + ");
+                nameLength = NULL != plus ? (size_t) (plus - nameStart) : strlen(nameStart);
+            }
+        }
+    }
+    if (NULL == nameStart || 0 == nameLength) {
+        heapStringAppendString(stack, "[unknown]");
+        return;
+    }
+    /* ; separates frames in the folded format */
+    for (size_t i = 0; i < nameLength; i++) {
+        heapStringAppendChar(stack, ';' == nameStart[i] ? ':' : nameStart[i]);
+    }
+}
+
+static int profilerStringCompare(const void* a, const void* b) {
+    return strcmp(*(const char* const*) a, *(const char* const*) b);
+}
+
+struct HeapString profilerFoldedStacksCreate(int seconds, int samplesPerSecond) {
+    struct HeapString folded;
+    heapStringInit(&folded);
+    if (seconds <= 0 || samplesPerSecond <= 0 || samplesPerSecond > 1000) {
+        heapStringAppendString(&folded, "The profile needs a positive number of seconds and 1-1000 samples per second\n");
+        return folded;
+    }
+    if (!ews_atomic_cas64(&profiler.running, 0, 1)) {
+        heapStringAppendString(&folded, "Someone else is already profiling\n");
+        return folded;
+    }
+    if (NULL == profiler.frames) {
+        profiler.frames = (void**) calloc(PROFILER_MAX_SAMPLES * PROFILER_MAX_FRAMES, sizeof(void*));
+        profiler.depths = (int*) calloc(PROFILER_MAX_SAMPLES, sizeof(int));
+    }
+    /* the first backtrace loads the unwinder (which mallocs) so get that out of the way outside of the signal handler */
+    void* warmUpFrames[4];
+    backtrace(warmUpFrames, 4);
+    if (!profiler.handlerInstalled) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = &profilerSIGPROFHandler;
+        /* so recv/send/accept on the connection threads don't fail with EINTR */
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        if (0 != sigaction(SIGPROF, &action, NULL)) {
+            heapStringAppendFormat(&folded, "Could not install the SIGPROF handler %s = %d\n", strerror(errno), errno);
+            ews_atomic_add64(&profiler.running, -1);
+            return folded;
+        }
+        profiler.handlerInstalled = true;
+    }
+    profiler.samplesCount = 0;
+    ews_atomic_add64(&profiler.collecting, 1);
+    /* ITIMER_PROF counts CPU time of the whole process and the signal goes to a thread that's using the CPU */
+    struct itimerval timer;
+    /* tv_usec has to be under 1000000 so 1 sample per second is tv_sec = 1 */
+    int64_t intervalMicroseconds = 1000000 / samplesPerSecond;
+    timer.it_interval.tv_sec = (time_t) (intervalMicroseconds / 1000000);
+    timer.it_interval.tv_usec = (suseconds_t) (intervalMicroseconds % 1000000);
+    timer.it_value = timer.it_interval;
+    if (0 != setitimer(ITIMER_PROF, &timer, NULL)) {
+        heapStringAppendFormat(&folded, "Could not start the profiling timer. setitimer failed with %s = %d\n", strerror(errno), errno);
+        ews_atomic_add64(&profiler.collecting, -1);
+        ews_atomic_add64(&profiler.running, -1);
+        return folded;
+    }
+    sleepNanoseconds((int64_t) seconds * 1000000000);
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    ews_atomic_add64(&profiler.collecting, -1);
+    /* let handlers that already started on other threads finish writing */
+    sleepNanoseconds(10 * 1000000);
+    int64_t samplesTaken = ews_atomic_add64(&profiler.samplesCount, 0);
+    size_t samplesCount = (size_t) MIN(samplesTaken, (int64_t) PROFILER_MAX_SAMPLES);
+    /* fold: turn each sample into "root;...;leaf", sort and count the runs */
+    char** stacks = (char**) calloc(samplesCount > 0 ? samplesCount : 1, sizeof(char*));
+    size_t stacksCount = 0;
+    for (size_t i = 0; i < samplesCount; i++) {
+        int depth = profiler.depths[i];
+        if (depth <= PROFILER_SKIP_FRAMES) {
+            continue;
+        }
+        void** frames = &profiler.frames[i * PROFILER_MAX_FRAMES];
+        char** symbols = backtrace_symbols(frames, depth);
+        if (NULL == symbols) {
+            continue;
+        }
+        struct HeapString stack;
+        heapStringInit(&stack);
+        for (int frame = depth - 1; frame >= PROFILER_SKIP_FRAMES; frame--) {
+            profilerFrameNameAppend(&stack, symbols[frame]);
+            if (frame > PROFILER_SKIP_FRAMES) {
+                heapStringAppendChar(&stack, ';');
+            }
+        }
+        free(symbols);
+        stacks[stacksCount] = strdup(stack.contents);
+        stacksCount++;
+        heapStringFreeContents(&stack);
+    }
+    ews_atomic_add64(&profiler.running, -1);
+    qsort(stacks, stacksCount, sizeof(char*), profilerStringCompare);
+    for (size_t i = 0; i < stacksCount;) {
+        size_t runEnd = i + 1;
+        while (runEnd < stacksCount && 0 == strcmp(stacks[i], stacks[runEnd])) {
+            runEnd++;
+        }
+        heapStringAppendFormat(&folded, "%s %" PRIu64 "\n", stacks[i], (uint64_t) (runEnd - i));
+        i = runEnd;
+    }
+    for (size_t i = 0; i < stacksCount; i++) {
+        free(stacks[i]);
+    }
+    free(stacks);
+    if (samplesTaken > PROFILER_MAX_SAMPLES) {
+        ews_printf("Warning: the profile only kept the first %d of %" PRId64 " samples. Profile for less time or take fewer samples per second\n", PROFILER_MAX_SAMPLES, samplesTaken);
+    }
+    return folded;
+}
+#else
+struct HeapString profilerFoldedStacksCreate(int seconds, int samplesPerSecond) {
+    struct HeapString folded;
+    heapStringInit(&folded);
+    heapStringAppendString(&folded, "The profiler needs backtrace() from glibc or Mac OS X\n");
+    return folded;
+}
+#endif
+
 static void ignoreSIGPIPE() {
     void* previousSIGPIPEHandler = (void*) signal(SIGPIPE, &SIGPIPEHandler);
     if (NULL != previousSIGPIPEHandler && previousSIGPIPEHandler != &SIGPIPEHandler) {
@@ -2301,6 +7510,7 @@ static int pathInformationGet(const char* path, struct PathInformation* info) {
         if (ENOENT == errno) {
             info->exists = false;
             info->isDirectory = false;
+            info->isSymbolicLink = false;
             return 0;
         }
         return 1;
@@ -2312,12 +7522,287 @@ static int pathInformationGet(const char* path, struct PathInformation* info) {
     } else {
         info->isDirectory = false;
     }
+    struct stat linkStat;
+    info->isSymbolicLink = 0 == lstat(path, &linkStat) && S_ISLNK(linkStat.st_mode);
     return 0;
 }
 
 static FILE* fopen_utf8_path(const char* utf8Path, const char* mode) {
     return fopen(utf8Path, mode);
 }
+
+static int threadPinToCPU(int cpu) {
+#if defined(__linux__) && defined(CPU_SET)
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(cpu, &cpuSet);
+    int result = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+    if (0 != result) {
+        ews_printf("Warning: Could not pin thread to CPU %d. pthread_setaffinity_np returned %s = %d\n", cpu, strerror(result), result);
+        return 1;
+    }
+    return 0;
+#else
+    ews_printf("Warning: Pinning threads to CPU %d is not supported on this platform\n", cpu);
+    return 1;
+#endif
+}
+
+/* Called on the connection's own thread. Without privileges we can only make threads nicer (lower priority), not
+ less nice, so control threads just stay where they are and a bulk thread can't go back up. Errors are ignored */
+static void threadAndSocketSetPriority(sockettype socketfd, ConnectionPriority priority) {
+#if defined(__linux__) && !defined(EWS_FUZZ_TEST)
+    /* on Linux setpriority with a thread id changes just that thread */
+    int nice = ConnectionPriorityBulk == priority ? 10 : 0;
+    setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), nice);
+    /* the queueing discipline sends higher SO_PRIORITY packets first. 0-6 don't need CAP_NET_ADMIN */
+    int socketPriority = ConnectionPriorityControl == priority ? 6 : 0;
+    setsockopt(socketfd, SOL_SOCKET, SO_PRIORITY, &socketPriority, sizeof(socketPriority));
+#elif !defined(EWS_FUZZ_TEST)
+    struct sched_param schedulingParameters;
+    int policy;
+    if (0 == pthread_getschedparam(pthread_self(), &policy, &schedulingParameters)) {
+        int minimum = sched_get_priority_min(policy);
+        int maximum = sched_get_priority_max(policy);
+        schedulingParameters.sched_priority = ConnectionPriorityBulk == priority ? minimum : (minimum + maximum) / 2;
+        pthread_setschedparam(pthread_self(), policy, &schedulingParameters);
+    }
+#endif
+}
+
+static int socketIncomingCPU(sockettype socketfd) {
+#ifdef SO_INCOMING_CPU /* Linux 3.19+ */
+    int cpu = -1;
+    socklen_t cpuLength = sizeof(cpu);
+    if (0 != getsockopt(socketfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &cpuLength)) {
+        ews_printf_debug("getsockopt(SO_INCOMING_CPU) failed with %s = %d\n", strerror(errno), errno);
+        return -1;
+    }
+    return cpu;
+#else
+    return -1;
+#endif
+}
+
+static int64_t monotonicNanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void sleepNanoseconds(int64_t nanoseconds) {
+    struct timespec duration;
+    duration.tv_sec = (time_t) (nanoseconds / 1000000000);
+    duration.tv_nsec = (long) (nanoseconds % 1000000000);
+    while (0 != nanosleep(&duration, &duration) && EINTR == errno) {
+    }
+}
+
+#ifdef __linux__
+/* glibc's struct tcp_info stops at tcpi_total_retrans. The kernel has appended fields since, keeping the layout */
+struct LinuxTCPInfo {
+    struct tcp_info info;
+    uint64_t pacingRate;
+    uint64_t maxPacingRate;
+    uint64_t bytesAcked;
+    uint64_t bytesReceived;
+    uint32_t segmentsOut;
+    uint32_t segmentsIn;
+    uint32_t notSentBytes;
+    uint32_t minRTT;
+    uint32_t dataSegmentsIn;
+    uint32_t dataSegmentsOut;
+    uint64_t deliveryRate;
+};
+#endif
+
+static int socketTCPInfoGet(sockettype socketfd, struct TCPInfoSample* sample) {
+#if defined(__linux__) && !defined(EWS_FUZZ_TEST)
+    struct LinuxTCPInfo tcpInfo;
+    memset(&tcpInfo, 0, sizeof(tcpInfo));
+    socklen_t tcpInfoLength = sizeof(tcpInfo);
+    if (0 != getsockopt(socketfd, IPPROTO_TCP, TCP_INFO, &tcpInfo, &tcpInfoLength)) {
+        return 1;
+    }
+    sample->rttMicroseconds = tcpInfo.info.tcpi_rtt;
+    sample->rttVarianceMicroseconds = tcpInfo.info.tcpi_rttvar;
+    sample->totalRetransmits = tcpInfo.info.tcpi_total_retrans;
+    sample->congestionWindowSegments = tcpInfo.info.tcpi_snd_cwnd;
+    /* kernels before 4.9 don't fill it out */
+    sample->deliveryRateBytesPerSecond = tcpInfoLength >= sizeof(tcpInfo) ? (int64_t) tcpInfo.deliveryRate : -1;
+    return 0;
+#elif defined(__APPLE__) && defined(TCP_CONNECTION_INFO) && !defined(EWS_FUZZ_TEST)
+    struct tcp_connection_info tcpInfo;
+    socklen_t tcpInfoLength = sizeof(tcpInfo);
+    if (0 != getsockopt(socketfd, IPPROTO_TCP, TCP_CONNECTION_INFO, &tcpInfo, &tcpInfoLength)) {
+        return 1;
+    }
+    /* these are in milliseconds and bytes */
+    sample->rttMicroseconds = (int64_t) tcpInfo.tcpi_srtt * 1000;
+    sample->rttVarianceMicroseconds = (int64_t) tcpInfo.tcpi_rttvar * 1000;
+    sample->totalRetransmits = (int64_t) tcpInfo.tcpi_txretransmitpackets;
+    sample->congestionWindowSegments = tcpInfo.tcpi_maxseg > 0 ? (int64_t) (tcpInfo.tcpi_snd_cwnd / tcpInfo.tcpi_maxseg) : -1;
+    sample->deliveryRateBytesPerSecond = -1;
+    return 0;
+#else
+    return 1;
+#endif
+}
+
+static bool socketPeerClosed(sockettype socketfd) {
+#ifdef EWS_FUZZ_TEST
+    /* the fuzzer's socket is stdin, there's nobody to hang up */
+    return false;
+#else
+    struct pollfd pollDescriptor;
+    pollDescriptor.fd = socketfd;
+    pollDescriptor.events = POLLIN;
+#ifdef POLLRDHUP /* Linux tells us about the FIN directly */
+    pollDescriptor.events |= POLLRDHUP;
+#endif
+    pollDescriptor.revents = 0;
+    if (poll(&pollDescriptor, 1, 0) <= 0) {
+        return false;
+    }
+    if (pollDescriptor.revents & (POLLERR | POLLHUP)) {
+        return true;
+    }
+#ifdef POLLRDHUP
+    if (pollDescriptor.revents & POLLRDHUP) {
+        return true;
+    }
+#endif
+    if (pollDescriptor.revents & POLLIN) {
+        /* readable: either there's data (pipelined bytes), an orderly shutdown (0) or an error like ECONNRESET */
+        char peekedByte;
+        ssize_t peekResult = recv(socketfd, &peekedByte, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (0 == peekResult) {
+            return true;
+        }
+        if (peekResult < 0 && EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno) {
+            return true;
+        }
+    }
+    return false;
+#endif
+}
+
+static int fileMapReadOnly(const char* path, void** mappingOut, size_t* lengthOut) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        ews_printf("Could not open '%s'. %s = %d\n", path, strerror(errno), errno);
+        return 1;
+    }
+    struct stat st;
+    if (0 != fstat(fd, &st) || 0 == st.st_size) {
+        ews_printf("Could not get the size of '%s' or it's empty. %s = %d\n", path, strerror(errno), errno);
+        close(fd);
+        return 1;
+    }
+    void* mapping = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == mapping) {
+        ews_printf("Could not mmap '%s'. %s = %d\n", path, strerror(errno), errno);
+        return 1;
+    }
+    *mappingOut = mapping;
+    *lengthOut = (size_t) st.st_size;
+    return 0;
+}
+
+static void fileUnmap(void* mapping, size_t length) {
+    munmap(mapping, length);
+}
+
+/* Is the segment owned by a process that's gone? The owner keeps its process ID at processIDOffset. A segment with no
+ process ID yet is being set up by someone, so it isn't */
+static bool sharedMemoryOwnerDied(const char* name, size_t processIDOffset) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    size_t mappingLength = processIDOffset + sizeof(int64_t);
+    if (0 != fstat(fd, &st) || (size_t) st.st_size < mappingLength) {
+        close(fd);
+        return false;
+    }
+    void* mapping = mmap(NULL, mappingLength, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == mapping) {
+        return false;
+    }
+    int64_t ownerProcessID;
+    memcpy(&ownerProcessID, (const char*) mapping + processIDOffset, sizeof(ownerProcessID));
+    munmap(mapping, mappingLength);
+    return ownerProcessID > 0 && ownerProcessID != processID() && 0 != kill((pid_t) ownerProcessID, 0) && ESRCH == errno;
+}
+
+/* Only this user can read it. If a live process already has name we fail rather than pull it out from under them */
+static void* sharedMemoryCreate(const char* name, size_t length, size_t processIDOffset) {
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0 && EEXIST == errno && sharedMemoryOwnerDied(name, processIDOffset)) {
+        ews_printf("Replacing the shared memory segment '%s' left behind by a process that exited\n", name);
+        shm_unlink(name);
+        fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    }
+    if (fd < 0) {
+        ews_printf("Could not create the shared memory segment '%s'%s. %s = %d\n", name, EEXIST == errno ? " because another process is using it" : "", strerror(errno), errno);
+        return NULL;
+    }
+    if (0 != ftruncate(fd, (off_t) length)) {
+        ews_printf("Could not size the shared memory segment '%s' to %" PRIu64 " bytes. %s = %d\n", name, (uint64_t) length, strerror(errno), errno);
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    void* mapping = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == mapping) {
+        ews_printf("Could not mmap the shared memory segment '%s'. %s = %d\n", name, strerror(errno), errno);
+        shm_unlink(name);
+        return NULL;
+    }
+    return mapping;
+}
+
+static void sharedMemoryDestroy(const char* name, void* mapping, size_t length) {
+    munmap(mapping, length);
+    shm_unlink(name);
+}
+
+static int64_t processID() {
+    return (int64_t) getpid();
+}
+
+/* Returns how many bytes we asked the OS to read ahead (0 if the file's too big), or -1 if it couldn't be opened or isn't a
+ regular file. O_NONBLOCK is so opening a FIFO with no writer doesn't block the warm thread forever */
+static int64_t fileWarm(const char* path, int64_t maxFileSize) {
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (0 != fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size > maxFileSize) {
+        close(fd);
+        return 0;
+    }
+#if defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+#elif defined(F_RDADVISE)
+    struct radvisory advice;
+    advice.ra_offset = 0;
+    advice.ra_count = (int) st.st_size;
+    fcntl(fd, F_RDADVISE, &advice);
+#endif
+    close(fd);
+    return st.st_size;
+}
 #endif // WIN32 or Linux/Mac OS X
 
 #endif // EWS_HEADER_ONLY
+#endif // EWS_STATS_SEGMENT_ONLY